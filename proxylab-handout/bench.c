@@ -0,0 +1,185 @@
+/*
+* Microbenchmark of request head processing.
+*
+* Times, on a request as a current browser sends it:
+*   legacy  - the proxy's old read_headers(): lines copied out a byte at
+*             a time, as rio_readlineb does, then a chain of strncmp
+*   scalar, sse2, avx2 - http_parse_request with each byte scanner
+* and the classification of header names by a linear strncasecmp
+* search against the hash table of http_header_id.
+*
+* Usage: ./bench [iterations]
+* (build with optimization for meaningful numbers, e.g.
+*  make clean bench CFLAGS="-O2 -Wall")
+*/
+#include <time.h>
+#include "csapp.h"
+#include "http.h"
+
+static const char request[] =
+    "GET http://www.example.com/articles/2026/10/index.html?ref=home HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/129.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8,"
+    "application/signed-exchange;v=b3;q=0.7\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: en-US,en;q=0.9,fr;q=0.8\r\n"
+    "Cookie: session=7f3a9c2e41b84d0f9e6a5c3b2d1e0f4a; theme=dark; "
+    "_ga=GA1.2.1234567890.1700000000; _gid=GA1.2.987654321.1700000000; "
+    "consent=analytics%3Dtrue%2Cads%3Dfalse\r\n"
+    "If-None-Match: \"5e8f-61a2b3c4d5e6f\"\r\n"
+    "If-Modified-Since: Sat, 17 Oct 2026 09:12:44 GMT\r\n"
+    "\r\n";
+
+/* Keeps the compiler from optimizing the measured work away */
+static volatile size_t sink;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+* The removed read_headers() over an in-memory request: each line is
+* copied out byte by byte, then matched against the headers the proxy
+* replaces.
+*/
+static size_t legacy_read_headers(const char *req, size_t len)
+{
+    char buf[MAXLINE], host_header[MAXLINE], other_headers[MAXLINE];
+    size_t pos = 0, other = 0, n;
+
+    while (pos < len)
+    {
+        for (n = 0; pos < len && n < MAXLINE - 1; )
+        {
+            char c = req[pos++];
+            buf[n++] = c;
+            if (c == '\n')
+                break;
+        }
+        buf[n] = '\0';
+        if (!strcmp(buf, "\r\n"))
+            break;
+
+        if (!strncmp(buf, "Host: ", strlen("Host: ")))
+            strcpy(host_header, buf + strlen("Host: "));
+        if (strncmp(buf, "User-Agent: ", strlen("User-Agent: ")) &&
+            strncmp(buf, "Accept: ", strlen("Accept: ")) &&
+            strncmp(buf, "Accept-Encoding: ", strlen("Accept-Encoding: ")) &&
+            strncmp(buf, "Connection: ", strlen("Connection: ")) &&
+            strncmp(buf, "Proxy-Connection: ", strlen("Proxy-Connection: ")))
+        {
+            memcpy(other_headers + other, buf, n);
+            other += n;
+        }
+    }
+
+    return other + host_header[0];
+}
+
+/*
+* The old http_header_id: one comparison per known name.
+*/
+static int linear_header_id(const char *name, size_t len)
+{
+    static const char *names[] = {
+        "Host", "User-Agent", "Accept", "Accept-Encoding", "Connection",
+        "Proxy-Connection", "Keep-Alive", "Range", "Content-Length",
+        "Transfer-Encoding", "If-None-Match", "If-Modified-Since"
+    };
+    int i;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (strlen(names[i]) == len && !strncasecmp(name, names[i], len))
+            return i + 1;
+    }
+
+    return HTTP_HDR_OTHER;
+}
+
+static void report(const char *what, double secs, long iters)
+{
+    printf("%-12s %8.1f ns/request  %8.0f MB/s\n", what,
+           secs * 1e9 / iters, sizeof(request) * iters / secs / 1e6);
+}
+
+static void bench_parser(const char *scanner, long iters)
+{
+    http_request req;
+    double start;
+    long i;
+
+    if (http_use_scanner(scanner) < 0)
+    {
+        printf("%-12s not supported on this CPU\n", scanner);
+        return;
+    }
+
+    start = now();
+    for (i = 0; i < iters; i++)
+    {
+        http_request_init(&req);
+        if (http_parse_request(&req, request, sizeof(request) - 1) !=
+            HTTP_PARSE_DONE)
+        {
+            fprintf(stderr, "parse failed\n");
+            exit(1);
+        }
+        sink += req.head_len + req.nheaders;
+    }
+    report(scanner, now() - start, iters);
+}
+
+int main(int argc, char **argv)
+{
+    long iters = argc > 1 ? atol(argv[1]) : 1000000;
+    http_request req;
+    double start;
+    long i;
+    int h;
+
+    http_init();
+    printf("%zu byte request, %ld iterations, default scanner %s\n\n",
+           sizeof(request) - 1, iters, http_scanner());
+
+    start = now();
+    for (i = 0; i < iters; i++)
+        sink += legacy_read_headers(request, sizeof(request) - 1);
+    report("legacy", now() - start, iters);
+
+    bench_parser("scalar", iters);
+    bench_parser("sse2", iters);
+    bench_parser("avx2", iters);
+
+    //classification alone, over the names of the request's headers
+    http_init();
+    http_request_init(&req);
+    http_parse_request(&req, request, sizeof(request) - 1);
+
+    start = now();
+    for (i = 0; i < iters; i++)
+        for (h = 0; h < req.nheaders; h++)
+            sink += linear_header_id(req.headers[h].name.p,
+                                     req.headers[h].name.len);
+    printf("\n%-12s %8.1f ns/request\n", "linear ids",
+           (now() - start) * 1e9 / iters);
+
+    start = now();
+    for (i = 0; i < iters; i++)
+        for (h = 0; h < req.nheaders; h++)
+            sink += http_header_id(req.headers[h].name.p,
+                                   req.headers[h].name.len);
+    printf("%-12s %8.1f ns/request\n", "hashed ids",
+           (now() - start) * 1e9 / iters);
+
+    return 0;
+}
@@ -5,6 +5,9 @@ and the maximum size of web objects to be cached */
 
 #include "cache.h"
 #include "csapp.h"
+#include "http.h"
+#include "msg.h"
+#include "compress.h"
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -27,22 +30,296 @@ timestamp indicating when it was last used */
 
 /* Defining Global variables */
 unsigned int timecounter = 0;
+unsigned int cache_compress_min = 0;
 
 //Create and initialize the rw lock
 pthread_rwlock_t lock;
 
+//The content-addressed body store, chained by hash
+static body_blob* blobs[BLOB_BUCKETS];
+
+static void unlinkObject(cache_LL* cache, web_object* prev, web_object* obj);
+static void releaseBlob(cache_LL* cache, body_blob* blob);
+static void freeObject(cache_LL* cache, web_object* obj);
+
 void cache_init()
 {
     pthread_rwlock_init(&lock, 0);
 }
 
 
+/* copy_bytes:
+*   Returns a freshly allocated, NUL terminated copy of the len bytes
+*   starting at src.
+*/
+static char* copy_bytes(const char* src, size_t len)
+{
+    char* copy = Malloc(len + 1);
+    memcpy(copy, src, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/* vary_names:
+*   Extracts the Vary header of a response as a comma separated list of
+*   lowercased header names with the whitespace removed, so that two
+*   responses listing the same headers produce the same string.
+*   Returns NULL if the response does not vary.
+*/
+static char* vary_names(const char* data, unsigned int size)
+{
+    size_t vlen, i, n = 0;
+    const char* value = http_find_header(data, size, "Vary", &vlen);
+
+    if(value == NULL || vlen == 0)
+        return NULL;
+
+    char* names = Malloc(vlen + 1);
+    for(i = 0; i < vlen; i++)
+    {
+        if(!isspace((unsigned char)value[i]))
+            names[n++] = tolower((unsigned char)value[i]);
+    }
+    names[n] = '\0';
+
+    return names;
+}
+
+/* vary_key:
+*   Builds the secondary key of a variant: for every header named in
+*   vary, the value that header has in the upstream request req (empty
+*   if missing),
+*   as "name=value" lines. Two requests select the same variant exactly
+*   when their keys are equal.
+*/
+static char* vary_key(const char* vary, const msg* req)
+{
+    char key[MAXLINE], name[MAXLINE];
+    size_t keylen = 0;
+    const char* cursor = vary;
+
+    while(*cursor)
+    {
+        size_t nlen = strcspn(cursor, ",");
+        size_t vlen = 0;
+        const char* value = NULL;
+
+        if(nlen > 0 && nlen < sizeof(name))
+        {
+            memcpy(name, cursor, nlen);
+            name[nlen] = '\0';
+            if(req != NULL)
+                value = msg_find_header(req, name, &vlen);
+
+            //names and values that do not fit are truncated
+            keylen += snprintf(key + keylen, sizeof(key) - keylen,
+                               "%s=%.*s\n", name, (int)vlen,
+                               value ? value : "");
+            if(keylen >= sizeof(key))
+                keylen = sizeof(key) - 1;
+        }
+
+        cursor += nlen;
+        if(*cursor == ',')
+            cursor++;
+    }
+
+    return copy_bytes(key, keylen);
+}
+
+
+/* cache_hash:
+*   Continues the 64-bit FNV-1a hash h over the n bytes at buf. Start
+*   from CACHE_HASH_INIT; feeding a body in pieces gives the same hash
+*   as feeding it at once, so it can be computed while it streams in.
+*/
+unsigned long cache_hash(unsigned long h, const char* buf, size_t n)
+{
+    const unsigned char* p = (const unsigned char*)buf;
+    size_t i;
+
+    for(i = 0; i < n; i++)
+    {
+        h ^= p[i];
+        h *= 1099511628211UL;
+    }
+
+    return h;
+}
+
+/* sameBody:
+*   Checks that blob really holds the bytes of body; equal hashes are
+*   only a hint. A compressed blob is inflated for the comparison.
+*/
+static int sameBody(body_blob* blob, const chain* body)
+{
+    if(blob->logical_size != body->len)
+        return 0;
+    if(!blob->compressed)
+        return chain_equal(&blob->data, body);
+
+    //view the inflated copy as a one segment chain to compare it
+    unsigned int n = body->len;
+    chain_seg seg = { Malloc(n > 0 ? n : 1), 0, n, n, NULL };
+    chain plain = { &seg, &seg, n };
+    int same = gzip_decompress(&blob->data, seg.data, n) == n &&
+               chain_equal(&plain, body);
+    free(seg.data);
+    return same;
+}
+
+/* holdBlob:
+*   Looks up a stored body of n bytes whose hash is hash and takes a
+*   reference on it, so that it stays put while it is compared with
+*   sameBody. Returns NULL if there is none.
+*   The caller must hold the cache lock.
+*/
+static body_blob* holdBlob(cache_LL* cache, unsigned long hash,
+                           unsigned int n)
+{
+    body_blob* blob;
+
+    for(blob = blobs[hash % BLOB_BUCKETS]; blob != NULL; blob = blob->next)
+    {
+        if(blob->hash == hash && blob->logical_size == n)
+        {
+            blob->refcount++;
+            cache->dedup_saved += blob->size;
+            return blob;
+        }
+    }
+
+    return NULL;
+}
+
+/* findBlob:
+*   Looks up a stored body identical to body, whose hash is hash, and
+*   takes a reference on it. Returns NULL if there is none. The bytes
+*   are compared (and a compressed body inflated) without the cache
+*   lock, which the caller must not hold.
+*/
+static body_blob* findBlob(cache_LL* cache, unsigned long hash,
+                           const chain* body)
+{
+    pthread_rwlock_wrlock(&lock);
+    body_blob* blob = holdBlob(cache, hash, body->len);
+    pthread_rwlock_unlock(&lock);
+
+    if(blob == NULL)
+        return NULL;
+
+    //a stored body is never changed, and the reference keeps it stored
+    int same = sameBody(blob, body);
+
+    pthread_rwlock_wrlock(&lock);
+    if(same)
+        cache->dedup_hits++;
+    else
+        releaseBlob(cache, blob);
+    pthread_rwlock_unlock(&lock);
+
+    if(!same)
+        return NULL;
+    dbg_printf("CACHE >> Sharing stored body of %u bytes\n", blob->size);
+    return blob;
+}
+
+/* makeBlob:
+*   Creates an unshared body from the chain body, which it takes over:
+*   the segments the body was read into are kept as they are. Large
+*   text bodies are instead stored gzipped (see http_compressible), but only
+*   if that saves at least an eighth of the body. headers is the header
+*   block of the response the body came with. The blob is not yet in
+*   the store; this is done without the cache lock.
+*/
+static body_blob* makeBlob(const char* headers, unsigned int headerSize,
+                           chain* body, unsigned long hash)
+{
+    body_blob* blob = Calloc(1, sizeof(body_blob));
+    unsigned int n = body->len;
+
+    blob->hash = hash;
+    blob->logical_size = n;
+    blob->refcount = 1;
+    chain_init(&blob->data);
+
+    if(cache_compress_min > 0 && n >= cache_compress_min &&
+       http_compressible(headers, headerSize) &&
+       !gzip_compress(body, &blob->data, CACHE_COMPRESS_LEVEL))
+    {
+        if(blob->data.len < n - n / 8)
+        {
+            dbg_printf("CACHE >> Compressed body from %u to %u bytes\n",
+                       n, blob->data.len);
+            blob->size = blob->data.len;
+            blob->compressed = 1;
+            chain_free(body);
+            return blob;
+        }
+        chain_free(&blob->data);
+    }
+
+    //No copy: the blob owns the segments from now on
+    chain_trim(body);
+    blob->data = *body;
+    blob->size = n;
+    chain_init(body);
+    return blob;
+}
+
+/* gzipBlob:
+*   Makes the unshared blob holding the gzip stream in the chain
+*   gzipped, which it takes over, of a body of logicalSize bytes.
+*/
+static body_blob* gzipBlob(chain* gzipped, unsigned int logicalSize)
+{
+    body_blob* blob = Calloc(1, sizeof(body_blob));
+
+    chain_trim(gzipped);
+    blob->data = *gzipped;
+    blob->size = gzipped->len;
+    blob->logical_size = logicalSize;
+    blob->compressed = 1;
+    blob->refcount = 1;
+    chain_init(gzipped);
+    return blob;
+}
+
+/* releaseBlob:
+*   Drops one object's reference to blob, freeing it and removing it
+*   from the store once no object uses it.
+*   The caller must hold the cache lock.
+*/
+static void releaseBlob(cache_LL* cache, body_blob* blob)
+{
+    blob->refcount--;
+    if(blob->refcount > 0)
+    {
+        cache->dedup_saved -= blob->size;
+        return;
+    }
+
+    body_blob** link = &blobs[blob->hash % BLOB_BUCKETS];
+    while(*link != blob)
+        link = &(*link)->next;
+    *link = blob->next;
+
+    cache->size -= blob->size;
+    chain_free(&blob->data);
+    free(blob);
+}
+
+
 /* checkCache: 
 *   This function goes through the singly linked list
 *   object by object and checks if the path of that object
-*   is the same as the one we are searching for.
+*   is the same as the one we are searching for. Objects stored
+*   with a Vary header only match if the headers they vary on have
+*   the same values in the upstream request req as in the one that filled
+*   them. A found object must be handed back with releaseObject()
+*   once it has been sent.
 */
-web_object* checkCache(cache_LL* cache, char* path) 
+web_object* checkCache(cache_LL* cache, char* path, const msg* req)
 {
     pthread_rwlock_wrlock(&lock);
     dbg_printf("\nCACHE >> Checking Cache for %s\n", path);
@@ -56,11 +333,26 @@ web_object* checkCache(cache_LL* cache, char* path)
         dbg_printf("CACHE >> Compare to %s\n", cursor->path);
 
         if(!strcmp(cursor->path, path)) {
-            //the object at cursor has just been used! 
-            //change its timestamp to reflect the current time
-            cursor->timestamp = timecounter;
-            dbg_printf("CACHE >> Found in cache!\n");
-            return cursor;
+            int match = 1;
+
+            if(cursor->vary != NULL)
+            {
+                char* key = vary_key(cursor->vary, req);
+                match = !strcmp(key, cursor->vary_key);
+                free(key);
+                dbg_printf("CACHE >> Variant on %s %s\n", cursor->vary,
+                           match ? "matches" : "differs");
+            }
+
+            if(match) {
+                //the object at cursor has just been used! 
+                //change its timestamp to reflect the current time
+                cursor->timestamp = timecounter;
+                cursor->refcount++;
+                dbg_printf("CACHE >> Found in cache!\n");
+                pthread_rwlock_unlock(&lock);
+                return cursor;
+            }
         }
 
         cursor = cursor->next;
@@ -73,16 +365,271 @@ web_object* checkCache(cache_LL* cache, char* path)
 }
 
 
+/* invalidateCache:
+*   Removes every variant of path from the cache, after a request that
+*   may have changed the resource (a POST, PUT, ...) went through.
+*/
+void invalidateCache(cache_LL* cache, char* path)
+{
+    pthread_rwlock_wrlock(&lock);
+
+    web_object* prev = NULL;
+    web_object* cursor = cache->head;
+    while(cursor != NULL)
+    {
+        web_object* next = cursor->next;
+        if(!strcmp(cursor->path, path))
+        {
+            dbg_printf("CACHE >> Invalidating %s\n", path);
+            unlinkObject(cache, prev, cursor);
+        }
+        else
+            prev = cursor;
+        cursor = next;
+    }
+
+    pthread_rwlock_unlock(&lock);
+}
+
+
+/* gzipBody:
+*   Returns the gzipped body of obj, for a client accepting gzip, or
+*   NULL if it has none: either it is not stored compressed and
+*   compressing it now is over the CPU budget (or doesn't save at
+*   least an eighth), or obj is not compressible at all. The copy
+*   made here is kept with obj, so the body is compressed only once.
+*   The caller holds a reference on obj, which keeps the copy alive.
+*/
+body_blob* gzipBody(cache_LL* cache, web_object* obj)
+{
+    body_blob* body = obj->body;
+    body_blob* zipped;
+    gzip_stream z;
+    chain_seg* seg;
+    chain out;
+
+    if(body->compressed)
+        return body;
+
+    pthread_rwlock_rdlock(&lock);
+    zipped = obj->gzip;
+    int tried = obj->gzip_tried;
+    pthread_rwlock_unlock(&lock);
+
+    if(zipped != NULL || tried || gzip_level == 0 ||
+       body->size < GZIP_MIN_LENGTH ||
+       !http_compressible(obj->data, obj->header_size) || !gzip_budget_ok())
+        return zipped;
+
+    //compressed outside the lock; a reader doing the same meanwhile
+    //loses and drops its copy
+    chain_init(&out);
+    if(gzip_stream_init(&z, gzip_level) < 0)
+        return NULL;
+    int failed = 0;
+    for(seg = body->data.head; seg != NULL && !failed; seg = seg->next)
+        failed = gzip_stream_write(&z, seg->data + seg->off, seg->len,
+                                   seg->next == NULL, &out) < 0;
+    gzip_stream_end(&z);
+
+    pthread_rwlock_wrlock(&lock);
+    obj->gzip_tried = 1;
+    if(!failed && obj->gzip == NULL && !obj->evicted &&
+       out.len < body->size - body->size / 8)
+    {
+        dbg_printf("CACHE >> Gzipped %s from %u to %u bytes\n", obj->path,
+                   body->size, out.len);
+        obj->gzip = gzipBlob(&out, body->logical_size);
+        cache->size += obj->gzip->size;
+        while(cache->size > MAX_CACHE_SIZE && cache->head != NULL)
+            evictAnObject(cache);
+    }
+    zipped = obj->gzip;
+    pthread_rwlock_unlock(&lock);
+
+    chain_free(&out);
+    return zipped;
+}
+
+
+/* releaseObject:
+*   Drops the reference taken by checkCache. An object that was
+*   evicted while it was being sent is freed by its last reader.
+*/
+void releaseObject(cache_LL* cache, web_object* obj)
+{
+    pthread_rwlock_wrlock(&lock);
+
+    obj->refcount--;
+    if(obj->evicted && obj->refcount == 0)
+    {
+        dbg_printf("CACHE >> Freeing released object %s\n", obj->path);
+        freeObject(cache, obj);
+    }
+
+    pthread_rwlock_unlock(&lock);
+}
+
+/* printCacheStats:
+*   Prints the cache occupancy and what body sharing saves. The
+*   counters are read without the lock since this is called from a
+*   signal handler, which may interrupt a thread holding it.
+*/
+void printCacheStats(cache_LL* cache, FILE* out)
+{
+    fprintf(out, "cache bytes: %u of %u\n", cache->size, MAX_CACHE_SIZE);
+    fprintf(out, "cache shared bodies: %lu\n", cache->dedup_hits);
+    fprintf(out, "cache bytes saved by sharing: %lu\n", cache->dedup_saved);
+}
+
+
+/* makeRoom:
+*   Drops the entry that a new object for path, with Vary names vary
+*   and key key (both NULL without Vary), replaces, and evicts the
+*   least recently used other variants of path until the new one fits
+*   within MAX_VARIANTS. The caller must hold the cache lock.
+*/
+static void makeRoom(cache_LL* cache, char* path, const char* vary,
+                     const char* key)
+{
+    web_object* prev = NULL;
+    web_object* cursor = cache->head;
+    int variants = 0;
+    while(cursor != NULL)
+    {
+        web_object* next = cursor->next;
+
+        if(!strcmp(cursor->path, path))
+        {
+            //an object without Vary replaces every variant and the other
+            //way round, since the origin changed how it negotiates
+            if(vary == NULL || cursor->vary == NULL ||
+               !strcmp(cursor->vary_key, key))
+            {
+                dbg_printf("CACHE >> Replacing old copy of %s\n", path);
+                unlinkObject(cache, prev, cursor);
+                cursor = next;
+                continue;
+            }
+            variants++;
+        }
+
+        prev = cursor;
+        cursor = next;
+    }
+
+    //bound the number of variants per URL by evicting the LRU one
+    while(variants >= MAX_VARIANTS)
+    {
+        web_object* victim = NULL;
+        web_object* victimPrev = NULL;
+
+        prev = NULL;
+        for(cursor = cache->head; cursor != NULL; cursor = cursor->next)
+        {
+            if(!strcmp(cursor->path, path) &&
+               (victim == NULL || cursor->timestamp < victim->timestamp))
+            {
+                victim = cursor;
+                victimPrev = prev;
+            }
+            prev = cursor;
+        }
+
+        dbg_printf("CACHE >> Too many variants, evicting one.\n");
+        unlinkObject(cache, victimPrev, victim);
+        variants--;
+    }
+}
+
 /* addToCache: 
 *   This function creates a new object and adds the information
 *   regarding the object. This object is then inserted at the
 *   start of the singly linked list representing the cache.
+*   The new object replaces the variant of path that the upstream
+*   request req selects; if path already has MAX_VARIANTS other variants the
+*   least recently used of them is evicted first. Responses with
+*   "Vary: *", partial (206) or 304 responses and responses whose header
+*   block does not fit in the first segment of the chain are never
+*   cached.
+*   The cache takes over the chain holding the response, which is left
+*   empty: its segments become the stored body unless an identical body
+*   is stored already. bodyHash is cache_hash() of the body, i.e. of
+*   the response past its header block. gzipped, if not NULL, is the
+*   body as gzipped for the client on the way in; it becomes the gzip
+*   copy of the object (and is left empty) unless the body is stored
+*   compressed anyway.
 */
-void addToCache(cache_LL* cache, char* data, char* path, unsigned int addSize)
+void addToCache(cache_LL* cache, chain* response, char* path,
+                const msg* req, unsigned long bodyHash, chain* gzipped)
 {
+    unsigned int addSize = response->len;
+    unsigned int headerSize = 0;
+
+    if(response->head != NULL)
+        headerSize = http_header_end(response->head->data + response->head->off,
+                                     response->head->len);
+    if(headerSize == 0)
+    {
+        chain_free(response);
+        return;
+    }
+
+    char* data = response->head->data + response->head->off;
+    char* vary = vary_names(data, headerSize);
+    char* key = NULL;
+
+    if(vary != NULL && strchr(vary, '*') != NULL)
+    {
+        dbg_printf("\nCACHE >> Not caching %s (Vary: *)\n", path);
+        free(vary);
+        chain_free(response);
+        return;
+    }
+    if(vary != NULL)
+        key = vary_key(vary, req);
+
+    //The object keeps its own copy of the headers; what is left of the
+    //chain is the body
+    char* headers = Malloc(headerSize);
+    memcpy(headers, data, headerSize);
+
+    //Partial and not-modified responses are not the object itself
+    http_meta meta;
+    if(http_parse_meta(headers, headerSize, &meta) < 0 ||
+       meta.status == 206 || meta.status == 304)
+    {
+        dbg_printf("\nCACHE >> Not caching %s (status %d)\n", path, meta.status);
+        free(headers);
+        free(vary);
+        free(key);
+        chain_free(response);
+        return;
+    }
+    chain_consume(response, headerSize);
+
+    //Share the body if an identical one is stored already, otherwise
+    //build a new one (possibly compressing it) without holding the lock
+    body_blob* blob = findBlob(cache, bodyHash, response);
+
+    int newBlob = (blob == NULL);
+    if(newBlob)
+        blob = makeBlob(headers, headerSize, response, bodyHash);
+    else
+        chain_free(response);
+
     pthread_rwlock_wrlock(&lock);   
     dbg_printf("\nCACHE >> Adding to cache: %s\n", path);
 
+    if(newBlob)
+    {
+        body_blob** bucket = &blobs[bodyHash % BLOB_BUCKETS];
+        blob->next = *bucket;
+        *bucket = blob;
+        cache->size += blob->size;
+    }
+
+    makeRoom(cache, path, vary, key);
 
     dbg_printf("CACHE >> Allocating %lu bytes for new web_object.\n", sizeof(web_object));
     //toAdd will hold all the information regarding the new web object
@@ -93,12 +640,19 @@ void addToCache(cache_LL* cache, char* data, char* path, unsigned int addSize)
     dbg_printf("CACHE >> Creating cache object.\n");
 
 
-    toAdd->data = Calloc(1, MAX_OBJECT_SIZE);
-    dbg_printf("CACHE >> Attempting adding data of size %d\n", addSize);
-    dbg_printf(" to field of size %lu\n", sizeof(toAdd->data));
-    //We use memcpy because we have to treat data as a byte array, not a string
-    memcpy(toAdd->data, data, addSize);
-    dbg_printf("CACHE >> Copied data.\n");
+    //The object keeps its own headers and points at the shared body
+    toAdd->data = headers;
+    toAdd->header_size = headerSize;
+    toAdd->meta = meta;
+    toAdd->stored = time(NULL);
+    toAdd->body = blob;
+    if(gzipped != NULL && gzipped->len > 0 && !blob->compressed)
+    {
+        toAdd->gzip = gzipBlob(gzipped, blob->logical_size);
+        toAdd->gzip_tried = 1;
+        cache->size += toAdd->gzip->size;
+    }
+    dbg_printf("CACHE >> Copied headers.\n");
     //update the time stamp of the new object to reflect the current time
     toAdd->timestamp = timecounter;
     dbg_printf("CACHE >> Updated timestamp.\n");
@@ -106,11 +660,15 @@ void addToCache(cache_LL* cache, char* data, char* path, unsigned int addSize)
     toAdd->path = Calloc(1, MAXLINE);
     strcpy(toAdd->path, path);
     dbg_printf("CACHE >> Copied path.\n");
-    //update the size of the new object
-    toAdd->size = addSize;
+    toAdd->vary = vary;
+    toAdd->vary_key = key;
+    //update the size of the new object: size is what it occupies in
+    //the cache, logical_size the size of the response as received
+    toAdd->size = headerSize + blob->size;
+    toAdd->logical_size = addSize;
     dbg_printf("CACHE >> Updated size.\n");
-    //Increment the cache size
-    cache->size += addSize;
+    //Increment the cache size; the body was counted when it was stored
+    cache->size += headerSize;
     dbg_printf("CACHE >> Incremented cache size.\n");
 
     //Adding the object to the head of the linked list representing the cache
@@ -123,7 +681,8 @@ void addToCache(cache_LL* cache, char* data, char* path, unsigned int addSize)
 
     //If the addition of this object has caused the cache to exceed the
     //max size, we evict objects until the cache is of a proper size
-    while(cache->size > MAX_CACHE_SIZE)
+    //(bodies still being sent are only released by their last reader)
+    while(cache->size > MAX_CACHE_SIZE && cache->head != NULL)
     {
         evictAnObject(cache);
     }
@@ -132,72 +691,403 @@ void addToCache(cache_LL* cache, char* data, char* path, unsigned int addSize)
     pthread_rwlock_unlock(&lock);
 }
 
+/* unlinkObject:
+*   Removes obj (whose predecessor is prev, NULL for the head) from the
+*   cache list. Its memory is released right away unless a reader still
+*   holds it, in which case releaseObject frees it later.
+*   The caller must hold the cache lock.
+*/
+static void unlinkObject(cache_LL* cache, web_object* prev, web_object* obj)
+{
+    if(prev == NULL)
+        cache->head = obj->next;
+    else
+        prev->next = obj->next;
+
+    obj->evicted = 1;
+
+    if(obj->refcount == 0)
+        freeObject(cache, obj);
+}
+
+/* freeObject:
+*   Releases an unlinked object and its reference to its body.
+*   The caller must hold the cache lock.
+*/
+static void freeObject(cache_LL* cache, web_object* obj)
+{
+    cache->size -= obj->header_size;
+    releaseBlob(cache, obj->body);
+    if(obj->gzip != NULL)
+    {
+        cache->size -= obj->gzip->size;
+        chain_free(&obj->gzip->data);
+        free(obj->gzip);
+    }
+
+    //since i've allocated memory for these fields, I need to free them
+    free(obj->data);
+    free(obj->path);
+    free(obj->vary);
+    free(obj->vary_key);
+    free(obj);
+}
+
 /* evictAnObject:
-*   We use the LRU policy to evict objects. We first traverse
-*   through the list to find the minimum time at which an
-*   object was used. We then traverse through the list again
-*   to find the object matching that timestamp and remove it 
+*   We use the LRU policy to evict objects. We traverse through
+*   the list to find the object with the minimum time at which it
+*   was used, remembering the object before it, and remove it
 *   from the linked list representing the cache.
+*   The caller must hold the cache lock.
 */
 void evictAnObject (cache_LL* cache)
 {
-    pthread_rwlock_wrlock(&lock);
     dbg_printf("CACHE >> Evicting from cache.\n");
 
-    unsigned int leastRecentTime = cache->head->timestamp;
-    web_object* cursor = cache->head;
-    //The following while loop finds the exact timestamp of the least
-    //recently used web object by iterating through the cache
+    if(cache->head == NULL)
+        return;
+
+    web_object* victim = cache->head;
+    web_object* victimPrev = NULL;
+    web_object* prev = cache->head;
+    web_object* cursor = cache->head->next;
+    //The following while loop finds the least recently used
+    //web object by iterating through the cache
 
     while(cursor != NULL)
     {
-        if(cursor->timestamp < leastRecentTime)
-            leastRecentTime = cursor->timestamp;
+        if(cursor->timestamp < victim->timestamp)
+        {
+            victim = cursor;
+            victimPrev = prev;
+        }
+        prev = cursor;
         cursor = cursor->next;
     }
 
-    //reset the cursor
-    cursor = cache->head;
+    unlinkObject(cache, victimPrev, victim);
+}
+
+/* A cached object as cache_export writes it, followed by its path,
+   headers, Vary names and key (if vary_len isn't -1) and, unless it
+   shares the body of the earlier record shares, the body_size bytes
+   of its body as stored */
+typedef struct cache_record{
+  unsigned int path_len;
+  unsigned int header_size;
+  int vary_len;
+  int key_len;
+  int shares;
+  unsigned int body_size;
+  unsigned int body_logical;
+  int compressed;
+  unsigned long hash;
+  unsigned int logical_size;
+  time_t stored;
+} cache_record;
+
+/* exportBytes:
+*   Writes the n bytes at buf to fd. Returns 0, or -1 on error.
+*/
+static int exportBytes(int fd, const void* buf, size_t n)
+{
+    return n == 0 || rio_writen(fd, (void*)buf, n) == n ? 0 : -1;
+}
+
+/* fillRecord:
+*   Fills r in for obj, whose body is that of the earlier record shares
+*   or, if shares is -1, written after it.
+*/
+static void fillRecord(cache_record* r, web_object* obj, int shares)
+{
+    memset(r, 0, sizeof(*r));
+    r->path_len = strlen(obj->path);
+    r->header_size = obj->header_size;
+    r->vary_len = obj->vary != NULL ? strlen(obj->vary) : -1;
+    r->key_len = obj->vary != NULL ? strlen(obj->vary_key) : -1;
+    r->shares = shares;
+    r->body_size = shares < 0 ? obj->body->size : 0;
+    r->body_logical = obj->body->logical_size;
+    r->compressed = obj->body->compressed;
+    r->hash = obj->body->hash;
+    r->logical_size = obj->logical_size;
+    r->stored = obj->stored;
+}
+
+/* cache_export:
+*   Writes the objects of the cache to fd, least recently used first,
+*   each shared body once, for cache_import to read back in another
+*   process. Gzip copies for clients are left out. Returns the number
+*   of objects written, or -1 on error.
+*/
+int cache_export(cache_LL* cache, int fd)
+{
+    web_object** objs;
+    web_object* cursor;
+    int n = 0, i, j, ok = 0;
+
+    pthread_rwlock_wrlock(&lock);
+    for(cursor = cache->head; cursor != NULL; cursor = cursor->next)
+        n++;
+    objs = Malloc((n + 1) * sizeof(web_object*));
+    for(i = n, cursor = cache->head; cursor != NULL; cursor = cursor->next)
+        objs[--i] = cursor;
+
+    ok = exportBytes(fd, CACHE_EXPORT_MAGIC, 4) == 0 &&
+         exportBytes(fd, &n, sizeof(n)) == 0;
+    for(i = 0; i < n && ok; i++)
+    {
+        web_object* obj = objs[i];
+        cache_record r;
+        chain_seg* seg;
+        int shares = -1;
+
+        for(j = 0; j < i && shares < 0; j++)
+        {
+            if(objs[j]->body == obj->body)
+                shares = j;
+        }
+        fillRecord(&r, obj, shares);
+
+        ok = exportBytes(fd, &r, sizeof(r)) == 0 &&
+             exportBytes(fd, obj->path, r.path_len) == 0 &&
+             exportBytes(fd, obj->data, r.header_size) == 0 &&
+             (r.vary_len < 0 ||
+              (exportBytes(fd, obj->vary, r.vary_len) == 0 &&
+               exportBytes(fd, obj->vary_key, r.key_len) == 0));
+        for(seg = obj->body->data.head; ok && r.shares < 0 && seg != NULL;
+            seg = seg->next)
+            ok = exportBytes(fd, seg->data + seg->off, seg->len) == 0;
+    }
+    pthread_rwlock_unlock(&lock);
+
+    free(objs);
+    return ok ? n : -1;
+}
+
+/* cache_pack:
+*   Returns a freshly allocated export of obj alone, as cache_export
+*   would write it, and sets len to its size. obj must be held, as
+*   checkCache returns it.
+*/
+char* cache_pack(cache_LL* cache, web_object* obj, size_t* len)
+{
+    cache_record r;
+    chain_seg* seg;
+    char *buf, *p;
+    int n = 1;
 
-    /* We now have two cases:
-    * 1. The object to be evicted is at the head of the list
-    * 2. The object to be evicted is not at the head
-    */
+    pthread_rwlock_rdlock(&lock);
+    fillRecord(&r, obj, -1);
+    *len = 4 + sizeof(n) + sizeof(r) + r.path_len + r.header_size +
+           (r.vary_len < 0 ? 0 : r.vary_len + r.key_len) + r.body_size;
+    p = buf = Malloc(*len);
 
-    web_object *temp;
-    /* Case 1: Evict the object at the head */
-    if( cache->head->timestamp == leastRecentTime)
+    memcpy(p, CACHE_EXPORT_MAGIC, 4);
+    memcpy(p += 4, &n, sizeof(n));
+    memcpy(p += sizeof(n), &r, sizeof(r));
+    memcpy(p += sizeof(r), obj->path, r.path_len);
+    memcpy(p += r.path_len, obj->data, r.header_size);
+    p += r.header_size;
+    if(r.vary_len >= 0)
+    {
+        memcpy(p, obj->vary, r.vary_len);
+        memcpy(p += r.vary_len, obj->vary_key, r.key_len);
+        p += r.key_len;
+    }
+    for(seg = obj->body->data.head; seg != NULL; seg = seg->next)
     {
-        temp = cache->head;
-        cache->head = cache->head->next;
-        //since i've allocated memory for these fields, I need to free them
-        free(temp->data);
-        free(temp->path);
-        free(temp);
+        memcpy(p, seg->data + seg->off, seg->len);
+        p += seg->len;
     }
+    pthread_rwlock_unlock(&lock);
+
+    return buf;
+}
 
-    /*
-     * Case 2: The object is not at the head.
-     * This loop goes back and deletes that old cache object
-     * that was found in the first while loop.
-     */
-    while(cursor->next != NULL)
+/* findImported:
+*   Looks up a stored body identical to the body of the record r, which
+*   body holds as stored, and takes a reference on it. Returns NULL if
+*   there is none. The caller must not hold the cache lock.
+*/
+static body_blob* findImported(cache_LL* cache, chain* body,
+                               const cache_record* r)
+{
+    if(!r->compressed)
+        return findBlob(cache, r->hash, body);
+
+    //identical bodies compare as sent by the origin
+    unsigned int n = r->body_logical;
+    chain_seg seg = { Malloc(n > 0 ? n : 1), 0, n, n, NULL };
+    chain plain = { &seg, &seg, n };
+    body_blob* blob = NULL;
+    if(gzip_decompress(body, seg.data, n) == n)
+        blob = findBlob(cache, r->hash, &plain);
+    free(seg.data);
+    return blob;
+}
+
+/* cache_matches:
+*   Tells whether the object exported alone in the len bytes at buf
+*   (see cache_pack) is the variant that the upstream request req
+*   selects.
+*/
+int cache_matches(const char* buf, size_t len, const msg* req)
+{
+    cache_record r;
+    size_t at = 4 + sizeof(int) + sizeof(r);
+
+    if(len < at || memcmp(buf, CACHE_EXPORT_MAGIC, 4))
+        return 0;
+    memcpy(&r, buf + 4 + sizeof(int), sizeof(r));
+    if(r.vary_len < 0)
+        return 1;
+    if(r.key_len < 0 ||
+       len - at < (size_t)r.path_len + r.header_size + r.vary_len + r.key_len)
+        return 0;
+
+    const char* vary = buf + at + r.path_len + r.header_size;
+    char* names = copy_bytes(vary, r.vary_len);
+    char* key = vary_key(names, req);
+    int match = strlen(key) == r.key_len &&
+                !memcmp(key, vary + r.vary_len, r.key_len);
+    free(names);
+    free(key);
+    return match;
+}
+
+/* cache_import:
+*   Adds to the cache the objects written by cache_export into the len
+*   bytes at buf, as the most recently used ones. Each replaces the
+*   variant of its URL already cached, if any, and shares a body stored
+*   already if it can, as in addToCache. Returns the number of objects
+*   added, which is short of the export's if buf ends early or holds a
+*   bad record (those before it are kept), or -1 if buf isn't an
+*   export at all.
+*/
+int cache_import(cache_LL* cache, const char* buf, size_t len)
+{
+    const char* end = buf + len;
+    body_blob** bodies;
+    int n, i, added = 0;
+
+    if(len < 4 + sizeof(int) || memcmp(buf, CACHE_EXPORT_MAGIC, 4))
+        return -1;
+    memcpy(&n, buf + 4, sizeof(int));
+    buf += 4 + sizeof(int);
+    if(n < 0)
+        return -1;
+    bodies = Calloc(n + 1, sizeof(body_blob*));
+
+    for(i = 0; i < n; i++)
     {
-        if(cursor->next->timestamp == leastRecentTime)
+        cache_record r;
+        http_meta meta;
+
+        if(end - buf < sizeof(r))
+            break;
+        memcpy(&r, buf, sizeof(r));
+        buf += sizeof(r);
+        //sizes are checked before anything is allocated for them
+        size_t vary_bytes = r.vary_len < 0 ? 0 : (size_t)r.vary_len + r.key_len;
+        if(r.path_len >= MAXLINE || (r.vary_len >= 0 && r.key_len < 0) ||
+           r.shares >= i || (r.shares >= 0 && bodies[r.shares] == NULL) ||
+           r.body_logical > MAX_OBJECT_SIZE || r.body_size > MAX_OBJECT_SIZE ||
+           (r.shares < 0 && !r.compressed && r.body_size != r.body_logical) ||
+           end - buf < (size_t)r.path_len + r.header_size + vary_bytes +
+                       r.body_size ||
+           http_parse_meta(buf + r.path_len, r.header_size, &meta) < 0)
+            break;
+
+        web_object* obj = Calloc(1, sizeof(web_object));
+        obj->path = Calloc(1, MAXLINE);
+        memcpy(obj->path, buf, r.path_len);
+        buf += r.path_len;
+        obj->data = Malloc(r.header_size);
+        memcpy(obj->data, buf, r.header_size);
+        http_parse_meta(obj->data, r.header_size, &obj->meta);
+        buf += r.header_size;
+        if(r.vary_len >= 0)
         {
-            cache->size -= cursor->next->size;
-            cursor->next = cursor->next->next;
-            temp = cursor->next;
-            //since i've allocated memory for these fields, need to free them
-            free(temp->data);
-            free(temp->path);
-            free(temp);
-
-            return;
+            obj->vary = copy_bytes(buf, r.vary_len);
+            obj->vary_key = copy_bytes(buf + r.vary_len, r.key_len);
+            buf += vary_bytes;
         }
 
-        cursor = cursor->next;
+        //a body stored already is shared, as addToCache would, and like
+        //there it is looked up and built without the lock
+        body_blob* blob = r.shares >= 0 ? bodies[r.shares] : NULL;
+        int newBlob = 0;
+        if(blob == NULL)
+        {
+            chain body;
+            chain_init(&body);
+            chain_append(&body, buf, r.body_size);
+            buf += r.body_size;
+            blob = findImported(cache, &body, &r);
+            if(blob != NULL)
+                chain_free(&body);
+            else
+            {
+                blob = Calloc(1, sizeof(body_blob));
+                blob->data = body;
+                blob->size = r.body_size;
+                blob->logical_size = r.body_logical;
+                blob->compressed = r.compressed;
+                blob->hash = r.hash;
+                blob->refcount = 1;
+                newBlob = 1;
+            }
+        }
+
+        pthread_rwlock_wrlock(&lock);
+        if(newBlob)
+        {
+            body_blob** bucket = &blobs[blob->hash % BLOB_BUCKETS];
+            blob->next = *bucket;
+            *bucket = blob;
+            cache->size += blob->size;
+        }
+        if(r.shares >= 0)
+        {
+            blob->refcount++;
+            cache->dedup_hits++;
+            cache->dedup_saved += blob->size;
+        }
+        else
+        {
+            //held until the end, for later records to share
+            blob->refcount++;
+            cache->dedup_saved += blob->size;
+            bodies[i] = blob;
+        }
+
+        //the object replaces its variant, like a new one would
+        makeRoom(cache, obj->path, obj->vary, obj->vary_key);
+        obj->header_size = r.header_size;
+        obj->stored = r.stored;
+        obj->body = blob;
+        obj->timestamp = timecounter++;
+        obj->size = r.header_size + blob->size;
+        obj->logical_size = r.logical_size;
+        obj->next = cache->head;
+        cache->head = obj;
+        cache->size += r.header_size;
+        pthread_rwlock_unlock(&lock);
+        added++;
+    }
+
+    pthread_rwlock_wrlock(&lock);
+    for(i = 0; i < n; i++)
+    {
+        if(bodies[i] != NULL)
+            releaseBlob(cache, bodies[i]);
     }
+    while(cache->size > MAX_CACHE_SIZE && cache->head != NULL)
+        evictAnObject(cache);
     pthread_rwlock_unlock(&lock);
 
+    free(bodies);
+    dbg_printf("CACHE >> Imported %d of %d objects\n", added, n);
+    return added;
 }
@@ -3,31 +3,113 @@
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Maximum number of Vary variants kept for a single URL */
+#define MAX_VARIANTS 4
+
+/* Default body size from which text objects are stored gzipped
+   when compression is turned on with -z */
+#define CACHE_COMPRESS_MIN 1024
+
+/* Number of hash chains in the store of response bodies, and the
+   starting value of cache_hash() */
+#define BLOB_BUCKETS 1024
+#define CACHE_HASH_INIT 14695981039346656037UL
+
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include "chain.h"
+#include "msg.h"
 
 /* The cache will be represented as a linked list of web objects
    The eviction policy will be LRU and each object will hold a
    timestamp indicating when it was last used */
 
+/* Response bodies live in a content-addressed store: objects whose
+   bodies are byte-identical (aliases of the same resource, cache
+   busting query strings) point at one shared body_blob, found through
+   the hash of its contents. refcount counts the objects using it.
+   data is usually the very chain the body was read into from the
+   origin. When compressed is set, data holds the body as a gzip
+   stream: size is then the number of bytes held and logical_size the
+   size of the body as the origin sent it */
+
+typedef struct body_blob{
+  chain data;
+  unsigned int size;
+  unsigned int logical_size;
+  int compressed;
+  unsigned long hash;
+  unsigned int refcount;
+  struct body_blob* next;
+} body_blob;
+
+/* data holds the header_size bytes of the response headers and body
+   its body. meta is what hits need to know about the headers, parsed
+   when the object was stored at time stored. size is what the object accounts for in the cache (its
+   headers plus its body, even if shared) and logical_size the size of
+   the response as received.
+   gzip is the gzipped copy of an uncompressed body sent to clients
+   accepting gzip when compression for clients is on (-g), made once
+   and kept apart from the shared bodies; gzip_tried is set once
+   making it was attempted.
+   An object whose response carried a Vary header is a variant of its
+   URL: vary holds the (lowercased) request header names listed in
+   Vary and vary_key the values those headers had in the request that
+   filled it. Objects without Vary have both fields set to NULL.
+   refcount counts the readers currently sending the object; an
+   evicted object is only freed once the last reader releases it */
+
 typedef struct web_object{
   char *data;
+  unsigned int header_size;
+  http_meta meta;
+  time_t stored;
+  body_blob* body;
+  body_blob* gzip;
+  int gzip_tried;
   unsigned int timestamp;
   unsigned int size;
+  unsigned int logical_size;
   char* path;
+  char* vary;
+  char* vary_key;
+  unsigned int refcount;
+  int evicted;
   struct web_object* next;
 } web_object;
 
+/* size counts the bytes actually held, shared bodies once.
+   dedup_hits counts the objects that found their body already stored
+   and dedup_saved the bytes sharing currently saves */
+
 typedef struct cache_LL{
   web_object* head;
   unsigned int size;
+  unsigned long dedup_hits;
+  unsigned long dedup_saved;
 }cache_LL;
 
+/* First bytes of what cache_export writes */
+#define CACHE_EXPORT_MAGIC "PXC1"
+
+/* Smallest body stored compressed, 0 when compression is off */
+extern unsigned int cache_compress_min;
+
 void cache_init();
-web_object* checkCache(cache_LL* cache, char* path);
-void addToCache(cache_LL* cache, char* data, char* path, unsigned int addSize);
+unsigned long cache_hash(unsigned long h, const char* buf, size_t n);
+web_object* checkCache(cache_LL* cache, char* path, const msg* req);
+void releaseObject(cache_LL* cache, web_object* obj);
+void invalidateCache(cache_LL* cache, char* path);
+void addToCache(cache_LL* cache, chain* response, char* path,
+                const msg* req, unsigned long bodyHash, chain* gzipped);
+body_blob* gzipBody(cache_LL* cache, web_object* obj);
 void evictAnObject(cache_LL* cache);
+void printCacheStats(cache_LL* cache, FILE* out);
+int cache_export(cache_LL* cache, int fd);
+char* cache_pack(cache_LL* cache, web_object* obj, size_t* len);
+int cache_matches(const char* buf, size_t len, const msg* req);
+int cache_import(cache_LL* cache, const char* buf, size_t len);
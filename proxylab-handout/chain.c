@@ -0,0 +1,263 @@
+/*
+* Segmented byte buffers. See chain.h for the layout.
+*/
+#include "chain.h"
+#include "csapp.h"
+
+
+/* chain_init:
+*   Makes c an empty chain.
+*/
+void chain_init(chain* c)
+{
+    c->head = NULL;
+    c->tail = NULL;
+    c->len = 0;
+}
+
+/* chain_free:
+*   Releases every segment of c, leaving it empty.
+*/
+void chain_free(chain* c)
+{
+    chain_seg* seg = c->head;
+
+    while(seg != NULL)
+    {
+        chain_seg* next = seg->next;
+        free(seg->data);
+        free(seg);
+        seg = next;
+    }
+
+    chain_init(c);
+}
+
+/* chain_reset:
+*   Empties c but keeps its last segment allocated, so that a chain
+*   used to relay data that is not being kept can reuse one buffer.
+*/
+void chain_reset(chain* c)
+{
+    chain_seg* tail = c->tail;
+
+    if(tail == NULL)
+        return;
+
+    while(c->head != tail)
+    {
+        chain_seg* next = c->head->next;
+        free(c->head->data);
+        free(c->head);
+        c->head = next;
+    }
+
+    tail->off = 0;
+    tail->len = 0;
+    c->len = 0;
+}
+
+/* chain_trim:
+*   Gives the unused end of the last segment back to the allocator,
+*   once nothing more is going to be appended to c.
+*/
+void chain_trim(chain* c)
+{
+    chain_seg* tail = c->tail;
+
+    if(tail == NULL || tail->off + tail->len == tail->cap || tail->len == 0)
+        return;
+
+    tail->cap = tail->off + tail->len;
+    tail->data = Realloc(tail->data, tail->cap);
+}
+
+/* chain_reserve:
+*   Returns the free space at the end of c and its size in room. If
+*   the last segment is full, a new one of want bytes is added first
+*   (CHAIN_SEG_SIZE if want is 0). Bytes written there become part of
+*   the chain once chain_commit is called.
+*/
+char* chain_reserve(chain* c, unsigned int want, unsigned int* room)
+{
+    chain_seg* tail = c->tail;
+
+    if(tail == NULL || tail->off + tail->len == tail->cap)
+    {
+        chain_seg* seg = Malloc(sizeof(chain_seg));
+        seg->cap = want > 0 ? want : CHAIN_SEG_SIZE;
+        seg->data = Malloc(seg->cap);
+        seg->off = 0;
+        seg->len = 0;
+        seg->next = NULL;
+
+        if(tail == NULL)
+            c->head = seg;
+        else
+            tail->next = seg;
+        c->tail = tail = seg;
+    }
+
+    *room = tail->cap - tail->off - tail->len;
+    return tail->data + tail->off + tail->len;
+}
+
+/* chain_commit:
+*   Appends the n bytes written at the space returned by chain_reserve.
+*/
+void chain_commit(chain* c, unsigned int n)
+{
+    c->tail->len += n;
+    c->len += n;
+}
+
+/* chain_shrink:
+*   Drops the last n bytes of c, which must all be in its last
+*   segment, e.g. the framing of data just read and decoded in place.
+*/
+void chain_shrink(chain* c, unsigned int n)
+{
+    c->tail->len -= n;
+    c->len -= n;
+}
+
+/* chain_prepend:
+*   Puts a copy of the n bytes at buf in front of c, in a segment of
+*   their own.
+*/
+void chain_prepend(chain* c, const char* buf, unsigned int n)
+{
+    chain_seg* seg = Malloc(sizeof(chain_seg));
+
+    seg->data = Malloc(n > 0 ? n : 1);
+    memcpy(seg->data, buf, n);
+    seg->off = 0;
+    seg->len = seg->cap = n;
+    seg->next = c->head;
+
+    c->head = seg;
+    if(c->tail == NULL)
+        c->tail = seg;
+    c->len += n;
+}
+
+/* chain_append:
+*   Appends a copy of the n bytes at buf.
+*/
+void chain_append(chain* c, const char* buf, unsigned int n)
+{
+    while(n > 0)
+    {
+        unsigned int room;
+        char* at = chain_reserve(c, n, &room);
+        unsigned int take = n < room ? n : room;
+
+        memcpy(at, buf, take);
+        chain_commit(c, take);
+        buf += take;
+        n -= take;
+    }
+}
+
+/* chain_consume:
+*   Drops the first n bytes of c, freeing the segments they emptied.
+*/
+void chain_consume(chain* c, unsigned int n)
+{
+    while(n > 0 && c->head != NULL)
+    {
+        chain_seg* seg = c->head;
+        unsigned int take = n < seg->len ? n : seg->len;
+
+        seg->off += take;
+        seg->len -= take;
+        c->len -= take;
+        n -= take;
+
+        if(seg->len == 0 && seg != c->tail)
+        {
+            c->head = seg->next;
+            free(seg->data);
+            free(seg);
+        }
+    }
+}
+
+/* chain_read:
+*   Reads once from fd straight into the free space at the end of c
+*   (see chain_reserve for want). On success the bytes read are part
+*   of c and *at points to them. Returns the number of bytes read,
+*   0 at end of file or -1 on error, like read().
+*/
+int chain_read(int fd, chain* c, unsigned int want, char** at)
+{
+    unsigned int room;
+    int n;
+
+    *at = chain_reserve(c, want, &room);
+
+    while((n = read(fd, *at, room)) < 0)
+    {
+        if(errno != EINTR) /* interrupted by sig handler return */
+            return -1;
+    }
+
+    chain_commit(c, n);
+    return n;
+}
+
+/* chain_write:
+*   Writes all of c to fd. Returns 0, or -1 if a write failed.
+*/
+int chain_write(int fd, const chain* c)
+{
+    chain_seg* seg;
+
+    for(seg = c->head; seg != NULL; seg = seg->next)
+    {
+        if(seg->len > 0 &&
+           rio_writen(fd, seg->data + seg->off, seg->len) != seg->len)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* chain_equal:
+*   Checks whether a and b hold the same bytes, however these are
+*   split into segments.
+*/
+int chain_equal(const chain* a, const chain* b)
+{
+    chain_seg* sa = a->head;
+    chain_seg* sb = b->head;
+    unsigned int oa = 0, ob = 0;
+
+    if(a->len != b->len)
+        return 0;
+
+    while(sa != NULL && sb != NULL)
+    {
+        unsigned int na = sa->len - oa;
+        unsigned int nb = sb->len - ob;
+        unsigned int n = na < nb ? na : nb;
+
+        if(memcmp(sa->data + sa->off + oa, sb->data + sb->off + ob, n))
+            return 0;
+
+        oa += n;
+        ob += n;
+        if(oa == sa->len)
+        {
+            sa = sa->next;
+            oa = 0;
+        }
+        if(ob == sb->len)
+        {
+            sb = sb->next;
+            ob = 0;
+        }
+    }
+
+    return 1;
+}
@@ -0,0 +1,41 @@
+/* A chain is a byte string kept as a list of separately allocated
+   segments, so that data read from a socket can be kept where it was
+   read to instead of being copied into one growing buffer. Bytes are
+   only ever appended at the tail and consumed from the head; every
+   segment holds len bytes starting at data + off, out of cap */
+
+#ifndef __CHAIN_H__
+#define __CHAIN_H__
+
+/* Size of the segments allocated when the caller has no better idea */
+#define CHAIN_SEG_SIZE 8192
+
+typedef struct chain_seg{
+  char *data;
+  unsigned int off;
+  unsigned int len;
+  unsigned int cap;
+  struct chain_seg* next;
+} chain_seg;
+
+typedef struct chain{
+  chain_seg* head;
+  chain_seg* tail;
+  unsigned int len;
+} chain;
+
+void chain_init(chain* c);
+void chain_free(chain* c);
+void chain_reset(chain* c);
+void chain_trim(chain* c);
+char* chain_reserve(chain* c, unsigned int want, unsigned int* room);
+void chain_commit(chain* c, unsigned int n);
+void chain_shrink(chain* c, unsigned int n);
+void chain_prepend(chain* c, const char* buf, unsigned int n);
+void chain_append(chain* c, const char* buf, unsigned int n);
+void chain_consume(chain* c, unsigned int n);
+int chain_read(int fd, chain* c, unsigned int want, char** at);
+int chain_write(int fd, const chain* c);
+int chain_equal(const chain* a, const chain* b);
+
+#endif /* __CHAIN_H__ */
@@ -0,0 +1,216 @@
+/*
+* gzip compression of cached bodies, built on zlib.
+*/
+#include "compress.h"
+#include "csapp.h"
+#include <zlib.h>
+
+
+int gzip_level = 0;
+int gzip_cpu_budget = GZIP_CPU_BUDGET;
+
+/* CPU time spent compressing for clients in the current second of
+   wall clock time, which budget_second is */
+static long budget_used = 0;
+static time_t budget_second = 0;
+
+/* Counters reported by printCompressStats */
+static unsigned long gzip_streams = 0;
+static unsigned long gzip_over_budget = 0;
+static unsigned long gzip_bytes_in = 0;
+static unsigned long gzip_bytes_out = 0;
+static unsigned long gzip_cpu_ns = 0;
+
+static pthread_mutex_t budget_lock;
+
+void compress_init()
+{
+    pthread_mutex_init(&budget_lock, 0);
+}
+
+
+/* gzip_compress:
+*   Compresses the bytes of src, segment by segment, into a gzip
+*   stream appended to the empty chain dst as a single segment.
+*   Returns 0 on success and -1 if zlib fails, leaving dst empty.
+*/
+int gzip_compress(const chain* src, chain* dst, int level)
+{
+    z_stream strm;
+    chain_seg* seg;
+    unsigned int room;
+    memset(&strm, 0, sizeof(strm));
+
+    //windowBits of 15 + 16 asks zlib for a gzip header and trailer
+    if(deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    //the gzip header and trailer take 18 bytes that deflateBound
+    //does not count for a gzip stream in older zlibs
+    unsigned int bound = deflateBound(&strm, src->len) + 18;
+
+    strm.next_out = (Bytef*)chain_reserve(dst, bound, &room);
+    strm.avail_out = room;
+
+    //the output has room for everything, so each segment is consumed
+    //whole; anything else means zlib failed
+    int failed = 0;
+    for(seg = src->head; seg != NULL && !failed; seg = seg->next)
+    {
+        strm.next_in = (Bytef*)seg->data + seg->off;
+        strm.avail_in = seg->len;
+        failed = deflate(&strm, Z_NO_FLUSH) == Z_STREAM_ERROR ||
+                 strm.avail_in != 0;
+    }
+
+    if(failed || deflate(&strm, Z_FINISH) != Z_STREAM_END)
+    {
+        deflateEnd(&strm);
+        chain_free(dst);
+        return -1;
+    }
+
+    chain_commit(dst, room - strm.avail_out);
+    chain_trim(dst);
+    deflateEnd(&strm);
+    return 0;
+}
+
+/* gzip_decompress:
+*   Inflates the gzip stream held in src into dst, which must be able
+*   to hold dstlen bytes. Returns the number of bytes produced, or -1
+*   if the stream is corrupt or does not fit.
+*/
+int gzip_decompress(const chain* src, char* dst, unsigned int dstlen)
+{
+    z_stream strm;
+    chain_seg* seg;
+    int rc = Z_OK;
+    memset(&strm, 0, sizeof(strm));
+
+    if(inflateInit2(&strm, 15 + 16) != Z_OK)
+        return -1;
+
+    strm.next_out = (Bytef*)dst;
+    strm.avail_out = dstlen;
+
+    for(seg = src->head; seg != NULL && rc == Z_OK; seg = seg->next)
+    {
+        strm.next_in = (Bytef*)seg->data + seg->off;
+        strm.avail_in = seg->len;
+        rc = inflate(&strm, Z_NO_FLUSH);
+    }
+    inflateEnd(&strm);
+
+    if(rc != Z_STREAM_END)
+        return -1;
+    return dstlen - strm.avail_out;
+}
+
+/* gzip_budget_ok:
+*   Whether compression for a client may start now, i.e. the CPU time
+*   spent on it in the current second is still under gzip_cpu_budget.
+*   A stream that is started is always finished, so the budget can be
+*   overrun by the streams running when it runs out.
+*/
+int gzip_budget_ok()
+{
+    time_t now = time(NULL);
+    int ok;
+
+    pthread_mutex_lock(&budget_lock);
+    if(now != budget_second)
+    {
+        budget_second = now;
+        budget_used = 0;
+    }
+    ok = gzip_cpu_budget == 0 || budget_used < gzip_cpu_budget * 1000000L;
+    if(!ok)
+        gzip_over_budget++;
+    pthread_mutex_unlock(&budget_lock);
+
+    return ok;
+}
+
+/* gzip_stream_init:
+*   Starts a gzip stream at the given level. Returns 0, or -1 if zlib
+*   fails.
+*/
+int gzip_stream_init(gzip_stream* z, int level)
+{
+    memset(&z->strm, 0, sizeof(z->strm));
+    if(deflateInit2(&z->strm, level, Z_DEFLATED, 15 + 16, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    pthread_mutex_lock(&budget_lock);
+    gzip_streams++;
+    pthread_mutex_unlock(&budget_lock);
+    return 0;
+}
+
+/* gzip_stream_write:
+*   Compresses the len bytes at data, the next piece of the input of z,
+*   appending whatever output zlib has ready to out; with finish set
+*   they are the last piece and the stream is completed. The CPU time
+*   this takes is charged to the budget. Returns the number of bytes
+*   appended, or -1 if zlib fails.
+*/
+int gzip_stream_write(gzip_stream* z, const char* data, unsigned int len,
+                      int finish, chain* out)
+{
+    struct timespec start, end;
+    unsigned int before = out->len, room;
+    int flush = finish ? Z_FINISH : Z_NO_FLUSH;
+    int rc;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+    z->strm.next_in = (Bytef*)data;
+    z->strm.avail_in = len;
+    do
+    {
+        z->strm.next_out = (Bytef*)chain_reserve(out, CHAIN_SEG_SIZE, &room);
+        z->strm.avail_out = room;
+        rc = deflate(&z->strm, flush);
+        chain_commit(out, room - z->strm.avail_out);
+    } while(rc == Z_OK && (z->strm.avail_out == 0 || z->strm.avail_in > 0 ||
+                           (finish && rc != Z_STREAM_END)));
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    long ns = (end.tv_sec - start.tv_sec) * 1000000000L +
+              end.tv_nsec - start.tv_nsec;
+
+    pthread_mutex_lock(&budget_lock);
+    budget_used += ns;
+    gzip_cpu_ns += ns;
+    gzip_bytes_in += len;
+    gzip_bytes_out += out->len - before;
+    pthread_mutex_unlock(&budget_lock);
+
+    if(rc == Z_STREAM_ERROR || (finish && rc != Z_STREAM_END) ||
+       (rc == Z_BUF_ERROR && z->strm.avail_in > 0))
+        return -1;
+    return out->len - before;
+}
+
+/* gzip_stream_end:
+*   Releases the zlib state of z.
+*/
+void gzip_stream_end(gzip_stream* z)
+{
+    deflateEnd(&z->strm);
+}
+
+/* printCompressStats:
+*   Prints what the compression for clients did, read without locking.
+*/
+void printCompressStats(FILE* out)
+{
+    fprintf(out, "gzip streams: %lu, skipped over budget: %lu\n",
+            gzip_streams, gzip_over_budget);
+    fprintf(out, "gzip bytes: %lu in, %lu out\n", gzip_bytes_in,
+            gzip_bytes_out);
+    fprintf(out, "gzip cpu: %lu ms\n", gzip_cpu_ns / 1000000);
+}
@@ -0,0 +1,47 @@
+/* gzip helpers used to keep compressible objects small in the cache,
+   and to compress text responses on their way to clients that accept
+   gzip. The gzip container is used (rather than raw deflate) so that a
+   stored body can be handed as-is to a client accepting gzip */
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stdio.h>
+#include <zlib.h>
+#include "chain.h"
+
+/* Level used for objects compressed on their way into the cache;
+   level 1 keeps the fill path cheap while still shrinking text well */
+#define CACHE_COMPRESS_LEVEL 1
+
+int gzip_compress(const chain* src, chain* dst, int level);
+int gzip_decompress(const chain* src, char* dst, unsigned int dstlen);
+
+/* Default level of the compression done for clients (-g), and the
+   default CPU time in milliseconds it may use per second of wall
+   clock time, over all threads (-B, 0 for no limit) */
+#define GZIP_LEVEL 6
+#define GZIP_CPU_BUDGET 500
+
+/* Smallest body of known length worth compressing for a client */
+#define GZIP_MIN_LENGTH 256
+
+/* Level of the compression for clients, 0 when it is off, and its
+   CPU budget */
+extern int gzip_level;
+extern int gzip_cpu_budget;
+
+/* A gzip stream being produced a piece at a time */
+typedef struct gzip_stream{
+  z_stream strm;
+} gzip_stream;
+
+void compress_init();
+int gzip_budget_ok();
+int gzip_stream_init(gzip_stream* z, int level);
+int gzip_stream_write(gzip_stream* z, const char* data, unsigned int len,
+                      int finish, chain* out);
+void gzip_stream_end(gzip_stream* z);
+void printCompressStats(FILE* out);
+
+#endif /* __COMPRESS_H__ */
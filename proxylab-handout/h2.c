@@ -0,0 +1,1179 @@
+/*
+* HTTP/2 cleartext frontend. See h2.h.
+*/
+#include <poll.h>
+#include "h2.h"
+#include "csapp.h"
+#include "msg.h"
+#include "limit.h"
+
+
+#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+/* Frame types */
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+/* Frame flags */
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY_FLAG 0x20
+
+/* Settings */
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+/* Error codes */
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+
+#define H2_FRAME_HEADER 9
+#define H2_MAX_WINDOW 0x7fffffffL
+
+
+int h2_enabled = 0;
+
+static h2_handler handler;
+
+/* Counters reported by printH2Stats */
+static unsigned long h2_connections = 0;
+static unsigned long h2_active = 0;
+static unsigned long h2_streams = 0;
+static unsigned long h2_refused = 0;
+static unsigned long h2_errors = 0;
+static unsigned long h2_flow_resets = 0;
+
+static pthread_mutex_t h2_lock;
+
+/* An open stream. fd is our end of the socketpair to the thread
+   serving it, id 0 marks a free slot. Until head_done, buf collects
+   the response head; after it, buf holds response body bytes from off
+   to len that wait for window to be sent. window is what the client
+   lets us send on the stream.
+   body_open is set while the request body is being passed on, chunked
+   if it is with the chunked coding, and body_end once the client has
+   sent all of it. The fd doesn't block: body holds the bytes from
+   body_off to body_len the thread hasn't taken yet, at most
+   H2_INITIAL_WINDOW as recv_window, what the client may still send on
+   the stream, only grows again as they are taken. frame holds chunk
+   framing from frame_off to frame_len that goes out before any more of
+   the body, and chunk_left is what is left of the chunk being passed
+   on */
+typedef struct h2_stream{
+  unsigned int id;
+  int fd;
+  int head_done;
+  int body_open;
+  int body_end;
+  int chunked;
+  long window;
+  long recv_window;
+  char buf[H2_FRAME_SIZE];
+  size_t off;
+  size_t len;
+  char* body;
+  size_t body_off;
+  size_t body_len;
+  char frame[16];
+  size_t frame_off;
+  size_t frame_len;
+  size_t chunk_left;
+} h2_stream;
+
+/* A client connection. in holds what was read from the client and
+   not yet handled, at most one frame. window is what the client lets
+   us send on the connection, initial_window what a new stream starts
+   with, and recv_window what the client may send us on the
+   connection. A header block is collected in block until its last frame,
+   block_id being the stream it is for while more is expected. out is
+   where response header blocks are encoded. client is the slot of the
+   client in the limits */
+typedef struct h2_conn{
+  int fd;
+  int client;
+  unsigned char in[H2_FRAME_HEADER + H2_FRAME_SIZE];
+  size_t in_len;
+  long window;
+  long initial_window;
+  long recv_window;
+  unsigned int last_id;
+  int goaway;
+  int nstreams;
+  h2_stream streams[H2_MAX_STREAMS];
+  hpack_table decoder;
+  unsigned char block[H2_MAX_HEADER_BLOCK];
+  size_t block_len;
+  unsigned int block_id;
+  int block_end_stream;
+  char fields_buf[H2_MAX_HEADER_BLOCK];
+  hpack_field fields[H2_MAX_FIELDS];
+  unsigned char out[H2_MAX_HEADER_BLOCK];
+} h2_conn;
+
+void h2_init(h2_handler serve)
+{
+    handler = serve;
+    hpack_init();
+    pthread_mutex_init(&h2_lock, 0);
+}
+
+/* h2_preface:
+*   Tells whether the len bytes at buf, which the HTTP/1 parser
+*   rejected, are the start of the HTTP/2 connection preface.
+*/
+int h2_preface(const char* buf, size_t len)
+{
+    return len >= 16 && !memcmp(buf, H2_PREFACE, 16);
+}
+
+static unsigned int get32(const unsigned char* p)
+{
+    return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(unsigned char* p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* send_frame:
+*   Writes a frame to the client. Returns 0, or -1 on error.
+*/
+static int send_frame(h2_conn* c, int type, int flags, unsigned int id,
+                      const void* payload, size_t len)
+{
+    unsigned char head[H2_FRAME_HEADER];
+    msg m;
+
+    head[0] = len >> 16;
+    head[1] = len >> 8;
+    head[2] = len;
+    head[3] = type;
+    head[4] = flags;
+    put32(head + 5, id & 0x7fffffff);
+
+    msg_init(&m);
+    msg_add(&m, head, sizeof(head));
+    if(len > 0)
+        msg_add(&m, payload, len);
+    return msg_send(&m, c->fd);
+}
+
+/* send_rst:
+*   Resets stream id with the given error code.
+*/
+static void send_rst(h2_conn* c, unsigned int id, unsigned int code)
+{
+    unsigned char p[4];
+
+    put32(p, code);
+    send_frame(c, H2_RST_STREAM, 0, id, p, sizeof(p));
+}
+
+/* send_window_update:
+*   Gives the client n more bytes of window on stream id (0 for the
+*   connection).
+*/
+static void send_window_update(h2_conn* c, unsigned int id, size_t n)
+{
+    unsigned char p[4];
+
+    put32(p, n);
+    send_frame(c, H2_WINDOW_UPDATE, 0, id, p, sizeof(p));
+}
+
+/* conn_error:
+*   Ends the connection with a GOAWAY carrying code. Returns -1, for
+*   the caller to pass on.
+*/
+static int conn_error(h2_conn* c, unsigned int code)
+{
+    unsigned char p[8];
+
+    put32(p, c->last_id);
+    put32(p + 4, code);
+    send_frame(c, H2_GOAWAY, 0, 0, p, sizeof(p));
+
+    pthread_mutex_lock(&h2_lock);
+    h2_errors++;
+    pthread_mutex_unlock(&h2_lock);
+    dbg_printf("HTTP/2 connection error %u\n", code);
+    return -1;
+}
+
+/* send_headers:
+*   Sends the header block of len bytes at block on stream id, in a
+*   HEADERS frame followed by as many CONTINUATION frames as needed.
+*/
+static void send_headers(h2_conn* c, unsigned int id,
+                         const unsigned char* block, size_t len,
+                         int end_stream)
+{
+    int type = H2_HEADERS;
+    int flags = end_stream ? H2_END_STREAM : 0;
+
+    while(len > H2_FRAME_SIZE)
+    {
+        send_frame(c, type, flags, id, block, H2_FRAME_SIZE);
+        block += H2_FRAME_SIZE;
+        len -= H2_FRAME_SIZE;
+        type = H2_CONTINUATION;
+        flags = 0;
+    }
+    send_frame(c, type, flags | H2_END_HEADERS, id, block, len);
+}
+
+/* send_status:
+*   Answers stream id with an empty response of the given status.
+*/
+static void send_status(h2_conn* c, unsigned int id, int status)
+{
+    size_t n = hpack_encode_status(c->out, sizeof(c->out), status);
+
+    n += hpack_encode(c->out + n, sizeof(c->out) - n, "content-length", 14,
+                      "0", 1);
+    send_headers(c, id, c->out, n, 1);
+}
+
+static h2_stream* find_stream(h2_conn* c, unsigned int id)
+{
+    int i;
+
+    for(i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if(c->streams[i].id == id)
+            return &c->streams[i];
+    }
+    return NULL;
+}
+
+/* close_stream:
+*   Frees the slot of s. Its thread sees the end of its socket and
+*   finishes.
+*/
+static void close_stream(h2_conn* c, h2_stream* s)
+{
+    Close(s->fd);
+    free(s->body);
+    s->body = NULL;
+    s->id = 0;
+    s->fd = -1;
+    c->nstreams--;
+}
+
+/* hop_by_hop:
+*   Tells whether a header only concerns one HTTP/1 connection and has
+*   no place in HTTP/2 (or the other way around).
+*/
+static int hop_by_hop(const http_slice* name)
+{
+    return http_slice_is(name, "connection") ||
+           http_slice_is(name, "keep-alive") ||
+           http_slice_is(name, "proxy-connection") ||
+           http_slice_is(name, "transfer-encoding") ||
+           http_slice_is(name, "upgrade") || http_slice_is(name, "te");
+}
+
+static void *stream_thread(void *arg)
+{
+    int fd = ((int *)arg)[0];
+    int client = ((int *)arg)[1];
+
+    Pthread_detach(pthread_self());
+    Free(arg);
+
+    handler(fd, client);
+    Close(fd);
+
+    return NULL;
+}
+
+/* open_stream:
+*   Starts serving the request whose n header fields were just
+*   decoded on a new stream id: its thread gets it as an HTTP/1.0
+*   request for the absolute URL the pseudo-headers make up. Problems
+*   with the request only end the stream, as does a client over its
+*   request rate. Returns 0.
+*/
+static int open_stream(h2_conn* c, unsigned int id, int n, int end_stream)
+{
+    http_slice *method = NULL, *path = NULL, *authority = NULL;
+    http_slice *length = NULL;
+    hpack_field *f;
+    h2_stream* s;
+    pthread_t tid;
+    int sv[2], *arg, i, cookies = 0;
+    msg m;
+
+    if((s = find_stream(c, 0)) == NULL)
+    {
+        send_rst(c, id, H2_REFUSED_STREAM);
+        pthread_mutex_lock(&h2_lock);
+        h2_refused++;
+        pthread_mutex_unlock(&h2_lock);
+        return 0;
+    }
+    if(limit_request(c->client) < 0)
+    {
+        send_status(c, id, 429);
+        return 0;
+    }
+
+    for(i = 0; i < n; i++)
+    {
+        f = &c->fields[i];
+        if(http_slice_is(&f->name, ":method"))
+            method = &f->value;
+        else if(http_slice_is(&f->name, ":path"))
+            path = &f->value;
+        else if(http_slice_is(&f->name, ":authority"))
+            authority = &f->value;
+        else if(http_slice_is(&f->name, "host") && authority == NULL)
+            authority = &f->value;
+        else if(http_slice_is(&f->name, "content-length"))
+            length = &f->value;
+    }
+
+    if(method == NULL || path == NULL || path->len == 0 || path->p[0] != '/')
+    {
+        if(method != NULL && http_slice_is(method, "CONNECT"))
+            send_status(c, id, 501);
+        else
+            send_rst(c, id, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+    if(authority == NULL || authority->len == 0)
+    {
+        send_status(c, id, 400);
+        return 0;
+    }
+
+    msg_init(&m);
+    msg_add_slice(&m, method);
+    msg_add_str(&m, " http://");
+    msg_add_slice(&m, authority);
+    msg_add_slice(&m, path);
+    msg_add_str(&m, " HTTP/1.0\r\n");
+    msg_add_header(&m, "Host", 4, authority->p, authority->len);
+    for(i = 0; i < n; i++)
+    {
+        f = &c->fields[i];
+        if(f->name.len == 0 || f->name.p[0] == ':' ||
+           http_slice_is(&f->name, "host") ||
+           http_slice_is(&f->name, "content-length") ||
+           http_slice_is(&f->name, "cookie") || hop_by_hop(&f->name))
+            continue;
+        msg_add_header(&m, f->name.p, f->name.len, f->value.p, f->value.len);
+    }
+    //HTTP/2 may split cookies into one field per pair
+    for(i = 0; i < n; i++)
+    {
+        f = &c->fields[i];
+        if(!http_slice_is(&f->name, "cookie"))
+            continue;
+        msg_add_str(&m, cookies++ ? "; " : "Cookie: ");
+        msg_add_slice(&m, &f->value);
+    }
+    if(cookies)
+        msg_add_str(&m, "\r\n");
+    if(length != NULL)
+        msg_add_header(&m, "Content-Length", 14, length->p, length->len);
+    else if(!end_stream)
+        msg_add_str(&m, "Transfer-Encoding: chunked\r\n");
+    msg_add_str(&m, "\r\n");
+
+    if(m.overflow)
+    {
+        send_status(c, id, 431);
+        return 0;
+    }
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        send_rst(c, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+
+    s->id = id;
+    s->fd = sv[0];
+    s->head_done = 0;
+    s->body_open = !end_stream;
+    s->body_end = 0;
+    s->chunked = length == NULL && !end_stream;
+    s->window = c->initial_window;
+    s->recv_window = H2_INITIAL_WINDOW;
+    s->off = 0;
+    s->len = 0;
+    s->body = s->body_open ? Malloc(H2_INITIAL_WINDOW) : NULL;
+    s->body_off = 0;
+    s->body_len = 0;
+    s->frame_off = 0;
+    s->frame_len = 0;
+    s->chunk_left = 0;
+    c->nstreams++;
+
+    arg = Malloc(2 * sizeof(int));
+    arg[0] = sv[1];
+    arg[1] = c->client;
+    Pthread_create(&tid, NULL, stream_thread, arg);
+
+    pthread_mutex_lock(&h2_lock);
+    h2_streams++;
+    pthread_mutex_unlock(&h2_lock);
+
+    //the head fits in the socket's buffer; what follows mustn't block
+    if(msg_send(&m, s->fd) < 0)
+    {
+        close_stream(c, s);
+        send_rst(c, id, H2_INTERNAL_ERROR);
+        return 0;
+    }
+    fcntl(s->fd, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+/* drop_body:
+*   Stops passing the request body of s on, when its thread no longer
+*   takes it.
+*/
+static void drop_body(h2_stream* s)
+{
+    s->body_open = 0;
+    free(s->body);
+    s->body = NULL;
+    s->body_off = s->body_len = 0;
+    s->frame_off = s->frame_len = 0;
+}
+
+/* set_frame:
+*   Queues chunk framing to go out next: the size line of a chunk of n
+*   bytes, or text if it isn't NULL.
+*/
+static void set_frame(h2_stream* s, const char* text, size_t n)
+{
+    if(text != NULL)
+        s->frame_len = snprintf(s->frame, sizeof(s->frame), "%s", text);
+    else
+        s->frame_len = snprintf(s->frame, sizeof(s->frame), "%zx\r\n", n);
+    s->frame_off = 0;
+}
+
+/* pump_body:
+*   Writes what the request body of s holds to the stream's thread, as
+*   much as it takes without blocking, chunk encoded if need be, and
+*   gives the client back the window of what it took.
+*/
+static void pump_body(h2_conn* c, h2_stream* s)
+{
+    size_t taken = 0;
+    ssize_t n;
+
+    while(s->body_open)
+    {
+        const char* p;
+        size_t len;
+
+        if(s->frame_off < s->frame_len)
+        {
+            p = s->frame + s->frame_off;
+            len = s->frame_len - s->frame_off;
+        }
+        else if(s->chunk_left > 0 || (!s->chunked && s->body_off < s->body_len))
+        {
+            p = s->body + s->body_off;
+            len = s->body_len - s->body_off;
+            if(s->chunked && len > s->chunk_left)
+                len = s->chunk_left;
+        }
+        else if(s->body_off < s->body_len)
+        {
+            //one chunk of whatever has piled up
+            s->chunk_left = s->body_len - s->body_off;
+            set_frame(s, NULL, s->chunk_left);
+            continue;
+        }
+        else if(s->body_end && s->chunked)
+        {
+            //the last chunk, queued once
+            set_frame(s, "0\r\n\r\n", 0);
+            s->chunked = 0;
+            continue;
+        }
+        else
+        {
+            if(s->body_end)
+                drop_body(s);
+            break;
+        }
+
+        n = write(s->fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if(n <= 0)
+        {
+            drop_body(s);
+            break;
+        }
+
+        if(p == s->frame + s->frame_off)
+        {
+            s->frame_off += n;
+            continue;
+        }
+        s->body_off += n;
+        taken += n;
+        if(s->chunked)
+        {
+            s->chunk_left -= n;
+            if(s->chunk_left == 0)
+                set_frame(s, "\r\n", 0);
+        }
+        if(s->body_off == s->body_len)
+            s->body_off = s->body_len = 0;
+    }
+
+    if(taken > 0 && s->body_open && !s->body_end)
+    {
+        s->recv_window += taken;
+        send_window_update(c, s->id, taken);
+    }
+}
+
+/* end_body:
+*   Passes the end of the request body of s on, after what it holds.
+*/
+static void end_body(h2_conn* c, h2_stream* s)
+{
+    s->body_end = 1;
+    pump_body(c, s);
+}
+
+/* headers_done:
+*   Decodes the header block just completed for stream id and acts on
+*   it: a new stream is opened, the trailers of a request body are
+*   dropped. Returns 0, or -1 on a connection error.
+*/
+static int headers_done(h2_conn* c, unsigned int id)
+{
+    int n = hpack_decode(&c->decoder, c->block, c->block_len, c->fields_buf,
+                         sizeof(c->fields_buf), c->fields, H2_MAX_FIELDS);
+    h2_stream* s;
+
+    //decoded in every case, for the dynamic table to stay in step
+    if(n < 0)
+        return conn_error(c, H2_COMPRESSION_ERROR);
+
+    if((s = find_stream(c, id)) != NULL)
+    {
+        if(c->block_end_stream && s->body_open)
+            end_body(c, s);
+        return 0;
+    }
+    if(!(id & 1))
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    //a stream we are done with
+    if(id <= c->last_id)
+        return 0;
+
+    c->last_id = id;
+    if(c->goaway)
+        return 0;
+    return open_stream(c, id, n, c->block_end_stream);
+}
+
+/* add_block:
+*   Adds a fragment of a header block, decoding the block once its
+*   last fragment is in. Returns 0, or -1 on a connection error.
+*/
+static int add_block(h2_conn* c, unsigned int id, const unsigned char* p,
+                     size_t len, int flags)
+{
+    if(len > sizeof(c->block) - c->block_len)
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    memcpy(c->block + c->block_len, p, len);
+    c->block_len += len;
+
+    if(!(flags & H2_END_HEADERS))
+    {
+        c->block_id = id;
+        return 0;
+    }
+    c->block_id = 0;
+    return headers_done(c, id);
+}
+
+/* strip_padding:
+*   Drops the padding of a frame with the PADDED flag. Returns 0, or
+*   -1 if there is more padding than payload.
+*/
+static int strip_padding(int flags, const unsigned char** p, size_t* len)
+{
+    size_t pad;
+
+    if(!(flags & H2_PADDED))
+        return 0;
+    if(*len < 1 || (pad = (*p)[0]) > *len - 1)
+        return -1;
+    (*p)++;
+    *len -= 1 + pad;
+    return 0;
+}
+
+/* on_data:
+*   Takes request body bytes for a stream into what it holds for its
+*   thread, up to the stream's window, and passes on what it can. The
+*   connection's window is given back right away, a stream's as its
+*   thread takes the bytes. A stream sending past its window is reset
+*   rather than waited for. Data the stream's thread doesn't want
+*   anymore is dropped.
+*/
+static int on_data(h2_conn* c, int flags, unsigned int id,
+                   const unsigned char* p, size_t len)
+{
+    size_t frame_len = len;
+    h2_stream* s;
+
+    if(id == 0 || strip_padding(flags, &p, &len) < 0)
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    if((long)frame_len > c->recv_window)
+        return conn_error(c, H2_FLOW_CONTROL_ERROR);
+
+    s = find_stream(c, id);
+    if(s != NULL && s->body_open && !s->body_end)
+    {
+        if((long)frame_len > s->recv_window)
+        {
+            send_rst(c, id, H2_FLOW_CONTROL_ERROR);
+            close_stream(c, s);
+            pthread_mutex_lock(&h2_lock);
+            h2_flow_resets++;
+            pthread_mutex_unlock(&h2_lock);
+            s = NULL;
+        }
+        else
+        {
+            //the padding is given back at once
+            s->recv_window -= len;
+            if(s->body_len + len > H2_INITIAL_WINDOW)
+            {
+                memmove(s->body, s->body + s->body_off,
+                        s->body_len - s->body_off);
+                s->body_len -= s->body_off;
+                s->body_off = 0;
+            }
+            memcpy(s->body + s->body_len, p, len);
+            s->body_len += len;
+            if(frame_len > len && !(flags & H2_END_STREAM))
+                send_window_update(c, id, frame_len - len);
+        }
+    }
+
+    if(s != NULL && s->body_open)
+    {
+        if(flags & H2_END_STREAM)
+            end_body(c, s);
+        else
+            pump_body(c, s);
+    }
+
+    if(frame_len > 0)
+        send_window_update(c, 0, frame_len);
+    return 0;
+}
+
+/* on_settings:
+*   Applies the client's settings and acknowledges them. Only the
+*   initial window matters to us: frames we send never exceed the
+*   least frame size a peer must take, and we encode headers without
+*   the dynamic table.
+*/
+static int on_settings(h2_conn* c, int flags, unsigned int id,
+                       const unsigned char* p, size_t len)
+{
+    size_t i;
+    int j;
+
+    if(id != 0)
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    if(flags & H2_ACK)
+        return len == 0 ? 0 : conn_error(c, H2_FRAME_SIZE_ERROR);
+    if(len % 6)
+        return conn_error(c, H2_FRAME_SIZE_ERROR);
+
+    for(i = 0; i < len; i += 6)
+    {
+        unsigned int key = p[i] << 8 | p[i + 1];
+        unsigned int value = get32(p + i + 2);
+
+        if(key == H2_SETTINGS_INITIAL_WINDOW_SIZE)
+        {
+            if(value > H2_MAX_WINDOW)
+                return conn_error(c, H2_FLOW_CONTROL_ERROR);
+            //a change applies to the windows of open streams too
+            for(j = 0; j < H2_MAX_STREAMS; j++)
+            {
+                if(c->streams[j].id != 0)
+                    c->streams[j].window += (long)value - c->initial_window;
+            }
+            c->initial_window = value;
+        }
+        else if(key == H2_SETTINGS_MAX_FRAME_SIZE &&
+                (value < H2_FRAME_SIZE || value > 0xffffff))
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        else if(key == H2_SETTINGS_ENABLE_PUSH && value > 1)
+            return conn_error(c, H2_PROTOCOL_ERROR);
+    }
+
+    send_frame(c, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+    return 0;
+}
+
+/* on_window_update:
+*   Gives us more window on a stream or the connection.
+*/
+static int on_window_update(h2_conn* c, unsigned int id,
+                            const unsigned char* p, size_t len)
+{
+    long inc;
+    h2_stream* s;
+
+    if(len != 4)
+        return conn_error(c, H2_FRAME_SIZE_ERROR);
+    inc = get32(p) & 0x7fffffff;
+
+    if(id == 0)
+    {
+        if(inc == 0)
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        if(c->window + inc > H2_MAX_WINDOW)
+            return conn_error(c, H2_FLOW_CONTROL_ERROR);
+        c->window += inc;
+        return 0;
+    }
+
+    if((s = find_stream(c, id)) == NULL)
+        return 0;
+    if(inc == 0 || s->window + inc > H2_MAX_WINDOW)
+    {
+        send_rst(c, id, inc == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        close_stream(c, s);
+        return 0;
+    }
+    s->window += inc;
+    return 0;
+}
+
+/* handle_frame:
+*   Acts on one frame from the client. Returns 0, or -1 once the
+*   connection has to end.
+*/
+static int handle_frame(h2_conn* c, int type, int flags, unsigned int id,
+                        const unsigned char* p, size_t len)
+{
+    h2_stream* s;
+
+    //nothing may come between the frames of a header block
+    if(c->block_id != 0 && (type != H2_CONTINUATION || id != c->block_id))
+        return conn_error(c, H2_PROTOCOL_ERROR);
+
+    switch(type)
+    {
+    case H2_DATA:
+        return on_data(c, flags, id, p, len);
+
+    case H2_HEADERS:
+        if(id == 0 || strip_padding(flags, &p, &len) < 0)
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        if(flags & H2_PRIORITY_FLAG)
+        {
+            if(len < 5)
+                return conn_error(c, H2_PROTOCOL_ERROR);
+            p += 5;
+            len -= 5;
+        }
+        c->block_len = 0;
+        c->block_end_stream = flags & H2_END_STREAM;
+        return add_block(c, id, p, len, flags);
+
+    case H2_CONTINUATION:
+        if(c->block_id == 0)
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        return add_block(c, id, p, len, flags);
+
+    case H2_RST_STREAM:
+        if(len != 4)
+            return conn_error(c, H2_FRAME_SIZE_ERROR);
+        if(id != 0 && (s = find_stream(c, id)) != NULL)
+            close_stream(c, s);
+        return 0;
+
+    case H2_SETTINGS:
+        return on_settings(c, flags, id, p, len);
+
+    case H2_PING:
+        if(len != 8)
+            return conn_error(c, H2_FRAME_SIZE_ERROR);
+        if(id != 0)
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        if(!(flags & H2_ACK))
+            send_frame(c, H2_PING, H2_ACK, 0, p, len);
+        return 0;
+
+    case H2_GOAWAY:
+        c->goaway = 1;
+        return 0;
+
+    case H2_WINDOW_UPDATE:
+        return on_window_update(c, id, p, len);
+
+    case H2_PUSH_PROMISE:
+        return conn_error(c, H2_PROTOCOL_ERROR);
+
+    default:
+        //PRIORITY, and types we don't know, are ignored
+        return 0;
+    }
+}
+
+/* handle_frames:
+*   Handles the complete frames in the input buffer, keeping a partial
+*   one for later. Returns 0, or -1 once the connection has to end.
+*/
+static int handle_frames(h2_conn* c)
+{
+    size_t off = 0;
+
+    while(c->in_len - off >= H2_FRAME_HEADER)
+    {
+        unsigned char* f = c->in + off;
+        size_t len = f[0] << 16 | f[1] << 8 | f[2];
+
+        if(len > H2_FRAME_SIZE)
+            return conn_error(c, H2_FRAME_SIZE_ERROR);
+        if(c->in_len - off < H2_FRAME_HEADER + len)
+            break;
+        if(handle_frame(c, f[3], f[4], get32(f + 5) & 0x7fffffff,
+                        f + H2_FRAME_HEADER, len) < 0)
+            return -1;
+        off += H2_FRAME_HEADER + len;
+    }
+
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return 0;
+}
+
+/* response_head:
+*   Sends the HTTP/1 response head that makes up the first hlen bytes
+*   of s->buf as a HEADERS frame. Returns 0, or -1 if it is not a
+*   response head or is too large.
+*/
+static int response_head(h2_conn* c, h2_stream* s, size_t hlen)
+{
+    const char* h = s->buf;
+    const char* end = h + hlen;
+    const char* line;
+    size_t n, m;
+
+    if(hlen < 12 || strncmp(h, "HTTP/1.", 7) || !isdigit((unsigned char)h[9]) ||
+       !isdigit((unsigned char)h[10]) || !isdigit((unsigned char)h[11]))
+        return -1;
+    n = hpack_encode_status(c->out, sizeof(c->out),
+                            (h[9] - '0') * 100 + (h[10] - '0') * 10 + h[11] - '0');
+
+    line = memchr(h, '\n', hlen) + 1;
+    while(line < end)
+    {
+        const char* eol = memchr(line, '\n', end - line);
+        const char* colon;
+        http_slice name, value;
+        size_t llen = eol - line;
+
+        if(llen > 0 && line[llen - 1] == '\r')
+            llen--;
+        if(llen == 0)
+            break;
+
+        if((colon = memchr(line, ':', llen)) != NULL)
+        {
+            name.p = line;
+            name.len = colon - line;
+            value.p = colon + 1;
+            value.len = line + llen - value.p;
+            while(value.len > 0 && (*value.p == ' ' || *value.p == '\t'))
+            {
+                value.p++;
+                value.len--;
+            }
+            while(value.len > 0 && (value.p[value.len - 1] == ' ' ||
+                                    value.p[value.len - 1] == '\t'))
+                value.len--;
+
+            if(name.len > 0 && !hop_by_hop(&name))
+            {
+                m = hpack_encode(c->out + n, sizeof(c->out) - n, name.p,
+                                 name.len, value.p, value.len);
+                if(m == 0)
+                    return -1;
+                n += m;
+            }
+        }
+        line = eol + 1;
+    }
+
+    send_headers(c, s->id, c->out, n, 0);
+    return 0;
+}
+
+/* read_stream:
+*   Reads what the thread serving s has written: the response head
+*   until it is complete, then body bytes, as many as s->buf holds.
+*   The end of the response ends the stream.
+*/
+static void read_stream(h2_conn* c, h2_stream* s)
+{
+    size_t hlen;
+    ssize_t n;
+
+    if(s->head_done)
+    {
+        n = read(s->fd, s->buf, sizeof(s->buf));
+        if(n < 0 && (errno == EINTR || errno == EAGAIN))
+            return;
+        if(n <= 0)
+        {
+            if(n == 0)
+                send_frame(c, H2_DATA, H2_END_STREAM, s->id, NULL, 0);
+            else
+                send_rst(c, s->id, H2_INTERNAL_ERROR);
+            close_stream(c, s);
+            return;
+        }
+        s->off = 0;
+        s->len = n;
+        return;
+    }
+
+    n = read(s->fd, s->buf + s->len, sizeof(s->buf) - s->len);
+    if(n < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if(n > 0)
+        s->len += n;
+
+    hlen = http_header_end(s->buf, s->len);
+    if(hlen == 0 && n > 0 && s->len < sizeof(s->buf))
+        return;
+    if(hlen == 0 || response_head(c, s, hlen) < 0)
+    {
+        send_status(c, s->id, 502);
+        close_stream(c, s);
+        return;
+    }
+    s->head_done = 1;
+    s->off = hlen;
+}
+
+/* flush_streams:
+*   Sends the response body bytes the streams hold, as far as the
+*   windows allow.
+*/
+static void flush_streams(h2_conn* c)
+{
+    int i;
+
+    for(i = 0; i < H2_MAX_STREAMS && c->window > 0; i++)
+    {
+        h2_stream* s = &c->streams[i];
+        long n = s->len - s->off;
+
+        if(s->id == 0 || !s->head_done || n == 0 || s->window <= 0)
+            continue;
+        if(n > s->window)
+            n = s->window;
+        if(n > c->window)
+            n = c->window;
+
+        send_frame(c, H2_DATA, 0, s->id, s->buf + s->off, n);
+        s->off += n;
+        s->window -= n;
+        c->window -= n;
+        if(s->off == s->len)
+            s->off = s->len = 0;
+    }
+}
+
+/* h2_serve:
+*   Serves an HTTP/2 connection on fd, whose first nearly bytes, at
+*   early, were already read, until the client closes it or it fails.
+*   The streams still open then are closed. client is the slot of the
+*   client in the limits.
+*/
+void h2_serve(int fd, const char* early, size_t nearly, int client)
+{
+    struct pollfd fds[H2_MAX_STREAMS + 1];
+    h2_stream* polled[H2_MAX_STREAMS + 1];
+    unsigned int ids[H2_MAX_STREAMS + 1];
+    unsigned char settings[6];
+    h2_conn* c = Calloc(1, sizeof(h2_conn));
+    ssize_t n;
+    int i;
+
+    c->fd = fd;
+    c->client = client;
+    c->window = H2_INITIAL_WINDOW;
+    c->initial_window = H2_INITIAL_WINDOW;
+    c->recv_window = H2_INITIAL_WINDOW;
+    hpack_table_init(&c->decoder);
+    for(i = 0; i < H2_MAX_STREAMS; i++)
+        c->streams[i].fd = -1;
+
+    pthread_mutex_lock(&h2_lock);
+    h2_connections++;
+    h2_active++;
+    pthread_mutex_unlock(&h2_lock);
+
+    //the rest of the preface, after which frames may already follow
+    if(nearly > sizeof(c->in))
+        nearly = sizeof(c->in);
+    memcpy(c->in, early, nearly);
+    c->in_len = nearly;
+    while(c->in_len < H2_PREFACE_LEN)
+    {
+        n = read(fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        c->in_len += n;
+    }
+
+    if(c->in_len >= H2_PREFACE_LEN &&
+       !memcmp(c->in, H2_PREFACE, H2_PREFACE_LEN))
+    {
+        memmove(c->in, c->in + H2_PREFACE_LEN, c->in_len - H2_PREFACE_LEN);
+        c->in_len -= H2_PREFACE_LEN;
+
+        settings[0] = 0;
+        settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+        put32(settings + 2, H2_MAX_STREAMS);
+        send_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+        dbg_printf("HTTP/2 connection\n");
+
+        while(handle_frames(c) == 0)
+        {
+            int nfds = 1;
+
+            flush_streams(c);
+            if(c->goaway && c->nstreams == 0)
+                break;
+
+            //a stream is read from while its head is incomplete, or
+            //when what it sent has gone out and there is window, and
+            //written to while it holds request body its thread hasn't
+            //taken
+            fds[0].fd = fd;
+            fds[0].events = POLLIN;
+            for(i = 0; i < H2_MAX_STREAMS; i++)
+            {
+                h2_stream* s = &c->streams[i];
+                short events = 0;
+                if(s->id == 0)
+                    continue;
+                if(!s->head_done || (s->off == s->len && s->window > 0 &&
+                                     c->window > 0))
+                    events |= POLLIN;
+                if(s->body_open && (s->body_off < s->body_len ||
+                                    s->frame_off < s->frame_len ||
+                                    s->body_end))
+                    events |= POLLOUT;
+                if(events == 0)
+                    continue;
+                fds[nfds].fd = s->fd;
+                fds[nfds].events = events;
+                polled[nfds] = s;
+                ids[nfds++] = s->id;
+            }
+
+            int ready = poll(fds, nfds,
+                             c->nstreams ? -1 : H2_IDLE_TIMEOUT * 1000);
+            if(ready < 0 && errno == EINTR)
+                continue;
+            if(ready == 0)
+                conn_error(c, H2_NO_ERROR);
+            if(ready <= 0)
+                break;
+
+            for(i = 1; i < nfds; i++)
+            {
+                if(fds[i].revents == 0 || polled[i]->id != ids[i])
+                    continue;
+                if(fds[i].events & POLLOUT)
+                    pump_body(c, polled[i]);
+                if(fds[i].events & POLLIN)
+                    read_stream(c, polled[i]);
+            }
+
+            if(fds[0].revents)
+            {
+                n = read(fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+                if(n < 0 && errno == EINTR)
+                    continue;
+                if(n <= 0)
+                    break;
+                c->in_len += n;
+            }
+        }
+    }
+
+    for(i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if(c->streams[i].id != 0)
+            close_stream(c, &c->streams[i]);
+    }
+    hpack_table_free(&c->decoder);
+    Free(c);
+
+    pthread_mutex_lock(&h2_lock);
+    h2_active--;
+    pthread_mutex_unlock(&h2_lock);
+}
+
+/* printH2Stats:
+*   Writes the HTTP/2 frontend's counters to out, read without
+*   locking.
+*/
+void printH2Stats(FILE* out)
+{
+    fprintf(out, "HTTP/2: %s, %lu connections (%lu active), %lu streams, "
+            "%lu refused, %lu reset past their window, "
+            "%lu connection errors\n",
+            h2_enabled ? "on" : "off", h2_connections, h2_active,
+            h2_streams, h2_refused, h2_flow_resets, h2_errors);
+}
@@ -0,0 +1,62 @@
+/* HTTP/2 over cleartext TCP (h2c), for clients that know in advance
+   the proxy speaks it and open with the connection preface instead of
+   an HTTP/1 request. One thread owns the client connection: it reads
+   frames, decodes header blocks with HPACK and writes frames back,
+   while each stream is served by the same code as an HTTP/1 request,
+   in a thread of its own. The two ends talk over a socketpair: the
+   stream's request goes in as an HTTP/1.0 request (its body, if any,
+   chunked unless the client gave its length) and the HTTP/1 response
+   that comes out is turned back into HEADERS and DATA frames. The
+   connection thread never blocks on a stream: a request body is held
+   for the stream's thread up to the stream's window, which is only
+   given back to the client as that thread takes the bytes, and a
+   client sending past it has the stream reset.
+   Every request that opens a stream is counted against the client of
+   the connection under -L (see limit.h), and answered 429 once it has
+   made all it may; the stream's handler is given the client so that
+   its fetch and bandwidth count against it too */
+
+#ifndef __H2_H__
+#define __H2_H__
+
+#include <stdio.h>
+#include "hpack.h"
+
+/* The client connection preface, the first line of which the HTTP/1
+   parser sees as the request line of method PRI */
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+/* Largest frame payload we send or accept, the least a peer must
+   accept */
+#define H2_FRAME_SIZE 16384
+
+/* Streams a client may have open at once; further ones are refused */
+#define H2_MAX_STREAMS 100
+
+/* Flow control window of a new stream and of the connection, until
+   the client's settings say otherwise */
+#define H2_INITIAL_WINDOW 65535
+
+/* Largest header block (with its CONTINUATION frames) we accept, and
+   most fields it may hold */
+#define H2_MAX_HEADER_BLOCK 65536
+#define H2_MAX_FIELDS 128
+
+/* Seconds a connection may go without a frame while no stream is open */
+#define H2_IDLE_TIMEOUT 300
+
+/* Set by -2: connections that open with the preface are served */
+extern int h2_enabled;
+
+/* Serves one stream, given our end of its socketpair and the slot of
+   the connection's client in the limits: reads the request from it
+   and writes the response to it */
+typedef void (*h2_handler)(int fd, int client);
+
+void h2_init(h2_handler handler);
+int h2_preface(const char* buf, size_t len);
+void h2_serve(int fd, const char* early, size_t nearly, int client);
+void printH2Stats(FILE* out);
+
+#endif /* __H2_H__ */
@@ -0,0 +1,263 @@
+/*
+* Hedged requests to origins. See hedge.h.
+*/
+#include <poll.h>
+#include "hedge.h"
+#include "timeout.h"
+#include "csapp.h"
+
+
+#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+int hedge_percent = 0;
+
+/* The last answer times of an origin, in milliseconds: a ring of
+   count samples, the next one going at next */
+typedef struct hedge_host{
+  unsigned long key;
+  long samples[HEDGE_SAMPLES];
+  int count;
+  int next;
+} hedge_host;
+
+static hedge_host hosts[HEDGE_HOSTS];
+
+/* The budget, in hundredths of a hedge */
+static long tokens = 0;
+
+/* Counters reported by printHedgeStats */
+static unsigned long requests = 0;
+static unsigned long hedges = 0;
+static unsigned long hedges_won = 0;
+static unsigned long held_back = 0;
+
+static pthread_mutex_t hedge_lock;
+
+void hedge_init()
+{
+    pthread_mutex_init(&hedge_lock, 0);
+}
+
+
+static long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static int compare_ms(const void* a, const void* b)
+{
+    long x = *(const long*)a, y = *(const long*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* p95:
+*   Returns the 95th percentile of the answer times kept for host, or
+*   -1 if there are too few of them. Called with hedge_lock held.
+*/
+static long p95(hedge_host* host)
+{
+    long sorted[HEDGE_SAMPLES];
+
+    if(host->count < HEDGE_MIN_SAMPLES)
+        return -1;
+    memcpy(sorted, host->samples, host->count * sizeof(long));
+    qsort(sorted, host->count, sizeof(long), compare_ms);
+    return sorted[(host->count * 95 + 99) / 100 - 1];
+}
+
+/* hedge_start:
+*   Sets up h for a request to port on host that is about to go out,
+*   and earns the budget its share of a hedge.
+*/
+void hedge_start(hedge* h, const char* host, int port)
+{
+    unsigned long key = 14695981039346656037UL;
+    const char* p;
+
+    for(p = host; *p; p++)
+        key = (key ^ (unsigned char)*p) * 1099511628211UL;
+    key = (key ^ port) * 1099511628211UL;
+
+    h->key = key;
+    h->slot = key % HEDGE_HOSTS;
+    h->sent = now_ms();
+    h->answered = 0;
+
+    pthread_mutex_lock(&hedge_lock);
+    requests++;
+    tokens += hedge_percent;
+    if(tokens > HEDGE_BURST * 100)
+        tokens = HEDGE_BURST * 100;
+
+    //an origin that takes the slot of another starts with no samples
+    hedge_host* slot = &hosts[h->slot];
+    if(slot->key != key)
+    {
+        slot->key = key;
+        slot->count = 0;
+        slot->next = 0;
+    }
+    h->delay = p95(slot);
+    pthread_mutex_unlock(&hedge_lock);
+
+    if(h->delay >= 0 && h->delay < HEDGE_MIN_DELAY)
+        h->delay = HEDGE_MIN_DELAY;
+}
+
+/* hedge_due:
+*   Waits until fd has an answer or the time to hedge comes. Returns 1
+*   if the request is to be hedged now, which spends from the budget,
+*   0 otherwise.
+*/
+int hedge_due(hedge* h, int fd)
+{
+    struct pollfd pfd;
+    long wait;
+
+    //no point in a hedge once the request has timed out
+    if(h->delay < 0 || (timeout_secs[TIMEOUT_PHASE_TTFB] > 0 &&
+                        h->delay >= timeout_secs[TIMEOUT_PHASE_TTFB] * 1000L))
+        return 0;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    wait = h->sent + h->delay - now_ms();
+    if(poll(&pfd, 1, wait > 0 ? wait : 0) != 0)
+        return 0;
+
+    pthread_mutex_lock(&hedge_lock);
+    int go = tokens >= 100;
+    if(go)
+    {
+        tokens -= 100;
+        hedges++;
+    }
+    else
+        held_back++;
+    pthread_mutex_unlock(&hedge_lock);
+    return go;
+}
+
+/* answers:
+*   Tells whether what fd has to read is the start of an answer rather
+*   than the end of the connection.
+*/
+static int answers(int fd)
+{
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+/* hedge_race:
+*   Waits for the first of first, the connection h went out on, and
+*   second, the hedge just sent, to answer, until the time to the
+*   first byte runs out. A connection that closes without answering
+*   drops out unless it is the last one left. Returns the connection
+*   that answered, the other being closed, or -1 if neither answered
+*   in time, both being closed.
+*/
+int hedge_race(hedge* h, int first, int second)
+{
+    struct pollfd fds[2];
+    long hedged = now_ms();
+    long deadline = timeout_secs[TIMEOUT_PHASE_TTFB] > 0 ?
+                    h->sent + timeout_secs[TIMEOUT_PHASE_TTFB] * 1000L : 0;
+    int winner = -1;
+    int i;
+
+    fds[0].fd = first;
+    fds[1].fd = second;
+    fds[0].events = fds[1].events = POLLIN;
+
+    while(winner < 0 && (fds[0].fd >= 0 || fds[1].fd >= 0))
+    {
+        long wait = -1;
+        if(deadline > 0 && (wait = deadline - now_ms()) <= 0)
+            break;
+
+        int ready = poll(fds, 2, wait);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready <= 0)
+            break;
+
+        for(i = 0; i < 2 && winner < 0; i++)
+        {
+            if(fds[i].fd < 0 || fds[i].revents == 0)
+                continue;
+            //the last one left is relayed as it is, answer or not
+            if(answers(fds[i].fd) || fds[1 - i].fd < 0)
+                winner = i;
+            else
+            {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+            }
+        }
+    }
+
+    for(i = 0; i < 2; i++)
+    {
+        if(i != winner && fds[i].fd >= 0)
+            close(fds[i].fd);
+    }
+    if(winner < 0)
+        return -1;
+
+    if(winner == 1)
+    {
+        //the hedge's own wait is what the origin took
+        h->sent = hedged;
+        pthread_mutex_lock(&hedge_lock);
+        hedges_won++;
+        pthread_mutex_unlock(&hedge_lock);
+    }
+    dbg_printf("Hedge race won by the %s request\n",
+               winner ? "hedged" : "first");
+    return fds[winner].fd;
+}
+
+/* hedge_answered:
+*   Samples the time the answer to h took to start, the first time it
+*   is called for h.
+*/
+void hedge_answered(hedge* h)
+{
+    if(h->answered)
+        return;
+    h->answered = 1;
+
+    long ms = now_ms() - h->sent;
+    pthread_mutex_lock(&hedge_lock);
+    hedge_host* host = &hosts[h->slot];
+    if(host->key == h->key)
+    {
+        host->samples[host->next] = ms;
+        host->next = (host->next + 1) % HEDGE_SAMPLES;
+        if(host->count < HEDGE_SAMPLES)
+            host->count++;
+    }
+    pthread_mutex_unlock(&hedge_lock);
+}
+
+/* printHedgeStats:
+*   Writes the hedging counters to out, read without locking.
+*/
+void printHedgeStats(FILE* out)
+{
+    if(hedge_percent > 0)
+        fprintf(out, "Hedging: %d%% budget, %lu requests, %lu hedged (%lu won "
+                "by the hedge), %lu held back by the budget\n", hedge_percent,
+                requests, hedges, hedges_won, held_back);
+    else
+        fprintf(out, "Hedging: off\n");
+}
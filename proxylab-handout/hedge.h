@@ -0,0 +1,53 @@
+/* Hedged requests to origins, to cut the tail of miss latency that a
+   slow origin replica causes. The time to the first byte of each
+   answer is sampled per origin; once enough samples are in, a request
+   whose answer hasn't started by the origin's p95 of them is sent a
+   second time, on a new connection to another of the origin's
+   addresses (upstream.h), and whichever connection answers first is
+   used while the other is closed. Only GET and HEAD requests without
+   a body are hedged, and hedges are capped by a global budget: each
+   such request earns hedge_percent hundredths of a hedge, up to
+   HEDGE_BURST saved, and each hedge spends one */
+
+#ifndef __HEDGE_H__
+#define __HEDGE_H__
+
+#include <stdio.h>
+
+/* Share of requests that may be hedged by default (-H), in percent */
+#define HEDGE_PERCENT 5
+
+/* Most hedges that the budget can save up */
+#define HEDGE_BURST 10
+
+/* Origins whose answer times are kept, and how many of the last
+   answers are kept for each; no request to an origin is hedged before
+   HEDGE_MIN_SAMPLES are in */
+#define HEDGE_HOSTS 256
+#define HEDGE_SAMPLES 64
+#define HEDGE_MIN_SAMPLES 20
+
+/* Least wait in milliseconds before a hedge, however fast the origin */
+#define HEDGE_MIN_DELAY 10
+
+/* A request that may be hedged: the slot of its origin, when it went
+   out and after how long (-1: never) it is hedged, in milliseconds */
+typedef struct hedge{
+  unsigned long key;
+  int slot;
+  long sent;
+  long delay;
+  int answered;
+} hedge;
+
+/* Percent of requests that may be hedged, 0 when hedging is off */
+extern int hedge_percent;
+
+void hedge_init();
+void hedge_start(hedge* h, const char* host, int port);
+int hedge_due(hedge* h, int fd);
+int hedge_race(hedge* h, int first, int second);
+void hedge_answered(hedge* h);
+void printHedgeStats(FILE* out);
+
+#endif /* __HEDGE_H__ */
@@ -0,0 +1,567 @@
+/*
+* HPACK header compression. See hpack.h.
+*/
+#include "hpack.h"
+#include "csapp.h"
+
+
+/* The static table, RFC 7541 appendix A. Index 1 is its first entry */
+static const char* static_table[HPACK_STATIC_ENTRIES][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* The Huffman code, RFC 7541 appendix B: the code of each byte value,
+   right aligned, and its length in bits. End of string, symbol 256,
+   is thirty 1 bits */
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_BITS 30
+
+static const unsigned int huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+static const unsigned char huffman_bits[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+/* Canonical decoding tables made by hpack_init: the codes of each
+   length are consecutive numbers, first_code[n] the smallest of the
+   count[n] codes n bits long, whose symbols are listed in order from
+   symbols[offset[n]] */
+static unsigned int first_code[HUFFMAN_MAX_BITS + 1];
+static unsigned int code_count[HUFFMAN_MAX_BITS + 1];
+static unsigned int code_offset[HUFFMAN_MAX_BITS + 1];
+static unsigned short symbols[HUFFMAN_EOS + 1];
+
+
+/* hpack_init:
+*   Builds the Huffman decoding tables. Called once at startup.
+*/
+void hpack_init()
+{
+    unsigned int n, sym, bits, code, k = 0;
+
+    for(n = 1; n <= HUFFMAN_MAX_BITS; n++)
+    {
+        code_offset[n] = k;
+        code_count[n] = 0;
+        first_code[n] = 0;
+        for(sym = 0; sym <= HUFFMAN_EOS; sym++)
+        {
+            bits = sym == HUFFMAN_EOS ? HUFFMAN_MAX_BITS : huffman_bits[sym];
+            code = sym == HUFFMAN_EOS ? 0x3fffffff : huffman_codes[sym];
+            if(bits != n)
+                continue;
+            if(code_count[n] == 0)
+                first_code[n] = code;
+            symbols[k++] = sym;
+            code_count[n]++;
+        }
+    }
+}
+
+/* hpack_table_init:
+*   Makes t an empty dynamic table of the default size.
+*/
+void hpack_table_init(hpack_table* t)
+{
+    t->first = 0;
+    t->count = 0;
+    t->size = 0;
+    t->max_size = HPACK_TABLE_SIZE;
+}
+
+/* evict:
+*   Drops the oldest entries of t until size more bytes fit within
+*   its limit, or it is empty.
+*/
+static void evict(hpack_table* t, size_t size)
+{
+    while(t->count > 0 && t->size + size > t->max_size)
+    {
+        hpack_entry* e = &t->entries[(t->first + t->count - 1) %
+                                     HPACK_MAX_ENTRIES];
+        t->size -= e->nlen + e->vlen + 32;
+        free(e->name);
+        t->count--;
+    }
+}
+
+/* hpack_table_free:
+*   Releases the entries of t.
+*/
+void hpack_table_free(hpack_table* t)
+{
+    t->max_size = 0;
+    evict(t, 0);
+}
+
+/* insert:
+*   Adds a field to t as its newest entry, evicting what it must. A
+*   field larger than the whole table just empties it.
+*/
+static void insert(hpack_table* t, const char* name, size_t nlen,
+                   const char* value, size_t vlen)
+{
+    size_t size = nlen + vlen + 32;
+    hpack_entry* e;
+
+    evict(t, size);
+    if(size > t->max_size)
+        return;
+
+    t->first = (t->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    e = &t->entries[t->first];
+    e->name = Malloc(nlen + vlen + 1);
+    memcpy(e->name, name, nlen);
+    e->value = e->name + nlen;
+    memcpy(e->value, value, vlen);
+    e->nlen = nlen;
+    e->vlen = vlen;
+    t->count++;
+    t->size += size;
+}
+
+/* lookup:
+*   Finds the entry at index (static entries first, then the dynamic
+*   table from its newest entry). Returns 0, or -1 for no such entry.
+*/
+static int lookup(hpack_table* t, size_t index, const char** name,
+                  size_t* nlen, const char** value, size_t* vlen)
+{
+    if(index == 0)
+        return -1;
+    if(index <= HPACK_STATIC_ENTRIES)
+    {
+        *name = static_table[index - 1][0];
+        *nlen = strlen(*name);
+        *value = static_table[index - 1][1];
+        *vlen = strlen(*value);
+        return 0;
+    }
+
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if(index >= t->count)
+        return -1;
+    hpack_entry* e = &t->entries[(t->first + index) % HPACK_MAX_ENTRIES];
+    *name = e->name;
+    *nlen = e->nlen;
+    *value = e->value;
+    *vlen = e->vlen;
+    return 0;
+}
+
+/* decode_int:
+*   Reads an integer with a prefix bits long prefix starting at *p,
+*   advancing *p past it. Returns 0, or -1 if it is cut short or too
+*   large.
+*/
+static int decode_int(const unsigned char** p, const unsigned char* end,
+                      int prefix, size_t* value)
+{
+    size_t max = (1 << prefix) - 1;
+    size_t v;
+    int shift = 0;
+
+    if(*p >= end)
+        return -1;
+    v = *(*p)++ & max;
+    if(v < max)
+    {
+        *value = v;
+        return 0;
+    }
+
+    while(*p < end && shift <= 28)
+    {
+        unsigned char b = *(*p)++;
+        v += (size_t)(b & 0x7f) << shift;
+        shift += 7;
+        if(!(b & 0x80))
+        {
+            *value = v;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* huffman_decode:
+*   Decodes the len Huffman coded bytes at p into out, of size bytes.
+*   Returns the length decoded, or -1 if the string is not valid (an
+*   unknown code, EOS, padding that is not a prefix of EOS) or does
+*   not fit.
+*/
+static long huffman_decode(const unsigned char* p, size_t len, char* out,
+                           size_t size)
+{
+    unsigned long bits = 0;
+    unsigned int nbits = 0, n, v;
+    size_t i, outlen = 0;
+
+    for(i = 0; i < len; i++)
+    {
+        bits = (bits << 8 | p[i]) & ((1UL << (nbits + 8)) - 1);
+        nbits += 8;
+
+        while(nbits >= 5)
+        {
+            int sym = -1;
+            for(n = 5; n <= nbits && n <= HUFFMAN_MAX_BITS; n++)
+            {
+                v = bits >> (nbits - n);
+                if(v >= first_code[n] && v - first_code[n] < code_count[n])
+                {
+                    sym = symbols[code_offset[n] + v - first_code[n]];
+                    break;
+                }
+            }
+            if(sym < 0 && nbits >= HUFFMAN_MAX_BITS)
+                return -1;
+            if(sym < 0)
+                break;
+            if(sym == HUFFMAN_EOS || outlen == size)
+                return -1;
+            out[outlen++] = sym;
+            nbits -= n;
+            bits &= (1UL << nbits) - 1;
+        }
+    }
+
+    if(nbits > 7 || bits != (1UL << nbits) - 1)
+        return -1;
+    return outlen;
+}
+
+/* decode_string:
+*   Reads a string literal starting at *p into buf, advancing *p past
+*   it and *used past the string in buf. Returns 0, or -1 if it is
+*   malformed or buf is full.
+*/
+static int decode_string(const unsigned char** p, const unsigned char* end,
+                         char* buf, size_t size, size_t* used,
+                         http_slice* s)
+{
+    int huffman;
+    size_t len;
+    long n;
+
+    if(*p >= end)
+        return -1;
+    huffman = **p & 0x80;
+    if(decode_int(p, end, 7, &len) < 0 || len > end - *p)
+        return -1;
+
+    if(huffman)
+        n = huffman_decode(*p, len, buf + *used, size - *used);
+    else if(len <= size - *used)
+        memcpy(buf + *used, *p, n = len);
+    else
+        n = -1;
+    if(n < 0)
+        return -1;
+
+    s->p = buf + *used;
+    s->len = n;
+    *used += n;
+    *p += len;
+    return 0;
+}
+
+/* copy_field:
+*   Copies a table entry into buf as a field, advancing *used.
+*   Returns 0, or -1 if buf is full.
+*/
+static int copy_field(char* buf, size_t size, size_t* used,
+                      const char* p, size_t len, http_slice* s)
+{
+    if(len > size - *used)
+        return -1;
+    memcpy(buf + *used, p, len);
+    s->p = buf + *used;
+    s->len = len;
+    *used += len;
+    return 0;
+}
+
+/* hpack_decode:
+*   Decodes the header block of len bytes at block, updating the
+*   dynamic table t as it says. The fields are stored in fields, at
+*   most max of them, with their names and values copied into buf of
+*   size bytes. Returns the number of fields, or -1 if the block is
+*   malformed, refers to entries that do not exist, or does not fit;
+*   the connection can't go on after that, as t may be out of step.
+*/
+int hpack_decode(hpack_table* t, const unsigned char* block, size_t len,
+                 char* buf, size_t size, hpack_field* fields, int max)
+{
+    const unsigned char* p = block;
+    const unsigned char* end = block + len;
+    size_t used = 0, index;
+    int n = 0;
+
+    while(p < end)
+    {
+        const char *name, *value;
+        size_t nlen, vlen;
+        int prefix, indexing = 0;
+
+        if(*p & 0x80)
+        {
+            //indexed field
+            if(decode_int(&p, end, 7, &index) < 0 ||
+               lookup(t, index, &name, &nlen, &value, &vlen) < 0 ||
+               n == max ||
+               copy_field(buf, size, &used, name, nlen, &fields[n].name) < 0 ||
+               copy_field(buf, size, &used, value, vlen, &fields[n].value) < 0)
+                return -1;
+            n++;
+            continue;
+        }
+
+        if((*p & 0xe0) == 0x20)
+        {
+            //dynamic table size update, which may only open a block
+            if(n > 0 || decode_int(&p, end, 5, &index) < 0 ||
+               index > HPACK_TABLE_SIZE)
+                return -1;
+            t->max_size = index;
+            evict(t, 0);
+            continue;
+        }
+
+        //literal field, added to the table or not; without indexing
+        //and never indexed only differ for intermediaries that
+        //re-encode, and we never pass fields on in HPACK
+        if((*p & 0xc0) == 0x40)
+        {
+            prefix = 6;
+            indexing = 1;
+        }
+        else
+            prefix = 4;
+
+        if(n == max || decode_int(&p, end, prefix, &index) < 0)
+            return -1;
+        if(index > 0)
+        {
+            if(lookup(t, index, &name, &nlen, &value, &vlen) < 0 ||
+               copy_field(buf, size, &used, name, nlen, &fields[n].name) < 0)
+                return -1;
+        }
+        else if(decode_string(&p, end, buf, size, &used, &fields[n].name) < 0)
+            return -1;
+        if(decode_string(&p, end, buf, size, &used, &fields[n].value) < 0)
+            return -1;
+
+        if(indexing)
+            insert(t, fields[n].name.p, fields[n].name.len,
+                   fields[n].value.p, fields[n].value.len);
+        n++;
+    }
+
+    return n;
+}
+
+/* encode_int:
+*   Writes value with a prefix bits long prefix at out, the bits above
+*   the prefix in the first byte set to first. Returns the bytes
+*   written, or 0 if they don't fit in size.
+*/
+static size_t encode_int(unsigned char* out, size_t size, int prefix,
+                         unsigned char first, size_t value)
+{
+    size_t max = (1 << prefix) - 1;
+    size_t n = 1;
+
+    if(size == 0)
+        return 0;
+    if(value < max)
+    {
+        out[0] = first | value;
+        return 1;
+    }
+
+    out[0] = first | max;
+    value -= max;
+    while(value >= 0x80)
+    {
+        if(n == size)
+            return 0;
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if(n == size)
+        return 0;
+    out[n++] = value;
+    return n;
+}
+
+/* encode_string:
+*   Writes a string literal without Huffman coding, lowercased if
+*   lower is set. Returns the bytes written, or 0 if they don't fit.
+*/
+static size_t encode_string(unsigned char* out, size_t size, const char* s,
+                            size_t len, int lower)
+{
+    size_t n = encode_int(out, size, 7, 0, len), i;
+
+    if(n == 0 || len > size - n)
+        return 0;
+    for(i = 0; i < len; i++)
+        out[n + i] = lower ? tolower((unsigned char)s[i]) : s[i];
+    return n + len;
+}
+
+/* hpack_encode:
+*   Writes the field name: value as a literal without indexing, with
+*   the name lowercased as HTTP/2 wants it. Returns the bytes written
+*   at out, or 0 if they don't fit in size.
+*/
+size_t hpack_encode(unsigned char* out, size_t size, const char* name,
+                    size_t nlen, const char* value, size_t vlen)
+{
+    size_t n, m;
+
+    if(size == 0)
+        return 0;
+    out[0] = 0;
+    if((n = encode_string(out + 1, size - 1, name, nlen, 1)) == 0 ||
+       (m = encode_string(out + 1 + n, size - 1 - n, value, vlen, 0)) == 0)
+        return 0;
+    return 1 + n + m;
+}
+
+/* hpack_encode_status:
+*   Writes the :status pseudo-header, named by its static table entry.
+*   Returns the bytes written, or 0 if they don't fit in size.
+*/
+size_t hpack_encode_status(unsigned char* out, size_t size, int status)
+{
+    char value[3] = { '0' + status / 100 % 10, '0' + status / 10 % 10,
+                      '0' + status % 10 };
+    size_t n;
+
+    //literal without indexing, name of static entry 8 (:status: 200)
+    if((n = encode_int(out, size, 4, 0, 8)) == 0)
+        return 0;
+    size_t m = encode_string(out + n, size - n, value, 3, 0);
+    return m == 0 ? 0 : n + m;
+}
@@ -0,0 +1,60 @@
+/* HPACK, the header compression of HTTP/2 (RFC 7541). Header blocks
+   from a client are decoded against the static table and the dynamic
+   table the client's encoder builds up over the connection, with the
+   Huffman coding of strings undone. Header blocks we send are only
+   made of literals that are added to no table, without Huffman
+   coding, so the client's decoder never depends on state of ours */
+
+#ifndef __HPACK_H__
+#define __HPACK_H__
+
+#include <stddef.h>
+#include "http.h"
+
+/* Size of the dynamic table a peer may use, the HTTP/2 default; its
+   encoder can only shrink it */
+#define HPACK_TABLE_SIZE 4096
+
+/* Most entries the dynamic table can hold, as each costs 32 bytes on
+   top of its name and value */
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)
+
+/* Number of entries of the static table */
+#define HPACK_STATIC_ENTRIES 61
+
+/* One entry of the dynamic table, name and value in one allocation */
+typedef struct hpack_entry{
+  char* name;
+  size_t nlen;
+  char* value;
+  size_t vlen;
+} hpack_entry;
+
+/* The dynamic table: a ring of count entries, the newest at first.
+   size counts what the entries take as RFC 7541 does (their lengths
+   plus 32 each), max_size is the limit the encoder last set */
+typedef struct hpack_table{
+  hpack_entry entries[HPACK_MAX_ENTRIES];
+  int first;
+  int count;
+  size_t size;
+  size_t max_size;
+} hpack_table;
+
+/* A decoded header field. Both slices point into the buffer given to
+   hpack_decode */
+typedef struct hpack_field{
+  http_slice name;
+  http_slice value;
+} hpack_field;
+
+void hpack_init();
+void hpack_table_init(hpack_table* t);
+void hpack_table_free(hpack_table* t);
+int hpack_decode(hpack_table* t, const unsigned char* block, size_t len,
+                 char* buf, size_t size, hpack_field* fields, int max);
+size_t hpack_encode(unsigned char* out, size_t size, const char* name,
+                    size_t nlen, const char* value, size_t vlen);
+size_t hpack_encode_status(unsigned char* out, size_t size, int status);
+
+#endif /* __HPACK_H__ */
@@ -0,0 +1,1136 @@
+/*
+* Helpers for inspecting raw HTTP messages. All functions work on
+* byte ranges rather than C strings, since cached responses may
+* contain NUL bytes in their bodies, and the request parser hands
+* out slices of the receive buffer instead of copying out strings.
+*/
+#include <limits.h>
+#include "http.h"
+#include "csapp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86
+#endif
+
+
+/* Request parser states */
+#define PARSE_REQUEST_LINE 0
+#define PARSE_HEADERS 1
+#define PARSE_DONE 2
+
+/* Size of the header name hash table, a power of two */
+#define HEADER_SLOTS 32
+
+/* Names of the headers classified by http_header_id, by id */
+static const char* header_names[HTTP_HDR_COUNT] = {
+    NULL, "Host", "User-Agent", "Accept", "Accept-Encoding",
+    "Connection", "Proxy-Connection", "Keep-Alive", "Range",
+    "Content-Length", "Transfer-Encoding", "If-None-Match",
+    "If-Modified-Since", "If-Range"
+};
+
+/* Header ids by hash slot, HTTP_HDR_OTHER for empty slots */
+static unsigned char header_slots[HEADER_SLOTS];
+
+static const char* find_scalar(const char* p, size_t len, int c);
+
+/* The byte scanner picked by http_init for this CPU */
+static const char* (*find_char)(const char*, size_t, int) = find_scalar;
+static const char* scanner_name = "scalar";
+
+
+/* find_scalar:
+*   Byte at a time search, for CPUs without vector instructions and
+*   for the tails of buffers shorter than a vector.
+*/
+static const char* find_scalar(const char* p, size_t len, int c)
+{
+    const char* end = p + len;
+
+    for(; p < end; p++)
+    {
+        if(*p == (char)c)
+            return p;
+    }
+
+    return NULL;
+}
+
+#ifdef HTTP_SCAN_X86
+/* find_sse2:
+*   Compares 16 bytes at a time with the byte searched for.
+*/
+__attribute__((target("sse2")))
+static const char* find_sse2(const char* p, size_t len, int c)
+{
+    const char* end = p + len;
+    __m128i needle = _mm_set1_epi8((char)c);
+
+    while(end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if(mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+
+    return find_scalar(p, end - p, c);
+}
+
+/* find_avx2:
+*   Compares 32 bytes at a time with the byte searched for.
+*/
+__attribute__((target("avx2")))
+static const char* find_avx2(const char* p, size_t len, int c)
+{
+    const char* end = p + len;
+    __m256i needle = _mm256_set1_epi8((char)c);
+
+    while(end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+        if(mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+
+    //the tail of a short line, in the VEX encoded 16 byte form so the
+    //CPU doesn't pay for switching back to legacy SSE
+    if(end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        unsigned mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm256_castsi256_si128(needle)));
+        if(mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+
+    for(; p < end; p++)
+    {
+        if(*p == (char)c)
+            return p;
+    }
+
+    return NULL;
+}
+#endif
+
+/* header_hash:
+*   Hash of a header name, from its length and its first and last
+*   characters, case folded. It is collision free for the names in
+*   header_names; http_init checks that it stays so when one is added.
+*/
+static unsigned header_hash(const char* name, size_t len)
+{
+    unsigned first = (unsigned char)name[0] | 0x20;
+    unsigned last = (unsigned char)name[len - 1] | 0x20;
+
+    return (len + 7 * first + last) & (HEADER_SLOTS - 1);
+}
+
+/* http_init:
+*   Picks the fastest byte scanner the CPU supports and fills the
+*   header name hash table. Must be called before any other function
+*   of this module is used.
+*/
+void http_init()
+{
+    int id;
+
+    memset(header_slots, HTTP_HDR_OTHER, sizeof(header_slots));
+    for(id = 1; id < HTTP_HDR_COUNT; id++)
+    {
+        unsigned slot = header_hash(header_names[id], strlen(header_names[id]));
+        if(header_slots[slot] != HTTP_HDR_OTHER)
+        {
+            fprintf(stderr, "http_init: %s collides with %s\n",
+                    header_names[id], header_names[header_slots[slot]]);
+            exit(1);
+        }
+        header_slots[slot] = id;
+    }
+
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if(http_use_scanner("avx2") < 0)
+        http_use_scanner("sse2");
+#endif
+}
+
+/* http_use_scanner:
+*   Switches the byte scanner to the one called name ("scalar", "sse2"
+*   or "avx2"). Returns -1 if the CPU doesn't support it.
+*/
+int http_use_scanner(const char* name)
+{
+    if(!strcmp(name, "scalar"))
+        find_char = find_scalar;
+#ifdef HTTP_SCAN_X86
+    else if(!strcmp(name, "sse2") && __builtin_cpu_supports("sse2"))
+        find_char = find_sse2;
+    else if(!strcmp(name, "avx2") && __builtin_cpu_supports("avx2"))
+        find_char = find_avx2;
+#endif
+    else
+        return -1;
+
+    scanner_name = name;
+    return 0;
+}
+
+/* http_scanner:
+*   Returns the name of the byte scanner in use.
+*/
+const char* http_scanner()
+{
+    return scanner_name;
+}
+
+/* http_find_char:
+*   Returns the first byte equal to c among the len bytes at p, or NULL.
+*/
+const char* http_find_char(const char* p, size_t len, int c)
+{
+    return find_char(p, len, c);
+}
+
+
+/* http_request_init:
+*   Prepares req for parsing a new request.
+*/
+void http_request_init(http_request* req)
+{
+    req->state = PARSE_REQUEST_LINE;
+    req->pos = 0;
+    req->scan = 0;
+    req->nheaders = 0;
+    req->head_len = 0;
+}
+
+/* is_token:
+*   Checks that the len bytes at s form an HTTP token (a method or a
+*   header name).
+*/
+static int is_token(const char* s, size_t len)
+{
+    size_t i;
+
+    if(len == 0)
+        return 0;
+
+    for(i = 0; i < len; i++)
+    {
+        unsigned char c = s[i];
+        if(!isalnum(c) && !strchr("!#$%&'*+-.^_`|~", c))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* parse_request_line:
+*   Splits "METHOD target HTTP/1.x" (without its line ending) into
+*   slices. Returns 0, or -1 if the line is malformed.
+*/
+static int parse_request_line(http_request* req, const char* line, size_t len)
+{
+    const char* end = line + len;
+    const char* sp1 = memchr(line, ' ', len);
+    const char* sp2;
+
+    if(sp1 == NULL)
+        return -1;
+    sp2 = memchr(sp1 + 1, ' ', end - sp1 - 1);
+    if(sp2 == NULL || sp2 == sp1 + 1)
+        return -1;
+
+    req->method.p = line;
+    req->method.len = sp1 - line;
+    req->target.p = sp1 + 1;
+    req->target.len = sp2 - sp1 - 1;
+    req->version.p = sp2 + 1;
+    req->version.len = end - sp2 - 1;
+
+    if(!is_token(req->method.p, req->method.len))
+        return -1;
+    if(req->version.len != 8 || strncmp(req->version.p, "HTTP/1.", 7) ||
+       !isdigit((unsigned char)req->version.p[7]))
+        return -1;
+
+    return 0;
+}
+
+/* parse_header_line:
+*   Adds the header "Name: value" (without its line ending) to req,
+*   with the whitespace around the value trimmed. Returns 0, or -1 if
+*   the line is malformed or there are too many headers.
+*/
+static int parse_header_line(http_request* req, const char* line, size_t len)
+{
+    const char* colon = find_char(line, len, ':');
+    const char* value;
+    const char* end = line + len;
+
+    //folded continuation lines are obsolete and refused
+    if(colon == NULL || !is_token(line, colon - line) ||
+       req->nheaders == HTTP_MAX_HEADERS)
+        return -1;
+
+    value = colon + 1;
+    while(value < end && (*value == ' ' || *value == '\t'))
+        value++;
+    while(end > value && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+
+    http_header* h = &req->headers[req->nheaders++];
+    h->name.p = line;
+    h->name.len = colon - line;
+    h->value.p = value;
+    h->value.len = end - value;
+    h->id = http_header_id(h->name.p, h->name.len);
+
+    return 0;
+}
+
+/* http_parse_request:
+*   Parses as much of the request head held in the first len bytes of
+*   buf as has arrived. Only the bytes not seen by earlier calls are
+*   scanned, and each line is handled once it is complete. Returns
+*   HTTP_PARSE_DONE once the empty line ending the head has been read,
+*   HTTP_PARSE_AGAIN if more bytes are needed, or HTTP_PARSE_ERROR.
+*/
+int http_parse_request(http_request* req, const char* buf, size_t len)
+{
+    while(req->state != PARSE_DONE)
+    {
+        const char* nl = find_char(buf + req->scan, len - req->scan, '\n');
+        if(nl == NULL)
+        {
+            req->scan = len;
+            return HTTP_PARSE_AGAIN;
+        }
+
+        const char* line = buf + req->pos;
+        size_t linelen = nl - line;
+        if(linelen > 0 && line[linelen - 1] == '\r')
+            linelen--;
+
+        if(req->state == PARSE_REQUEST_LINE)
+        {
+            //empty lines before the request line are ignored
+            if(linelen > 0)
+            {
+                if(parse_request_line(req, line, linelen) < 0)
+                    return HTTP_PARSE_ERROR;
+                req->state = PARSE_HEADERS;
+            }
+        }
+        else if(linelen == 0)
+        {
+            req->state = PARSE_DONE;
+            req->head_len = nl + 1 - buf;
+        }
+        else if(parse_header_line(req, line, linelen) < 0)
+            return HTTP_PARSE_ERROR;
+
+        req->pos = req->scan = nl + 1 - buf;
+    }
+
+    return HTTP_PARSE_DONE;
+}
+
+/* http_header_id:
+*   Classifies a header name (case-insensitively) as one of the
+*   HTTP_HDR_ values, HTTP_HDR_OTHER for headers the proxy passes on
+*   without looking at them. The hash picks the only known name the
+*   header can be, a single comparison then confirms it.
+*/
+int http_header_id(const char* name, size_t len)
+{
+    int id;
+
+    if(len == 0)
+        return HTTP_HDR_OTHER;
+
+    id = header_slots[header_hash(name, len)];
+    if(id != HTTP_HDR_OTHER && strlen(header_names[id]) == len &&
+       !strncasecmp(name, header_names[id], len))
+        return id;
+
+    return HTTP_HDR_OTHER;
+}
+
+/* http_request_header:
+*   Returns the value of the first header of req classified as id, or
+*   NULL if the request has none.
+*/
+const http_slice* http_request_header(const http_request* req, int id)
+{
+    int i;
+
+    for(i = 0; i < req->nheaders; i++)
+    {
+        if(req->headers[i].id == id)
+            return &req->headers[i].value;
+    }
+
+    return NULL;
+}
+
+/* http_parse_authority:
+*   Splits the authority part of a URL, or a Host header value, of the
+*   form host[:port] into host and port (80 if none is given). The host
+*   of an IPv6 literal ("[::1]:8080") is returned without brackets.
+*   Returns 0, or -1 if the host is empty or the port invalid.
+*/
+int http_parse_authority(const http_slice* auth, http_slice* host, int* port)
+{
+    const char* p = auth->p;
+    const char* end = auth->p + auth->len;
+    const char* colon = NULL;
+
+    *port = 80;
+
+    if(p < end && *p == '[')
+    {
+        const char* close = memchr(p, ']', end - p);
+        if(close == NULL)
+            return -1;
+        host->p = p + 1;
+        host->len = close - p - 1;
+        if(close + 1 < end)
+        {
+            if(close[1] != ':')
+                return -1;
+            colon = close + 1;
+        }
+    }
+    else
+    {
+        colon = memchr(p, ':', end - p);
+        host->p = p;
+        host->len = (colon ? colon : end) - p;
+    }
+
+    if(host->len == 0)
+        return -1;
+
+    //"host:" with an empty port means the default one
+    if(colon != NULL && colon + 1 < end)
+    {
+        const char* d;
+        int value = 0;
+        for(d = colon + 1; d < end; d++)
+        {
+            if(!isdigit((unsigned char)*d) || value > 65535)
+                return -1;
+            value = value * 10 + (*d - '0');
+        }
+        if(value == 0 || value > 65535)
+            return -1;
+        *port = value;
+    }
+
+    return 0;
+}
+
+/* http_parse_connect:
+*   Splits the target of a CONNECT, which must be of the form
+*   host:port, into host and port. Returns 0, or -1 if it isn't.
+*/
+int http_parse_connect(const http_slice* target, http_slice* host, int* port)
+{
+    const char* p = target->p + target->len;
+
+    //the port is mandatory: the target must end in ":digits"
+    while(p > target->p && isdigit((unsigned char)p[-1]))
+        p--;
+    if(p == target->p + target->len || p == target->p || p[-1] != ':')
+        return -1;
+
+    return http_parse_authority(target, host, port);
+}
+
+/* http_parse_target:
+*   Splits a request target into the host, port and path to request
+*   from the origin, as slices of the target. An absolute http:// URL
+*   gives all three (a URL without a path gets "/"). For a target in
+*   origin form ("/path") only path is set and host is left empty, the
+*   host then comes from the Host header.
+*   Returns 0, or -1 for targets the proxy can't fetch.
+*/
+int http_parse_target(const http_slice* target, http_slice* host, int* port,
+                      http_slice* path)
+{
+    const char* p = target->p;
+    const char* end = target->p + target->len;
+
+    *port = 80;
+    host->p = p;
+    host->len = 0;
+
+    if(target->len > 0 && p[0] == '/')
+    {
+        *path = *target;
+        return 0;
+    }
+
+    if(target->len < 7 || strncasecmp(p, "http://", 7))
+        return -1;
+
+    //the authority runs up to the path, query or end of the URL
+    http_slice auth;
+    auth.p = p + 7;
+    auth.len = 0;
+    while(auth.p + auth.len < end && !strchr("/?#", auth.p[auth.len]))
+        auth.len++;
+
+    if(http_parse_authority(&auth, host, port) < 0)
+        return -1;
+
+    const char* aend = auth.p + auth.len;
+    if(aend < end && *aend == '/')
+    {
+        path->p = aend;
+        path->len = end - aend;
+    }
+    else
+    {
+        path->p = "/";
+        path->len = 1;
+    }
+
+    return 0;
+}
+
+/* http_slice_is:
+*   Case-insensitive comparison of a slice with a C string.
+*/
+int http_slice_is(const http_slice* s, const char* str)
+{
+    return strlen(str) == s->len && !strncasecmp(s->p, str, s->len);
+}
+
+
+/* http_parse_meta:
+*   Fills meta from the header block of a response, the len bytes at
+*   block. Returns 0, or -1 if the status line is malformed or the
+*   block is incomplete.
+*/
+int http_parse_meta(const char* block, size_t len, http_meta* meta)
+{
+    const char* end = block + len;
+    const char* line;
+
+    memset(meta, 0, sizeof(*meta));
+    meta->content_length = -1;
+
+    if(len < 12 || strncmp(block, "HTTP/1.", 7) || block[8] != ' ' ||
+       !isdigit((unsigned char)block[9]) || !isdigit((unsigned char)block[10]) ||
+       !isdigit((unsigned char)block[11]))
+        return -1;
+    meta->status = atoi(block + 9);
+
+    line = find_char(block, len, '\n');
+    if(line == NULL)
+        return -1;
+    line++;
+    meta->status_end = line - block;
+
+    while(line < end)
+    {
+        const char* eol = find_char(line, end - line, '\n');
+        const char* vend;
+        const char* value;
+        const char* colon;
+
+        if(eol == NULL)
+            return -1;
+
+        //the blank line ending the block
+        if(line[0] == '\n' || (line[0] == '\r' && eol == line + 1))
+        {
+            meta->head_end = line - block;
+            return 0;
+        }
+
+        colon = find_char(line, eol - line, ':');
+        if(colon != NULL)
+        {
+            http_slice name;
+            name.p = line;
+            name.len = colon - line;
+
+            value = colon + 1;
+            vend = eol;
+            while(value < vend && (*value == ' ' || *value == '\t'))
+                value++;
+            while(vend > value && isspace((unsigned char)vend[-1]))
+                vend--;
+
+            if(http_slice_is(&name, "Content-Length"))
+            {
+                meta->content_length = atol(value);
+                meta->cl_start = line - block;
+                meta->cl_end = eol + 1 - block;
+            }
+            else if(http_slice_is(&name, "ETag"))
+            {
+                meta->etag.p = value;
+                meta->etag.len = vend - value;
+                meta->etag_start = line - block;
+                meta->etag_end = eol + 1 - block;
+            }
+            else if(http_slice_is(&name, "Last-Modified"))
+            {
+                meta->last_modified.p = value;
+                meta->last_modified.len = vend - value;
+            }
+            else if(http_slice_is(&name, "Content-Type"))
+            {
+                meta->content_type.p = value;
+                meta->content_type.len = vend - value;
+                meta->ct_start = line - block;
+                meta->ct_end = eol + 1 - block;
+            }
+            else if(http_slice_is(&name, "Transfer-Encoding"))
+            {
+                meta->chunked = http_is_chunked(value, vend - value);
+                meta->te_start = line - block;
+                meta->te_end = eol + 1 - block;
+            }
+            else if(http_slice_is(&name, "Vary") &&
+                    http_value_contains(value, vend - value, "Accept-Encoding"))
+                meta->vary_encoding = 1;
+        }
+
+        line = eol + 1;
+    }
+
+    return -1;
+}
+
+/* http_parse_date:
+*   Parses an HTTP date in the preferred format
+*   ("Sun, 06 Nov 1994 08:49:37 GMT"). Returns -1 if it isn't one.
+*/
+time_t http_parse_date(const char* s, size_t len)
+{
+    static const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char buf[64], mon[4];
+    struct tm tm;
+    const char* m;
+
+    if(len >= sizeof(buf))
+        return -1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+
+    memset(&tm, 0, sizeof(tm));
+    if(sscanf(buf, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &tm.tm_mday, mon,
+              &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return -1;
+
+    m = strstr(months, mon);
+    if(strlen(mon) != 3 || m == NULL || (m - months) % 3 != 0)
+        return -1;
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+
+    return timegm(&tm);
+}
+
+/* parse_offset:
+*   Reads the decimal number making up all of the bytes from p to end.
+*   Returns -1 if there are none, other characters or too many digits.
+*/
+static long parse_offset(const char* p, const char* end)
+{
+    long value = 0;
+
+    if(p == end || end - p > 18)
+        return -1;
+
+    for(; p < end; p++)
+    {
+        if(!isdigit((unsigned char)*p))
+            return -1;
+        value = value * 10 + (*p - '0');
+    }
+
+    return value;
+}
+
+/* http_parse_ranges:
+*   Resolves the Range header value (len bytes at value) against a body
+*   of length bytes, storing the satisfiable ranges in ranges, which has
+*   room for HTTP_MAX_RANGES. Returns their number, 0 if none can be
+*   satisfied (a 416), or -1 if the header is to be ignored: a unit
+*   other than bytes, a malformed range or too many of them.
+*/
+int http_parse_ranges(const char* value, size_t len, long length,
+                      http_range* ranges)
+{
+    const char* end = value + len;
+    int n = 0;
+
+    if(len < 6 || strncasecmp(value, "bytes=", 6))
+        return -1;
+    value += 6;
+    //the set may not be empty
+    if(value == end)
+        return -1;
+
+    while(value < end)
+    {
+        const char* comma = memchr(value, ',', end - value);
+        const char* send = comma ? comma : end;
+        const char* dash;
+        long first, last;
+
+        while(value < send && isspace((unsigned char)*value))
+            value++;
+        while(send > value && isspace((unsigned char)send[-1]))
+            send--;
+
+        dash = memchr(value, '-', send - value);
+        if(dash == NULL)
+            return -1;
+
+        if(dash == value)
+        {
+            //"-n": the last n bytes
+            long suffix = parse_offset(dash + 1, send);
+            if(suffix < 0)
+                return -1;
+            first = suffix < length ? length - suffix : 0;
+            last = suffix > 0 ? length - 1 : -1;
+        }
+        else
+        {
+            first = parse_offset(value, dash);
+            last = dash + 1 == send ? LONG_MAX : parse_offset(dash + 1, send);
+            if(first < 0 || last < 0 || last < first)
+                return -1;
+            if(last >= length)
+                last = length - 1;
+        }
+
+        //ranges starting past the end (or empty) are left out
+        if(first < length && first <= last)
+        {
+            if(n == HTTP_MAX_RANGES)
+                return -1;
+            ranges[n].first = first;
+            ranges[n].last = last;
+            n++;
+        }
+
+        value = comma ? comma + 1 : end;
+    }
+
+    return n;
+}
+
+/* http_etag_matches:
+*   Checks whether the If-None-Match list (len bytes at list) names
+*   etag, or is "*". Weak and strong tags compare equal, as RFC 7232
+*   wants for If-None-Match.
+*/
+int http_etag_matches(const char* list, size_t len, const http_slice* etag)
+{
+    const char* end = list + len;
+    const char* tag = etag->p;
+    size_t tlen = etag->len;
+
+    if(tlen >= 2 && !strncmp(tag, "W/", 2))
+    {
+        tag += 2;
+        tlen -= 2;
+    }
+
+    while(list < end)
+    {
+        const char* comma = memchr(list, ',', end - list);
+        const char* iend = comma ? comma : end;
+
+        while(list < iend && isspace((unsigned char)*list))
+            list++;
+        while(iend > list && isspace((unsigned char)iend[-1]))
+            iend--;
+        if(iend - list == 1 && *list == '*')
+            return 1;
+        if(iend - list >= 2 && !strncmp(list, "W/", 2))
+            list += 2;
+        if(tlen > 0 && iend - list == tlen && !memcmp(list, tag, tlen))
+            return 1;
+
+        list = comma ? comma + 1 : end;
+    }
+
+    return 0;
+}
+
+/* http_find_header:
+*   Looks for the header called name in the header block that starts
+*   at block (a request or a response, first line included). Only the
+*   first len bytes are examined and the search stops at the empty line
+*   ending the headers. Returns a pointer to the trimmed value and its
+*   length in vlen, or NULL if the header is not present.
+*/
+const char* http_find_header(const char* block, size_t len,
+                             const char* name, size_t* vlen)
+{
+    const char* end = block + len;
+    const char* line = block;
+    size_t nlen = strlen(name);
+
+    while(line < end)
+    {
+        const char* eol = find_char(line, end - line, '\n');
+        if(eol == NULL)
+            eol = end;
+
+        //an empty line ends the header block
+        if(line != block && (line[0] == '\r' || line[0] == '\n'))
+            return NULL;
+
+        if((size_t)(eol - line) > nlen && !strncasecmp(line, name, nlen) &&
+           line[nlen] == ':')
+        {
+            const char* value = line + nlen + 1;
+            const char* vend = eol;
+            while(value < vend && (*value == ' ' || *value == '\t'))
+                value++;
+            while(vend > value && isspace((unsigned char)vend[-1]))
+                vend--;
+            *vlen = vend - value;
+            return value;
+        }
+
+        line = eol + 1;
+    }
+
+    return NULL;
+}
+
+/* http_header_end:
+*   Returns the length of the header block at the start of data,
+*   including the empty line that ends it, or 0 if the first len
+*   bytes do not contain a complete header block.
+*/
+size_t http_header_end(const char* data, size_t len)
+{
+    const char* line = data;
+    const char* end = data + len;
+
+    while(line < end)
+    {
+        const char* eol = find_char(line, end - line, '\n');
+        if(eol == NULL)
+            return 0;
+
+        if(line != data && (line[0] == '\n' || (line[0] == '\r' && eol == line + 1)))
+            return eol + 1 - data;
+
+        line = eol + 1;
+    }
+
+    return 0;
+}
+
+/* http_accepts_encoding:
+*   Checks whether the len bytes of an Accept-Encoding header value
+*   allow the content coding named coding, either by name or through
+*   "*". A coding listed with q=0 is refused.
+*/
+int http_accepts_encoding(const char* accept, size_t len, const char* coding)
+{
+    size_t clen = strlen(coding);
+    const char* end;
+    int star = 0;
+
+    if(accept == NULL)
+        return 0;
+    end = accept + len;
+
+    while(accept < end)
+    {
+        const char* comma = memchr(accept, ',', end - accept);
+        const char* tend = comma ? comma : end;
+        const char* token = accept;
+        const char* params;
+        size_t nlen;
+
+        while(token < tend && isspace((unsigned char)*token))
+            token++;
+        params = memchr(token, ';', tend - token);
+        nlen = (params ? params : tend) - token;
+        while(nlen > 0 && isspace((unsigned char)token[nlen - 1]))
+            nlen--;
+
+        int refused = 0;
+        if(params != NULL)
+        {
+            const char* q = params;
+            while(q < tend && (*q == ';' || isspace((unsigned char)*q)))
+                q++;
+            if(tend - q > 2 && !strncasecmp(q, "q=", 2) && atof(q + 2) == 0)
+                refused = 1;
+        }
+
+        if(nlen == clen && !strncasecmp(token, coding, clen))
+            return !refused;
+        if(nlen == 1 && token[0] == '*')
+            star = !refused;
+
+        accept = comma ? comma + 1 : end;
+    }
+
+    return star;
+}
+
+/* http_value_contains:
+*   Case-insensitive search for word inside the vlen bytes of a header
+*   value, e.g. "json" in a Content-Type or "no-transform" in a
+*   Cache-Control header.
+*/
+int http_value_contains(const char* value, size_t vlen, const char* word)
+{
+    size_t wlen = strlen(word);
+    size_t i;
+
+    for(i = 0; i + wlen <= vlen; i++)
+    {
+        if(!strncasecmp(value + i, word, wlen))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* http_parse_length:
+*   Parses a Content-Length value. Returns the length, or -1 if the
+*   value is not a plain decimal number.
+*/
+long http_parse_length(const char* value, size_t len)
+{
+    long n = 0;
+    size_t i;
+
+    if(len == 0 || len > 18)
+        return -1;
+
+    for(i = 0; i < len; i++)
+    {
+        if(!isdigit((unsigned char)value[i]))
+            return -1;
+        n = n * 10 + (value[i] - '0');
+    }
+
+    return n;
+}
+
+/* http_is_chunked:
+*   Whether a Transfer-Encoding value ends in the chunked coding, which
+*   is then what delimits the body.
+*/
+int http_is_chunked(const char* value, size_t len)
+{
+    const char* last = value;
+    const char* comma;
+
+    while((comma = memchr(last, ',', value + len - last)) != NULL)
+        last = comma + 1;
+    while(last < value + len && isspace((unsigned char)*last))
+        last++;
+    while(len > 0 && isspace((unsigned char)value[len - 1]))
+        len--;
+
+    return value + len - last == 7 && !strncasecmp(last, "chunked", 7);
+}
+
+/* States of http_chunked_step */
+#define CHUNK_SIZE 0
+#define CHUNK_EXT 1
+#define CHUNK_SIZE_LF 2
+#define CHUNK_DATA 3
+#define CHUNK_DATA_CR 4
+#define CHUNK_DATA_LF 5
+#define CHUNK_TRAILER 6
+#define CHUNK_TRAILER_LINE 7
+#define CHUNK_END_LF 8
+
+void http_chunked_init(http_chunked* c)
+{
+    memset(c, 0, sizeof(*c));
+}
+
+/* http_chunked_step:
+*   Feeds the len bytes at p, the next bytes of a chunked body, to the
+*   decoder c. It consumes either chunk data, which data is then set to
+*   point at, or framing (chunk sizes, line ends, trailers), in which
+*   case data is empty. Returns the number of bytes consumed, which is
+*   0 only once the body has ended (c->done), or -1 if the body is
+*   malformed. Callers loop until all their bytes are consumed; bytes
+*   left over when done is set come after the body.
+*/
+long http_chunked_step(http_chunked* c, const char* p, size_t len,
+                       http_slice* data)
+{
+    size_t i;
+
+    data->p = p;
+    data->len = 0;
+
+    if(c->state == CHUNK_DATA)
+    {
+        size_t n = len < c->size ? len : c->size;
+        data->len = n;
+        c->size -= n;
+        if(c->size == 0)
+            c->state = CHUNK_DATA_CR;
+        return n;
+    }
+
+    for(i = 0; i < len && !c->done && c->state != CHUNK_DATA; i++)
+    {
+        char ch = p[i];
+        int line_end = 0;
+
+        switch(c->state)
+        {
+        case CHUNK_SIZE:
+            if(isxdigit((unsigned char)ch))
+            {
+                if(++c->digits > 15)
+                    return -1;
+                c->size = c->size * 16 +
+                          (isdigit((unsigned char)ch) ? ch - '0' :
+                           (tolower((unsigned char)ch) - 'a' + 10));
+            }
+            else if(c->digits > 0 && (ch == ';' || ch == ' ' || ch == '\t'))
+                c->state = CHUNK_EXT;
+            else if(c->digits > 0 && ch == '\r')
+                c->state = CHUNK_SIZE_LF;
+            else if(c->digits > 0 && ch == '\n')
+                line_end = 1;
+            else
+                return -1;
+            break;
+        case CHUNK_EXT:
+            if(ch == '\r')
+                c->state = CHUNK_SIZE_LF;
+            else if(ch == '\n')
+                line_end = 1;
+            break;
+        case CHUNK_SIZE_LF:
+            if(ch != '\n')
+                return -1;
+            line_end = 1;
+            break;
+        case CHUNK_DATA_CR:
+            if(ch == '\r')
+                c->state = CHUNK_DATA_LF;
+            else if(ch == '\n')
+                c->state = CHUNK_SIZE;
+            else
+                return -1;
+            break;
+        case CHUNK_DATA_LF:
+            if(ch != '\n')
+                return -1;
+            c->state = CHUNK_SIZE;
+            break;
+        case CHUNK_TRAILER:
+            if(ch == '\r')
+                c->state = CHUNK_END_LF;
+            else if(ch == '\n')
+                c->done = 1;
+            else
+                c->state = CHUNK_TRAILER_LINE;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if(ch == '\n')
+                c->state = CHUNK_TRAILER;
+            break;
+        case CHUNK_END_LF:
+            if(ch != '\n')
+                return -1;
+            c->done = 1;
+            break;
+        }
+
+        //the end of a chunk size line: its data follows, or the
+        //trailer section if it was the last chunk
+        if(line_end)
+        {
+            c->state = c->size > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            c->digits = 0;
+        }
+    }
+
+    return i;
+}
+
+/* http_dechunk:
+*   Decodes the len bytes at buf, the next bytes of a chunked body, in
+*   place: the chunk data they hold is moved to the start of buf and
+*   the framing dropped, as are any bytes past the end of the body.
+*   Returns the number of data bytes, or -1 if the body is malformed.
+*/
+long http_dechunk(http_chunked* c, char* buf, size_t len)
+{
+    size_t pos = 0, out = 0;
+    http_slice data;
+    long n;
+
+    while(pos < len && !c->done)
+    {
+        if((n = http_chunked_step(c, buf + pos, len - pos, &data)) < 0)
+            return -1;
+        if(data.len > 0)
+        {
+            memmove(buf + out, data.p, data.len);
+            out += data.len;
+        }
+        pos += n;
+    }
+
+    return out;
+}
+
+/* http_compressible:
+*   Decides whether the body of a response, whose header block is the
+*   len bytes at headers, is worth gzipping: it must not already carry
+*   a content coding, the origin must not have forbidden
+*   transformations, and its type must be text-like (binary formats
+*   such as images are compressed already). Event streams are left
+*   alone, compressing them would hold their events back.
+*/
+int http_compressible(const char* headers, size_t len)
+{
+    size_t vlen;
+    const char* value;
+
+    value = http_find_header(headers, len, "Content-Encoding", &vlen);
+    if(value != NULL && !(vlen == 8 && !strncasecmp(value, "identity", 8)))
+        return 0;
+
+    value = http_find_header(headers, len, "Cache-Control", &vlen);
+    if(value != NULL && http_value_contains(value, vlen, "no-transform"))
+        return 0;
+
+    value = http_find_header(headers, len, "Content-Type", &vlen);
+    if(value == NULL || http_value_contains(value, vlen, "event-stream"))
+        return 0;
+
+    return !strncasecmp(value, "text/", 5) ||
+           http_value_contains(value, vlen, "json") ||
+           http_value_contains(value, vlen, "javascript") ||
+           http_value_contains(value, vlen, "xml");
+}
@@ -0,0 +1,157 @@
+/* Small helpers for looking at raw HTTP messages as they are read
+   off the wire: a request or response line followed by header lines,
+   each ending in "\r\n" (a bare "\n" is tolerated), and an empty line */
+
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+#include <time.h>
+
+/* A view of len bytes inside a buffer owned by someone else; it is
+   not NUL terminated */
+typedef struct http_slice{
+  const char *p;
+  size_t len;
+} http_slice;
+
+/* Headers the proxy looks at, as classified by http_header_id */
+enum {
+  HTTP_HDR_OTHER = 0,
+  HTTP_HDR_HOST,
+  HTTP_HDR_USER_AGENT,
+  HTTP_HDR_ACCEPT,
+  HTTP_HDR_ACCEPT_ENCODING,
+  HTTP_HDR_CONNECTION,
+  HTTP_HDR_PROXY_CONNECTION,
+  HTTP_HDR_KEEP_ALIVE,
+  HTTP_HDR_RANGE,
+  HTTP_HDR_CONTENT_LENGTH,
+  HTTP_HDR_TRANSFER_ENCODING,
+  HTTP_HDR_IF_NONE_MATCH,
+  HTTP_HDR_IF_MODIFIED_SINCE,
+  HTTP_HDR_IF_RANGE,
+  HTTP_HDR_COUNT
+};
+
+#define HTTP_MAX_HEADERS 100
+
+typedef struct http_header{
+  http_slice name;
+  http_slice value;
+  int id;
+} http_header;
+
+/* Parser state for one request head. The parser is fed the whole
+   receive buffer again each time more bytes have arrived and resumes
+   where it stopped; all slices point into that buffer, which must not
+   move while the request is in use. head_len is the size of the
+   request line and headers once the parse is done, and any bytes
+   after it belong to the body or the next request */
+typedef struct http_request{
+  int state;
+  size_t pos;
+  size_t scan;
+  http_slice method;
+  http_slice target;
+  http_slice version;
+  http_header headers[HTTP_MAX_HEADERS];
+  int nheaders;
+  size_t head_len;
+} http_request;
+
+/* What the proxy needs to know about a stored response, parsed once
+   from its header block (status line included) so that hits are
+   answered without looking at the headers again. The slices point
+   into that block and are empty when the header is missing.
+   status_end is where the status line ends, cl_start and cl_end
+   delimit the Content-Length line, ct_start and ct_end the
+   Content-Type line, te_start and te_end the Transfer-Encoding line
+   and etag_start and etag_end the ETag line (all 0 if there is none),
+   chunked tells whether that coding ends in chunked, and head_end is
+   where the blank line ending the block starts, so headers can be
+   dropped or added around them */
+typedef struct http_meta{
+  int status;
+  long content_length;
+  http_slice etag;
+  http_slice last_modified;
+  http_slice content_type;
+  size_t status_end;
+  size_t cl_start;
+  size_t cl_end;
+  size_t ct_start;
+  size_t ct_end;
+  size_t te_start;
+  size_t te_end;
+  size_t etag_start;
+  size_t etag_end;
+  int chunked;
+  size_t head_end;
+  int vary_encoding;
+} http_meta;
+
+/* One byte range of a Range header, resolved against the length of
+   the body: first and last are offsets of bytes within it */
+typedef struct http_range{
+  long first;
+  long last;
+} http_range;
+
+/* Largest number of ranges served from one request; asking for more
+   gets the whole object */
+#define HTTP_MAX_RANGES 8
+
+/* Decoder state for a body sent with the chunked transfer coding,
+   which http_chunked_step walks through one piece at a time: size is
+   the size of the chunk being read (what is left of it while its data
+   goes by) and done is set once the last chunk and the trailer
+   section after it have been seen */
+typedef struct http_chunked{
+  int state;
+  unsigned long size;
+  int digits;
+  int done;
+} http_chunked;
+
+/* Results of http_parse_request */
+#define HTTP_PARSE_ERROR -1
+#define HTTP_PARSE_AGAIN 0
+#define HTTP_PARSE_DONE 1
+
+void http_init();
+int http_use_scanner(const char* name);
+const char* http_scanner();
+const char* http_find_char(const char* p, size_t len, int c);
+
+void http_request_init(http_request* req);
+int http_parse_request(http_request* req, const char* buf, size_t len);
+int http_header_id(const char* name, size_t len);
+const http_slice* http_request_header(const http_request* req, int id);
+int http_parse_authority(const http_slice* auth, http_slice* host, int* port);
+int http_parse_connect(const http_slice* target, http_slice* host, int* port);
+int http_parse_target(const http_slice* target, http_slice* host, int* port,
+                      http_slice* path);
+int http_slice_is(const http_slice* s, const char* str);
+
+int http_parse_meta(const char* block, size_t len, http_meta* meta);
+time_t http_parse_date(const char* s, size_t len);
+int http_parse_ranges(const char* value, size_t len, long length,
+                      http_range* ranges);
+int http_etag_matches(const char* list, size_t len, const http_slice* etag);
+
+const char* http_find_header(const char* block, size_t len,
+                             const char* name, size_t* vlen);
+size_t http_header_end(const char* data, size_t len);
+int http_accepts_encoding(const char* accept, size_t len, const char* coding);
+int http_value_contains(const char* value, size_t vlen, const char* word);
+int http_compressible(const char* headers, size_t len);
+
+long http_parse_length(const char* value, size_t len);
+int http_is_chunked(const char* value, size_t len);
+void http_chunked_init(http_chunked* c);
+long http_chunked_step(http_chunked* c, const char* p, size_t len,
+                       http_slice* data);
+long http_dechunk(http_chunked* c, char* buf, size_t len);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,158 @@
+/*
+* Lanes for cache hits and misses. See lane.h.
+*/
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "lane.h"
+#include "csapp.h"
+
+
+#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+int lane_misses = 0;
+int lane_queue = LANE_QUEUE;
+
+/* Misses in the pool and waiting for it */
+static int busy = 0;
+static int waiting = 0;
+
+/* Counters reported by printLaneStats; hit times in microseconds */
+static unsigned long hits = 0;
+static unsigned long hit_us = 0;
+static unsigned long max_hit_us = 0;
+static unsigned long misses = 0;
+static unsigned long misses_queued = 0;
+static unsigned long misses_refused = 0;
+
+static pthread_mutex_t lane_lock;
+static pthread_cond_t lane_free;
+
+void lane_init()
+{
+    pthread_mutex_init(&lane_lock, 0);
+    pthread_cond_init(&lane_free, 0);
+}
+
+
+/* lane_parse:
+*   Sets the miss pool from "n,q"; q may be left out. Returns 0, or -1
+*   if spec is malformed.
+*/
+int lane_parse(const char* spec)
+{
+    char* end;
+    long n = strtol(spec, &end, 10);
+    long q = LANE_QUEUE;
+
+    if(end == spec || n < 0 || n > 100000)
+        return -1;
+    if(*end == ',')
+    {
+        spec = end + 1;
+        q = strtol(spec, &end, 10);
+        if(end == spec || q < 0 || q > 100000)
+            return -1;
+    }
+    if(*end != '\0')
+        return -1;
+
+    lane_misses = n;
+    lane_queue = q;
+    return 0;
+}
+
+/* lane_hit:
+*   Counts a hit whose request was looked up at start.
+*/
+void lane_hit(const struct timespec* start)
+{
+    struct timespec now;
+    unsigned long us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - start->tv_sec) * 1000000 +
+         (now.tv_nsec - start->tv_nsec) / 1000;
+
+    pthread_mutex_lock(&lane_lock);
+    hits++;
+    hit_us += us;
+    if(us > max_hit_us)
+        max_hit_us = us;
+    pthread_mutex_unlock(&lane_lock);
+}
+
+/* lane_miss_begin:
+*   Waits for a place in the miss pool, if it has a bound, and then
+*   lowers the priority of the calling thread. Returns 0 once the miss
+*   may go on, to be followed by lane_miss_end, or -1 if it is turned
+*   away.
+*/
+int lane_miss_begin()
+{
+    struct timespec deadline;
+    int ok = 1;
+
+    pthread_mutex_lock(&lane_lock);
+    misses++;
+    if(lane_misses > 0 && busy >= lane_misses)
+    {
+        if(waiting >= lane_queue)
+            ok = 0;
+        else
+        {
+            misses_queued++;
+            waiting++;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += LANE_WAIT;
+            while(busy >= lane_misses &&
+                  pthread_cond_timedwait(&lane_free, &lane_lock,
+                                         &deadline) == 0)
+                ;
+            waiting--;
+            ok = busy < lane_misses;
+        }
+    }
+    if(ok)
+        busy++;
+    else
+        misses_refused++;
+    pthread_mutex_unlock(&lane_lock);
+
+    if(ok && lane_misses > 0)
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), LANE_MISS_NICE);
+    return ok ? 0 : -1;
+}
+
+/* lane_miss_end:
+*   Gives back the place of a miss in the pool.
+*/
+void lane_miss_end()
+{
+    pthread_mutex_lock(&lane_lock);
+    busy--;
+    if(waiting > 0)
+        pthread_cond_signal(&lane_free);
+    pthread_mutex_unlock(&lane_lock);
+}
+
+/* printLaneStats:
+*   Writes the hits and misses of each lane to out, read without
+*   locking.
+*/
+void printLaneStats(FILE* out)
+{
+    fprintf(out, "Hit lane: %lu hits, %lu us on average, %lu us at most\n",
+            hits, hits ? hit_us / hits : 0, max_hit_us);
+    if(lane_misses > 0)
+        fprintf(out, "Miss lane: %lu misses, %d of %d busy, %d waiting, "
+                "%lu queued, %lu turned away\n", misses, busy, lane_misses,
+                waiting, misses_queued, misses_refused);
+    else
+        fprintf(out, "Miss lane: %lu misses, %d busy, no bound\n", misses, busy);
+}
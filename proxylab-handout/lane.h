@@ -0,0 +1,38 @@
+/* Separate lanes for cache hits and misses, so that hits stay fast
+   when the proxy is backed up with misses. Every request is read and
+   looked up in the cache by the thread of its connection; a hit is
+   answered right there and never waits on anything misses hold. With
+   -M n,q, a miss first needs a place in the miss pool: at most n
+   misses go to origins at once, q more wait for a place, up to
+   LANE_WAIT seconds, and the rest are answered 503. The thread of a
+   miss then drops to a lower CPU priority (LANE_MISS_NICE) for the
+   rest of its life, which is that of its connection, so that
+   relaying and compressing misses can't starve the threads serving
+   hits */
+
+#ifndef __LANE_H__
+#define __LANE_H__
+
+#include <stdio.h>
+#include <time.h>
+
+/* Misses that may wait for the pool by default, and for how long */
+#define LANE_QUEUE 256
+#define LANE_WAIT 30
+
+/* Nice value of the threads serving misses */
+#define LANE_MISS_NICE 10
+
+/* Misses served at once, 0 when the pool has no bound, and misses
+   that may wait */
+extern int lane_misses;
+extern int lane_queue;
+
+void lane_init();
+int lane_parse(const char* spec);
+void lane_hit(const struct timespec* start);
+int lane_miss_begin();
+void lane_miss_end();
+void printLaneStats(FILE* out);
+
+#endif /* __LANE_H__ */
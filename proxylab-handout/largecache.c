@@ -0,0 +1,365 @@
+/*
+* The store for large objects, kept as lists of fixed-size chunks.
+* See largecache.h for how it is organized.
+*/
+#include "largecache.h"
+#include "cache.h"
+#include "csapp.h"
+
+
+#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+/* Defining Global variables */
+static large_object* large_head = NULL;
+static unsigned long large_size = 0;
+static unsigned int large_clock = 0;
+static unsigned long large_seen[LARGE_SEEN_SLOTS];
+
+/* Counters reported by printLargeStats */
+static unsigned long large_admitted = 0;
+static unsigned long large_hits = 0;
+static unsigned long large_partial_hits = 0;
+static unsigned long large_chunk_evictions = 0;
+
+//Every operation updates some state, so a plain mutex is enough
+static pthread_mutex_t large_lock;
+
+void large_init()
+{
+    pthread_mutex_init(&large_lock, 0);
+}
+
+
+/* dropChunk:
+*   Drops a reference to chunk, freeing it with the last one.
+*   The caller must hold the large object lock.
+*/
+static void dropChunk(large_chunk* chunk)
+{
+    chunk->refcount--;
+    if(chunk->refcount == 0)
+    {
+        free(chunk->data);
+        free(chunk);
+    }
+}
+
+/* freeLarge:
+*   Frees an unlinked object that nobody is using any more.
+*/
+static void freeLarge(large_object* obj)
+{
+    free(obj->chunks);
+    free(obj->path);
+    free(obj->headers);
+    free(obj);
+}
+
+/* unlinkLarge:
+*   Removes obj (whose predecessor is prev, NULL for the head) from the
+*   store and gives back its chunks. Readers still holding obj find no
+*   chunks in it any more; the last of them frees it.
+*   The caller must hold the large object lock.
+*/
+static void unlinkLarge(large_object* prev, large_object* obj)
+{
+    if(prev == NULL)
+        large_head = obj->next;
+    else
+        prev->next = obj->next;
+
+    while(obj->present > 0)
+    {
+        obj->present--;
+        large_size -= obj->chunks[obj->present]->len;
+        dropChunk(obj->chunks[obj->present]);
+    }
+    large_size -= obj->header_size;
+    obj->evicted = 1;
+
+    if(obj->refcount == 0)
+        freeLarge(obj);
+}
+
+/* evictChunk:
+*   Drops the last chunk of the least recently used object that is not
+*   being filled, and the object itself once it has no chunks left.
+*   Returns 0 if there was nothing that could be evicted.
+*   The caller must hold the large object lock.
+*/
+static int evictChunk()
+{
+    large_object* victim = NULL;
+    large_object* victimPrev = NULL;
+    large_object* prev = NULL;
+    large_object* cursor;
+
+    for(cursor = large_head; cursor != NULL; cursor = cursor->next)
+    {
+        if(!cursor->filling &&
+           (victim == NULL || cursor->timestamp < victim->timestamp))
+        {
+            victim = cursor;
+            victimPrev = prev;
+        }
+        prev = cursor;
+    }
+
+    if(victim == NULL)
+        return 0;
+
+    if(victim->present > 0)
+    {
+        large_chunk* last = victim->chunks[--victim->present];
+        dbg_printf("LARGE >> Evicting chunk %u of %s\n", victim->present,
+                   victim->path);
+        large_size -= last->len;
+        dropChunk(last);
+        large_chunk_evictions++;
+    }
+
+    if(victim->present == 0)
+        unlinkLarge(victimPrev, victim);
+
+    return 1;
+}
+
+
+/* large_lookup:
+*   Finds the large object cached for path and takes a reference on
+*   it, to be dropped with large_release. Its chunks may only cover
+*   part of its body. Returns NULL if path is not in the store.
+*/
+large_object* large_lookup(char* path)
+{
+    large_object* cursor;
+
+    pthread_mutex_lock(&large_lock);
+    large_clock++;
+
+    for(cursor = large_head; cursor != NULL; cursor = cursor->next)
+    {
+        if(!strcmp(cursor->path, path))
+        {
+            cursor->timestamp = large_clock;
+            cursor->refcount++;
+            large_hits++;
+            if((unsigned long)cursor->present * LARGE_CHUNK_SIZE < cursor->length)
+                large_partial_hits++;
+            dbg_printf("LARGE >> Found %s with %u of %u chunks\n", path,
+                       cursor->present, cursor->nchunks);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&large_lock);
+    return cursor;
+}
+
+/* large_invalidate:
+*   Drops the object cached for path, if any, e.g. after a request
+*   that may have changed it.
+*/
+void large_invalidate(char* path)
+{
+    large_object* prev = NULL;
+    large_object* cursor;
+
+    pthread_mutex_lock(&large_lock);
+
+    for(cursor = large_head; cursor != NULL; cursor = cursor->next)
+    {
+        if(!strcmp(cursor->path, path))
+        {
+            dbg_printf("LARGE >> Invalidating %s\n", path);
+            unlinkLarge(prev, cursor);
+            break;
+        }
+        prev = cursor;
+    }
+
+    pthread_mutex_unlock(&large_lock);
+}
+
+/* large_admit:
+*   Decides whether the response with the given headers and a body of
+*   length bytes gets a place in the store. An object is admitted the
+*   second time its URL is fetched, if it is not too big. It then
+*   replaces any older copy and is returned referenced and marked as
+*   being filled: the caller stores its chunks with large_store from
+*   offset 0, then calls large_end_fill and large_release.
+*/
+large_object* large_admit(char* path, char* headers, unsigned int headerSize,
+                          unsigned long length)
+{
+    unsigned long h = cache_hash(CACHE_HASH_INIT, path, strlen(path));
+    unsigned long* seen = &large_seen[h % LARGE_SEEN_SLOTS];
+    large_object* prev = NULL;
+    large_object* cursor;
+
+    if(length == 0 || length > MAX_LARGE_OBJECT_SIZE)
+        return NULL;
+
+    pthread_mutex_lock(&large_lock);
+
+    if(*seen != h)
+    {
+        dbg_printf("LARGE >> First sight of %s, not admitted\n", path);
+        *seen = h;
+        pthread_mutex_unlock(&large_lock);
+        return NULL;
+    }
+
+    for(cursor = large_head; cursor != NULL; cursor = cursor->next)
+    {
+        if(!strcmp(cursor->path, path))
+        {
+            unlinkLarge(prev, cursor);
+            break;
+        }
+        prev = cursor;
+    }
+
+    large_object* obj = Calloc(1, sizeof(large_object));
+    obj->path = Malloc(strlen(path) + 1);
+    strcpy(obj->path, path);
+    obj->headers = Malloc(headerSize);
+    memcpy(obj->headers, headers, headerSize);
+    obj->header_size = headerSize;
+    http_parse_meta(obj->headers, headerSize, &obj->meta);
+    obj->stored = time(NULL);
+    obj->length = length;
+    obj->nchunks = (length + LARGE_CHUNK_SIZE - 1) / LARGE_CHUNK_SIZE;
+    obj->chunks = Calloc(obj->nchunks, sizeof(large_chunk*));
+    obj->filling = 1;
+    obj->refcount = 1;
+    obj->timestamp = ++large_clock;
+
+    obj->next = large_head;
+    large_head = obj;
+    large_size += headerSize;
+    large_admitted++;
+    dbg_printf("LARGE >> Admitted %s (%lu bytes)\n", path, length);
+
+    pthread_mutex_unlock(&large_lock);
+    return obj;
+}
+
+/* large_begin_fill:
+*   Lets the caller store the chunks of obj from body offset offset
+*   onwards, if that is where its cached prefix ends and nobody else is
+*   filling it already. Returns 1 if the caller became the filler.
+*/
+int large_begin_fill(large_object* obj, unsigned long offset)
+{
+    int ok;
+
+    pthread_mutex_lock(&large_lock);
+    ok = !obj->evicted && !obj->filling &&
+         offset == (unsigned long)obj->present * LARGE_CHUNK_SIZE;
+    if(ok)
+        obj->filling = 1;
+    pthread_mutex_unlock(&large_lock);
+
+    return ok;
+}
+
+/* large_store:
+*   Adds chunk number index of obj, taking over the len bytes at data.
+*   Chunks must come in order; one that does not follow the cached
+*   prefix (e.g. because obj was evicted meanwhile) is dropped.
+*/
+void large_store(large_object* obj, unsigned int index, char* data,
+                 unsigned int len)
+{
+    pthread_mutex_lock(&large_lock);
+
+    if(obj->evicted || index != obj->present || index >= obj->nchunks)
+    {
+        free(data);
+        pthread_mutex_unlock(&large_lock);
+        return;
+    }
+
+    large_chunk* chunk = Malloc(sizeof(large_chunk));
+    chunk->data = data;
+    chunk->len = len;
+    chunk->refcount = 1;
+    obj->chunks[index] = chunk;
+    obj->present++;
+    large_size += len;
+
+    while(large_size > MAX_LARGE_CACHE_SIZE && evictChunk())
+        ;
+
+    pthread_mutex_unlock(&large_lock);
+}
+
+/* large_end_fill:
+*   Ends the fill started by large_admit or large_begin_fill.
+*/
+void large_end_fill(large_object* obj)
+{
+    pthread_mutex_lock(&large_lock);
+    obj->filling = 0;
+    dbg_printf("LARGE >> %s now has %u of %u chunks\n", obj->path,
+               obj->present, obj->nchunks);
+    pthread_mutex_unlock(&large_lock);
+}
+
+/* large_get_chunk:
+*   Returns chunk number index of obj with a reference taken on it, to
+*   be dropped with large_put_chunk, or NULL if it is not cached.
+*/
+large_chunk* large_get_chunk(large_object* obj, unsigned int index)
+{
+    large_chunk* chunk = NULL;
+
+    pthread_mutex_lock(&large_lock);
+    if(index < obj->present)
+    {
+        chunk = obj->chunks[index];
+        chunk->refcount++;
+    }
+    pthread_mutex_unlock(&large_lock);
+
+    return chunk;
+}
+
+void large_put_chunk(large_chunk* chunk)
+{
+    pthread_mutex_lock(&large_lock);
+    dropChunk(chunk);
+    pthread_mutex_unlock(&large_lock);
+}
+
+/* large_release:
+*   Drops a reference taken by large_lookup or large_admit.
+*/
+void large_release(large_object* obj)
+{
+    pthread_mutex_lock(&large_lock);
+    obj->refcount--;
+    if(obj->evicted && obj->refcount == 0)
+        freeLarge(obj);
+    pthread_mutex_unlock(&large_lock);
+}
+
+/* printLargeStats:
+*   Prints the state of the large object store. Like printCacheStats
+*   it reads the counters without locking.
+*/
+void printLargeStats(FILE* out)
+{
+    fprintf(out, "large bytes: %lu of %u\n", large_size, MAX_LARGE_CACHE_SIZE);
+    fprintf(out, "large objects admitted: %lu\n", large_admitted);
+    fprintf(out, "large hits: %lu (%lu partial)\n", large_hits,
+            large_partial_hits);
+    fprintf(out, "large chunks evicted: %lu\n", large_chunk_evictions);
+}
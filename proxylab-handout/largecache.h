@@ -0,0 +1,66 @@
+/* Objects of MAX_OBJECT_SIZE bytes or more are kept apart from the
+   main cache, in a store of their own where each body is split into
+   LARGE_CHUNK_SIZE chunks. Chunks are evicted one at a time from the
+   end of the least recently used object, so a large object is always
+   cached as a prefix of its body: hits send the chunks that are there
+   and fetch the rest from the origin with a Range request */
+
+#ifndef __LARGECACHE_H__
+#define __LARGECACHE_H__
+
+#include <stdio.h>
+#include "http.h"
+
+#define LARGE_CHUNK_SIZE 65536
+#define MAX_LARGE_CACHE_SIZE (16 * 1024 * 1024)
+#define MAX_LARGE_OBJECT_SIZE (8 * 1024 * 1024)
+
+/* Number of URLs remembered to admit a large object only when it is
+   requested a second time, so one-off downloads don't flush the store */
+#define LARGE_SEEN_SLOTS 256
+
+/* refcount counts the object's own slot plus the readers sending it */
+typedef struct large_chunk{
+  char *data;
+  unsigned int len;
+  unsigned int refcount;
+} large_chunk;
+
+/* headers holds the response headers of the 200 the object came from,
+   meta what was parsed from them at time stored, and length the size
+   of its body. chunks has one slot per chunk of
+   the body; the first present slots are filled. filling is set while
+   a fetch is storing the chunks that follow. refcount and evicted
+   work as for a web_object */
+typedef struct large_object{
+  char *path;
+  char *headers;
+  unsigned int header_size;
+  http_meta meta;
+  time_t stored;
+  unsigned long length;
+  large_chunk **chunks;
+  unsigned int nchunks;
+  unsigned int present;
+  int filling;
+  unsigned int timestamp;
+  unsigned int refcount;
+  int evicted;
+  struct large_object* next;
+} large_object;
+
+void large_init();
+large_object* large_lookup(char* path);
+void large_invalidate(char* path);
+large_object* large_admit(char* path, char* headers, unsigned int headerSize,
+                          unsigned long length);
+int large_begin_fill(large_object* obj, unsigned long offset);
+void large_store(large_object* obj, unsigned int index, char* data,
+                 unsigned int len);
+void large_end_fill(large_object* obj);
+large_chunk* large_get_chunk(large_object* obj, unsigned int index);
+void large_put_chunk(large_chunk* chunk);
+void large_release(large_object* obj);
+void printLargeStats(FILE* out);
+
+#endif /* __LARGECACHE_H__ */
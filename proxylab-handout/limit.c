@@ -0,0 +1,370 @@
+/*
+* Limits per client address. See limit.h.
+*/
+#include "limit.h"
+#include "csapp.h"
+
+
+#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+int limits[LIMITS] = { 0, 0, 0, 0 };
+
+/* A client: its address (hashed), its open connections, its buckets
+   of requests (in thousandths) and bytes as of refilled (a time in
+   milliseconds), and its requests waiting for a turn to fetch and
+   the turns it was given that they haven't taken yet */
+typedef struct limit_client_t{
+  unsigned long key;
+  int conns;
+  long requests;
+  long bytes;
+  long refilled;
+  int waiting;
+  int granted;
+} limit_client_t;
+
+/* The clients, the last slot standing for requests that can't be
+   told apart by address */
+static limit_client_t clients[LIMIT_CLIENTS + 1];
+#define ANONYMOUS LIMIT_CLIENTS
+
+/* Fetches in flight, requests waiting for a turn, and the client
+   that got the last turn */
+static int fetching = 0;
+static int waiting = 0;
+static int turn = 0;
+
+/* Counters reported by printLimitStats */
+static unsigned long conns_refused = 0;
+static unsigned long requests_refused = 0;
+static unsigned long fetches_queued = 0;
+static unsigned long fetches_refused = 0;
+static unsigned long throttled_ms = 0;
+
+static pthread_mutex_t limit_lock;
+static pthread_cond_t limit_turn;
+
+void limit_init()
+{
+    pthread_mutex_init(&limit_lock, 0);
+    pthread_cond_init(&limit_turn, 0);
+}
+
+
+static long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static int limited()
+{
+    return limits[LIMIT_CONNS] || limits[LIMIT_REQUESTS] ||
+           limits[LIMIT_KB] || limits[LIMIT_FETCHES];
+}
+
+/* limit_parse:
+*   Sets the limits from "conns,req,kb,fetches"; limits left out at
+*   the end stay off. Returns 0, or -1 if spec is malformed.
+*/
+int limit_parse(const char* spec)
+{
+    int values[LIMITS] = { 0, 0, 0, 0 };
+    int i = 0;
+    char* end;
+
+    while(i < LIMITS)
+    {
+        long v = strtol(spec, &end, 10);
+        if(end == spec || v < 0 || v > 1000000)
+            return -1;
+        values[i++] = v;
+        if(*end == '\0')
+            break;
+        if(*end != ',')
+            return -1;
+        spec = end + 1;
+    }
+    if(*end != '\0')
+        return -1;
+
+    memcpy(limits, values, sizeof(limits));
+    return 0;
+}
+
+/* peer_key:
+*   Hashes the IP address of the peer of fd into key. Returns 0, or
+*   -1 if fd has no IP peer.
+*/
+static int peer_key(int fd, unsigned long* key)
+{
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+    const unsigned char* p;
+    size_t n, i;
+
+    if(getpeername(fd, (struct sockaddr*)&peer, &len) < 0)
+        return -1;
+    if(peer.ss_family == AF_INET)
+    {
+        p = (const unsigned char*)&((struct sockaddr_in*)&peer)->sin_addr;
+        n = sizeof(struct in_addr);
+    }
+    else if(peer.ss_family == AF_INET6)
+    {
+        p = (const unsigned char*)&((struct sockaddr_in6*)&peer)->sin6_addr;
+        n = sizeof(struct in6_addr);
+    }
+    else
+        return -1;
+
+    *key = 14695981039346656037UL;
+    for(i = 0; i < n; i++)
+        *key = (*key ^ p[i]) * 1099511628211UL;
+    //0 marks a slot never used
+    if(*key == 0)
+        *key = 1;
+    return 0;
+}
+
+/* find:
+*   Returns the slot of the client with key or, if it has none, a slot
+*   that no connection holds, made its own. Returns -1 if there is no
+*   such slot. Called with limit_lock held.
+*/
+static int find(unsigned long key)
+{
+    int i, free = -1;
+
+    for(i = 0; i < LIMIT_PROBES; i++)
+    {
+        int s = (key + i) % LIMIT_CLIENTS;
+        if(clients[s].key == key)
+            return s;
+        if(free < 0 && clients[s].conns == 0 && clients[s].waiting == 0)
+            free = s;
+    }
+    if(free < 0)
+        return -1;
+
+    //a new client starts with full buckets
+    clients[free].key = key;
+    clients[free].requests = limits[LIMIT_REQUESTS] * LIMIT_BURST * 1000L;
+    clients[free].bytes = limits[LIMIT_KB] * LIMIT_BURST * 1024L;
+    clients[free].refilled = now_ms();
+    clients[free].granted = 0;
+    return free;
+}
+
+/* refill:
+*   Adds to the buckets of c what they earned since last time, up to
+*   LIMIT_BURST seconds' worth. Called with limit_lock held.
+*/
+static void refill(limit_client_t* c)
+{
+    long now = now_ms();
+    long ms = now - c->refilled;
+    long cap;
+
+    if(ms <= 0)
+        return;
+    c->refilled = now;
+
+    cap = limits[LIMIT_REQUESTS] * LIMIT_BURST * 1000L;
+    c->requests += ms * limits[LIMIT_REQUESTS];
+    if(c->requests > cap)
+        c->requests = cap;
+
+    cap = limits[LIMIT_KB] * LIMIT_BURST * 1024L;
+    c->bytes += ms * limits[LIMIT_KB] * 1024L / 1000;
+    if(c->bytes > cap)
+        c->bytes = cap;
+}
+
+/* limit_accept:
+*   Counts a new connection fd against its client. Returns the slot of
+*   the client, -1 if it isn't limited, -2 if the client has as many
+*   connections as it may, or -3 if there is no room to keep track of
+*   it.
+*/
+int limit_accept(int fd)
+{
+    unsigned long key;
+    int client;
+
+    if(!limited() || peer_key(fd, &key) < 0)
+        return -1;
+
+    pthread_mutex_lock(&limit_lock);
+    client = find(key);
+    if(client >= 0 && limits[LIMIT_CONNS] > 0 &&
+       clients[client].conns >= limits[LIMIT_CONNS])
+        client = -2;
+    else if(client < 0)
+        client = -3;
+    else
+        clients[client].conns++;
+    if(client < 0)
+        conns_refused++;
+    pthread_mutex_unlock(&limit_lock);
+    return client;
+}
+
+/* limit_close:
+*   Ends a connection that limit_accept counted against client.
+*/
+void limit_close(int client)
+{
+    if(client < 0)
+        return;
+    pthread_mutex_lock(&limit_lock);
+    clients[client].conns--;
+    pthread_mutex_unlock(&limit_lock);
+}
+
+/* limit_request:
+*   Takes a request from the bucket of client. Returns 0, or -1 if
+*   the client has made all the requests it may for now.
+*/
+int limit_request(int client)
+{
+    int ok = 1;
+
+    if(client < 0 || limits[LIMIT_REQUESTS] == 0)
+        return 0;
+    pthread_mutex_lock(&limit_lock);
+    refill(&clients[client]);
+    if(clients[client].requests >= 1000)
+        clients[client].requests -= 1000;
+    else
+    {
+        ok = 0;
+        requests_refused++;
+    }
+    pthread_mutex_unlock(&limit_lock);
+    return ok ? 0 : -1;
+}
+
+/* limit_sent:
+*   Takes bytes relayed to client from its bucket, pausing until the
+*   bucket is no longer in debt.
+*/
+void limit_sent(int client, long bytes)
+{
+    long debt;
+
+    if(client < 0 || limits[LIMIT_KB] == 0)
+        return;
+    pthread_mutex_lock(&limit_lock);
+    refill(&clients[client]);
+    clients[client].bytes -= bytes;
+    debt = -clients[client].bytes;
+    if(debt > 0)
+        throttled_ms += debt * 1000 / (limits[LIMIT_KB] * 1024L);
+    pthread_mutex_unlock(&limit_lock);
+
+    if(debt > 0)
+    {
+        long us = debt * 1000000 / (limits[LIMIT_KB] * 1024L);
+        struct timespec ts = { us / 1000000, us % 1000000 * 1000 };
+        while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+/* limit_fetch_begin:
+*   Waits for a request of client to be allowed to go to the origin.
+*   Returns 0 once it may, to be followed by limit_fetch_end, or -1 if
+*   its turn didn't come in time.
+*/
+int limit_fetch_begin(int client)
+{
+    struct timespec deadline;
+    limit_client_t* c = &clients[client < 0 ? ANONYMOUS : client];
+    int ok = 0;
+
+    if(limits[LIMIT_FETCHES] == 0)
+        return 0;
+
+    pthread_mutex_lock(&limit_lock);
+    if(fetching < limits[LIMIT_FETCHES] && waiting == 0)
+    {
+        fetching++;
+        pthread_mutex_unlock(&limit_lock);
+        return 0;
+    }
+
+    fetches_queued++;
+    c->waiting++;
+    waiting++;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += LIMIT_QUEUE_WAIT;
+    while(c->granted == 0 &&
+          pthread_cond_timedwait(&limit_turn, &limit_lock, &deadline) == 0)
+        ;
+    //the slot came with the turn
+    if(c->granted > 0)
+    {
+        c->granted--;
+        ok = 1;
+    }
+    else
+        fetches_refused++;
+    c->waiting--;
+    waiting--;
+    pthread_mutex_unlock(&limit_lock);
+    return ok ? 0 : -1;
+}
+
+/* limit_fetch_end:
+*   Ends a fetch that limit_fetch_begin let go, handing its slot to
+*   the next client in turn that has a request waiting.
+*/
+void limit_fetch_end(int client)
+{
+    int i;
+
+    if(limits[LIMIT_FETCHES] == 0)
+        return;
+
+    pthread_mutex_lock(&limit_lock);
+    for(i = 1; waiting > 0 && i <= LIMIT_CLIENTS + 1; i++)
+    {
+        int s = (turn + i) % (LIMIT_CLIENTS + 1);
+        if(clients[s].waiting > clients[s].granted)
+        {
+            clients[s].granted++;
+            turn = s;
+            pthread_cond_broadcast(&limit_turn);
+            pthread_mutex_unlock(&limit_lock);
+            return;
+        }
+    }
+    fetching--;
+    pthread_mutex_unlock(&limit_lock);
+}
+
+/* printLimitStats:
+*   Writes the limits and how often they were hit to out, read without
+*   locking.
+*/
+void printLimitStats(FILE* out)
+{
+    if(limited())
+        fprintf(out, "Client limits: %d connections, %d requests/s, %d KB/s, "
+                "%d fetches; refused %lu connections and %lu requests, "
+                "%lu fetches queued (%lu timed out), %lu ms throttled\n",
+                limits[LIMIT_CONNS], limits[LIMIT_REQUESTS], limits[LIMIT_KB],
+                limits[LIMIT_FETCHES], conns_refused, requests_refused,
+                fetches_queued, fetches_refused, throttled_ms);
+    else
+        fprintf(out, "Client limits: off\n");
+}
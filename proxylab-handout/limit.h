@@ -0,0 +1,55 @@
+/* Limits per client address, so that one client can't starve the
+   others. Set with -L conns,req,kb,fetches (0, or left out: no limit):
+     conns    - connections a client may have open at once; more are
+                answered 429 as soon as they are accepted
+     req      - requests per second, a token bucket that saves up to
+                LIMIT_BURST seconds' worth; more are answered 429
+     kb       - KB per second relayed from origins to a client, the
+                relay pausing once its bucket runs dry
+     fetches  - requests to origins in flight at once, over all
+                clients. A request that finds them all busy waits its
+                turn; turns go round the clients that are waiting, one
+                at a time, so a client with many waiting doesn't hold
+                up one with a few. A request that waits longer than
+                LIMIT_QUEUE_WAIT is answered 503
+   Clients are told apart by IP address, looked up once per connection
+   by limit_accept; the slot it returns goes along with the requests of
+   the connection, HTTP/2 streams included (see h2.h) */
+
+#ifndef __LIMIT_H__
+#define __LIMIT_H__
+
+#include <stdio.h>
+#include <sys/socket.h>
+
+/* The limits, in the order -L takes them */
+#define LIMIT_CONNS 0
+#define LIMIT_REQUESTS 1
+#define LIMIT_KB 2
+#define LIMIT_FETCHES 3
+#define LIMITS 4
+
+/* Seconds of requests or bytes a bucket saves up */
+#define LIMIT_BURST 2
+
+/* Clients tracked at once, and the slots looked at for a client */
+#define LIMIT_CLIENTS 1024
+#define LIMIT_PROBES 8
+
+/* Seconds a request may wait for its turn to go to the origin */
+#define LIMIT_QUEUE_WAIT 10
+
+/* The limits, 0 meaning none */
+extern int limits[LIMITS];
+
+void limit_init();
+int limit_parse(const char* spec);
+int limit_accept(int fd);
+void limit_close(int client);
+int limit_request(int client);
+void limit_sent(int client, long bytes);
+int limit_fetch_begin(int client);
+void limit_fetch_end(int client);
+void printLimitStats(FILE* out);
+
+#endif /* __LIMIT_H__ */
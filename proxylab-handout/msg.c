@@ -0,0 +1,233 @@
+/*
+* Gather-write messages. See msg.h.
+*/
+#include <stdarg.h>
+#include "msg.h"
+#include "csapp.h"
+
+
+/* msg_init:
+*   Makes m an empty message.
+*/
+void msg_init(msg* m)
+{
+    m->niov = 0;
+    m->len = 0;
+    m->nheaders = 0;
+    m->used = 0;
+    m->overflow = 0;
+}
+
+/* msg_add:
+*   Appends the len bytes at p, which must stay valid until the
+*   message has been sent.
+*/
+void msg_add(msg* m, const void* p, size_t len)
+{
+    if(len == 0)
+        return;
+
+    if(m->niov == MSG_MAX_IOV)
+    {
+        m->overflow = 1;
+        return;
+    }
+
+    m->iov[m->niov].iov_base = (void*)p;
+    m->iov[m->niov].iov_len = len;
+    m->niov++;
+    m->len += len;
+}
+
+/* msg_add_str:
+*   Appends the C string s.
+*/
+void msg_add_str(msg* m, const char* s)
+{
+    msg_add(m, s, strlen(s));
+}
+
+/* msg_add_slice:
+*   Appends the bytes of a slice.
+*/
+void msg_add_slice(msg* m, const http_slice* s)
+{
+    msg_add(m, s->p, s->len);
+}
+
+/* msg_add_chain:
+*   Appends every segment of c.
+*/
+void msg_add_chain(msg* m, const chain* c)
+{
+    chain_seg* seg;
+
+    for(seg = c->head; seg != NULL; seg = seg->next)
+        msg_add(m, seg->data + seg->off, seg->len);
+}
+
+/* msg_add_chain_range:
+*   Appends the len bytes of c starting at offset off.
+*/
+void msg_add_chain_range(msg* m, const chain* c, unsigned long off,
+                         unsigned long len)
+{
+    chain_seg* seg;
+
+    for(seg = c->head; seg != NULL && len > 0; seg = seg->next)
+    {
+        if(off >= seg->len)
+        {
+            off -= seg->len;
+            continue;
+        }
+
+        unsigned long n = seg->len - off < len ? seg->len - off : len;
+        msg_add(m, seg->data + seg->off + off, n);
+        len -= n;
+        off = 0;
+    }
+}
+
+/* msg_append:
+*   Appends the pieces of other, which must outlive m's sending.
+*/
+void msg_append(msg* m, const msg* other)
+{
+    int i;
+
+    for(i = 0; i < other->niov; i++)
+        msg_add(m, other->iov[i].iov_base, other->iov[i].iov_len);
+    if(other->overflow)
+        m->overflow = 1;
+}
+
+/* msg_printf:
+*   Appends formatted text, written into the message's scratch space.
+*/
+void msg_printf(msg* m, const char* fmt, ...)
+{
+    size_t room = MSG_SCRATCH - m->used;
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(m->scratch + m->used, room, fmt, ap);
+    va_end(ap);
+
+    if(n < 0 || n >= room)
+    {
+        m->overflow = 1;
+        return;
+    }
+
+    msg_add(m, m->scratch + m->used, n);
+    m->used += n;
+}
+
+/* msg_add_header:
+*   Appends the header line "name: value" and indexes it.
+*/
+void msg_add_header(msg* m, const char* name, size_t nlen,
+                    const char* value, size_t vlen)
+{
+    if(m->nheaders == MSG_MAX_HEADERS)
+    {
+        m->overflow = 1;
+        return;
+    }
+
+    http_header* h = &m->headers[m->nheaders++];
+    h->name.p = name;
+    h->name.len = nlen;
+    h->value.p = value;
+    h->value.len = vlen;
+    h->id = http_header_id(name, nlen);
+
+    msg_add(m, name, nlen);
+    msg_add(m, ": ", 2);
+    msg_add(m, value, vlen);
+    msg_add(m, "\r\n", 2);
+}
+
+/* msg_add_header_str:
+*   Appends a header line whose name and value are C strings.
+*/
+void msg_add_header_str(msg* m, const char* name, const char* value)
+{
+    msg_add_header(m, name, strlen(name), value, strlen(value));
+}
+
+/* msg_find_header:
+*   Looks up a header added with msg_add_header, by its name in any
+*   case. Returns its value and length in vlen, or NULL.
+*/
+const char* msg_find_header(const msg* m, const char* name, size_t* vlen)
+{
+    int i;
+
+    for(i = 0; i < m->nheaders; i++)
+    {
+        if(http_slice_is(&m->headers[i].name, name))
+        {
+            *vlen = m->headers[i].value.len;
+            return m->headers[i].value.p;
+        }
+    }
+
+    return NULL;
+}
+
+/* msg_send:
+*   Writes the whole message to fd, with as few writev calls as the
+*   socket allows. The pieces are consumed as they are written, so a
+*   message can only be sent once; its headers can still be looked up.
+*   Returns 0, or -1 if a write failed or the message overflowed.
+*/
+int msg_send(msg* m, int fd)
+{
+    struct iovec* iov = m->iov;
+    int left = m->niov;
+    ssize_t n;
+
+    if(m->overflow)
+        return -1;
+
+    while(left > 0)
+    {
+        n = writev(fd, iov, left);
+        if(n < 0)
+        {
+            if(errno == EINTR) /* interrupted by sig handler return */
+                continue;
+            return -1;
+        }
+
+        //skip what went out, part of a piece may be left
+        while(left > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            left--;
+        }
+        if(left > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    m->niov = 0;
+    return 0;
+}
+
+/* msg_dump:
+*   Prints the message, for debugging.
+*/
+void msg_dump(const msg* m, FILE* out)
+{
+    int i;
+
+    for(i = 0; i < m->niov; i++)
+        fwrite(m->iov[i].iov_base, 1, m->iov[i].iov_len, out);
+}
@@ -0,0 +1,54 @@
+/* A message is an HTTP request or response assembled as a list of
+   pieces that stay where they are: constant strings, slices of a
+   parsed request, cached headers and bodies. It is sent with writev
+   instead of being copied into one buffer first. Only the few bytes
+   that have to be formatted (numbers) are written, into scratch.
+   The headers added with msg_add_header are also indexed, so they
+   can be looked up like those of a parsed request */
+
+#ifndef __MSG_H__
+#define __MSG_H__
+
+#include <stdio.h>
+#include <sys/uio.h>
+#include "http.h"
+#include "chain.h"
+
+/* Enough pieces for a request with HTTP_MAX_HEADERS headers (four
+   pieces each) or a cached object of MAX_LARGE_OBJECT_SIZE in
+   LARGE_CHUNK_SIZE chunks, and below the IOV_MAX of Linux (1024) so
+   a message always goes to writev whole */
+#define MSG_MAX_IOV 512
+#define MSG_MAX_HEADERS (HTTP_MAX_HEADERS + 8)
+#define MSG_SCRATCH 1024
+
+/* overflow is set once a piece did not fit; such a message is never
+   sent */
+typedef struct msg{
+  struct iovec iov[MSG_MAX_IOV];
+  int niov;
+  size_t len;
+  http_header headers[MSG_MAX_HEADERS];
+  int nheaders;
+  char scratch[MSG_SCRATCH];
+  size_t used;
+  int overflow;
+} msg;
+
+void msg_init(msg* m);
+void msg_add(msg* m, const void* p, size_t len);
+void msg_add_str(msg* m, const char* s);
+void msg_add_slice(msg* m, const http_slice* s);
+void msg_add_chain(msg* m, const chain* c);
+void msg_add_chain_range(msg* m, const chain* c, unsigned long off,
+                         unsigned long len);
+void msg_append(msg* m, const msg* other);
+void msg_printf(msg* m, const char* fmt, ...);
+void msg_add_header(msg* m, const char* name, size_t nlen,
+                    const char* value, size_t vlen);
+void msg_add_header_str(msg* m, const char* name, const char* value);
+const char* msg_find_header(const msg* m, const char* name, size_t* vlen);
+int msg_send(msg* m, int fd);
+void msg_dump(const msg* m, FILE* out);
+
+#endif /* __MSG_H__ */
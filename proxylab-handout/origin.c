@@ -0,0 +1,322 @@
+/*
+* Per-origin caps on requests in flight. See origin.h.
+*/
+#include "origin.h"
+#include "csapp.h"
+
+
+#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+int origin_max = 0;
+int origin_queue = ORIGIN_QUEUE;
+int origin_wait = ORIGIN_WAIT;
+int origin_status = ORIGIN_STATUS;
+
+/* A request waiting for an origin, on the stack of its thread; it is
+   woken with granted set once a request in flight hands it its place */
+typedef struct origin_waiter{
+  pthread_cond_t cond;
+  int granted;
+  struct origin_waiter* next;
+} origin_waiter;
+
+/* An origin: its key and name, its requests in flight and waiting
+   (in a queue per priority), and its counters */
+typedef struct origin_t{
+  unsigned long key;
+  char name[ORIGIN_NAME];
+  int active;
+  int waiting;
+  origin_waiter* head[2];
+  origin_waiter* tail[2];
+  unsigned long requests;
+  unsigned long queued;
+  unsigned long overflowed;
+  unsigned long wait_ms;
+  unsigned long max_wait_ms;
+} origin_t;
+
+static origin_t origins[ORIGIN_SLOTS];
+
+/* Counters reported by printOriginStats, over all origins */
+static unsigned long requests = 0;
+static unsigned long queued = 0;
+static unsigned long overflowed = 0;
+static unsigned long wait_ms = 0;
+static unsigned long max_wait_ms = 0;
+
+static pthread_mutex_t origin_lock;
+
+void origin_init()
+{
+    pthread_mutex_init(&origin_lock, 0);
+}
+
+
+static long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* origin_parse:
+*   Sets the settings from "max,queue,wait,status"; those left out at
+*   the end keep their defaults. Returns 0, or -1 if spec is malformed.
+*/
+int origin_parse(const char* spec)
+{
+    int values[4] = { 0, ORIGIN_QUEUE, ORIGIN_WAIT, ORIGIN_STATUS };
+    int i = 0;
+    char* end;
+
+    while(i < 4)
+    {
+        long v = strtol(spec, &end, 10);
+        if(end == spec || v < 0 || v > 100000)
+            return -1;
+        values[i++] = v;
+        if(*end == '\0')
+            break;
+        if(*end != ',')
+            return -1;
+        spec = end + 1;
+    }
+    if(*end != '\0' || origin_reason(values[3]) == NULL)
+        return -1;
+
+    origin_max = values[0];
+    origin_queue = values[1];
+    origin_wait = values[2];
+    origin_status = values[3];
+    return 0;
+}
+
+/* origin_reason:
+*   Returns the reason phrase of status if a request turned away may
+*   be answered with it, NULL otherwise.
+*/
+char* origin_reason(int status)
+{
+    switch(status)
+    {
+    case 429: return "Too Many Requests";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    }
+    return NULL;
+}
+
+/* find:
+*   Returns the slot of the origin with key, or one that has nothing
+*   in flight or waiting, made its own, or -1 if there is none. Called
+*   with origin_lock held.
+*/
+static int find(unsigned long key, const char* host, int port)
+{
+    int i, free = -1;
+
+    for(i = 0; i < ORIGIN_PROBES; i++)
+    {
+        int s = (key + i) % ORIGIN_SLOTS;
+        if(origins[s].key == key)
+            return s;
+        if(free < 0 && origins[s].active == 0 && origins[s].waiting == 0)
+            free = s;
+    }
+    if(free < 0)
+        return -1;
+
+    memset(&origins[free], 0, sizeof(origin_t));
+    origins[free].key = key;
+    snprintf(origins[free].name, ORIGIN_NAME, "%s:%d", host, port);
+    return free;
+}
+
+/* unlink_waiter:
+*   Takes w, which gave up, out of the queue of priority of o. Called
+*   with origin_lock held.
+*/
+static void unlink_waiter(origin_t* o, int priority, origin_waiter* w)
+{
+    origin_waiter** at = &o->head[priority];
+    origin_waiter* prev = NULL;
+
+    while(*at != w)
+    {
+        prev = *at;
+        at = &(*at)->next;
+    }
+    *at = w->next;
+    if(o->tail[priority] == w)
+        o->tail[priority] = prev;
+}
+
+/* origin_acquire:
+*   Waits for a request of priority to port on host to be let through.
+*   Returns the slot of the origin, to be given back to origin_release
+*   once the response is in, ORIGIN_UNTRACKED if the request wasn't
+*   counted (still to be given back), or ORIGIN_OVERFLOW if it is
+*   turned away.
+*/
+int origin_acquire(const char* host, int port, int priority)
+{
+    unsigned long key = 14695981039346656037UL;
+    const char* p;
+    origin_waiter w;
+    struct timespec deadline;
+    origin_t* o;
+    int slot;
+
+    if(origin_max == 0)
+        return ORIGIN_UNTRACKED;
+
+    for(p = host; *p; p++)
+        key = (key ^ (unsigned char)*p) * 1099511628211UL;
+    key = (key ^ port) * 1099511628211UL;
+    if(key == 0)
+        key = 1;
+
+    pthread_mutex_lock(&origin_lock);
+    requests++;
+    if((slot = find(key, host, port)) < 0)
+    {
+        pthread_mutex_unlock(&origin_lock);
+        return ORIGIN_UNTRACKED;
+    }
+    o = &origins[slot];
+    o->requests++;
+
+    if(o->active < origin_max && o->waiting == 0)
+    {
+        o->active++;
+        pthread_mutex_unlock(&origin_lock);
+        return slot;
+    }
+    if(o->waiting >= origin_queue)
+    {
+        o->overflowed++;
+        overflowed++;
+        pthread_mutex_unlock(&origin_lock);
+        return ORIGIN_OVERFLOW;
+    }
+
+    //wait in line behind those of the same priority
+    pthread_cond_init(&w.cond, NULL);
+    w.granted = 0;
+    w.next = NULL;
+    if(o->tail[priority] != NULL)
+        o->tail[priority]->next = &w;
+    else
+        o->head[priority] = &w;
+    o->tail[priority] = &w;
+    o->waiting++;
+    o->queued++;
+    queued++;
+
+    long start = now_ms();
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += origin_wait;
+    while(!w.granted &&
+          pthread_cond_timedwait(&w.cond, &origin_lock, &deadline) == 0)
+        ;
+
+    long waited = now_ms() - start;
+    o->wait_ms += waited;
+    wait_ms += waited;
+    if(waited > o->max_wait_ms)
+        o->max_wait_ms = waited;
+    if(waited > max_wait_ms)
+        max_wait_ms = waited;
+
+    //the place of a request let through was handed over along with it,
+    //and was taken off the queue by whoever handed it over
+    if(!w.granted)
+    {
+        unlink_waiter(o, priority, &w);
+        o->waiting--;
+        o->overflowed++;
+        overflowed++;
+        slot = ORIGIN_OVERFLOW;
+    }
+    pthread_mutex_unlock(&origin_lock);
+    pthread_cond_destroy(&w.cond);
+
+    if(slot == ORIGIN_OVERFLOW)
+        dbg_printf("Gave up waiting %ld ms for %s:%d\n", waited, host, port);
+    return slot;
+}
+
+/* origin_release:
+*   Gives back the place of a request that origin_acquire let through,
+*   to the next request waiting for the origin if there is one.
+*/
+void origin_release(int slot)
+{
+    origin_t* o;
+    int priority;
+
+    if(slot < 0)
+        return;
+
+    pthread_mutex_lock(&origin_lock);
+    o = &origins[slot];
+    for(priority = ORIGIN_PRIORITY_HIGH; priority >= ORIGIN_PRIORITY_LOW;
+        priority--)
+    {
+        origin_waiter* w = o->head[priority];
+        if(w == NULL)
+            continue;
+        o->head[priority] = w->next;
+        if(o->head[priority] == NULL)
+            o->tail[priority] = NULL;
+        o->waiting--;
+        w->granted = 1;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&origin_lock);
+        return;
+    }
+    o->active--;
+    pthread_mutex_unlock(&origin_lock);
+}
+
+/* printOriginStats:
+*   Writes the counters over all origins to out, then those of each
+*   origin that had requests wait. The slots are read without locking,
+*   so an origin being taken over may show half old, half new.
+*/
+void printOriginStats(FILE* out)
+{
+    int i;
+
+    if(origin_max == 0)
+    {
+        fprintf(out, "Origin caps: off\n");
+        return;
+    }
+
+    fprintf(out, "Origin caps: %d in flight, %d waiting, %ds wait, answer %d; "
+            "%lu requests, %lu queued (%lu ms on average, %lu ms at most), "
+            "%lu turned away\n", origin_max, origin_queue, origin_wait,
+            origin_status, requests, queued, queued ? wait_ms / queued : 0,
+            max_wait_ms, overflowed);
+    for(i = 0; i < ORIGIN_SLOTS; i++)
+    {
+        origin_t* o = &origins[i];
+        if(o->key == 0 || o->queued == 0)
+            continue;
+        fprintf(out, "  %s: %d in flight, %d waiting, %lu requests, "
+                "%lu queued (%lu ms on average, %lu ms at most), "
+                "%lu turned away\n", o->name, o->active, o->waiting,
+                o->requests, o->queued, o->wait_ms / o->queued,
+                o->max_wait_ms, o->overflowed);
+    }
+}
@@ -0,0 +1,54 @@
+/* Caps on the requests in flight to each origin (host and port), so
+   that a flood of misses for one host neither swamps it nor uses up
+   our ephemeral ports. Set with -O max,queue,wait,status:
+     max     - requests in flight to one origin at once (0: no cap)
+     queue   - requests that may wait for one origin beyond those;
+               further ones are turned away at once
+     wait    - seconds a request may wait before it is turned away
+     status  - what a request turned away is answered: 429, 502, 503
+               or 504
+   Waiting requests are served in order of arrival, GET and HEAD ahead
+   of other methods. A request holds its place from before it connects
+   until the origin's response is in, so a slow origin only holds up
+   the requests for itself */
+
+#ifndef __ORIGIN_H__
+#define __ORIGIN_H__
+
+#include <stdio.h>
+
+/* Defaults of the settings that follow max in -O */
+#define ORIGIN_QUEUE 64
+#define ORIGIN_WAIT 10
+#define ORIGIN_STATUS 503
+
+/* Origins tracked at once, and the slots looked at for an origin */
+#define ORIGIN_SLOTS 256
+#define ORIGIN_PROBES 8
+
+/* Most characters of an origin's name kept for the stats */
+#define ORIGIN_NAME 64
+
+/* What origin_acquire returns for a request that isn't let through;
+   one that isn't tracked (no cap, or no room) gets ORIGIN_UNTRACKED */
+#define ORIGIN_UNTRACKED -1
+#define ORIGIN_OVERFLOW -2
+
+/* Priorities of waiting requests */
+#define ORIGIN_PRIORITY_LOW 0
+#define ORIGIN_PRIORITY_HIGH 1
+
+/* The settings of -O */
+extern int origin_max;
+extern int origin_queue;
+extern int origin_wait;
+extern int origin_status;
+
+void origin_init();
+int origin_parse(const char* spec);
+char* origin_reason(int status);
+int origin_acquire(const char* host, int port, int priority);
+void origin_release(int slot);
+void printOriginStats(FILE* out);
+
+#endif /* __ORIGIN_H__ */
@@ -1,7 +1,8 @@
 /*
 * A Web proxy that acts as intermediate between Web browser and the Web.
 *
-* Note: handles only GET requests
+* Note: handles GET, HEAD, POST, PUT, PATCH and DELETE requests, and
+* CONNECT tunnels
 *
 * Authors: Alex Lucena & Saumya Dalal
 *
@@ -9,10 +10,32 @@
 #include <stdio.h>
 #include "csapp.h"
 #include "cache.h"
+#include "http.h"
+#include "compress.h"
+#include "largecache.h"
+#include "msg.h"
+#include "tunnel.h"
+#include "h2.h"
+#include "spool.h"
+#include "timeout.h"
+#include "upstream.h"
+#include "hedge.h"
+#include "limit.h"
+#include "origin.h"
+#include "lane.h"
+#include "upgrade.h"
+#include "shmcache.h"
+#include "worker.h"
 
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* A fetch being stored whose client goes away is finished in the
+   background if at most FILL_BYTE_BUDGET bytes (by default, -F) are
+   left to read, within FILL_TIME_BUDGET seconds */
+#define FILL_BYTE_BUDGET (4 * 1024 * 1024)
+#define FILL_TIME_BUDGET 10
+
 /* Debug output macro taken from malloc lab */
 #define DEBUG
 #ifdef DEBUG
@@ -21,32 +44,95 @@
 # define dbg_printf(...)
 #endif
 
-static const char *user_agent = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *accept_type = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding = "Accept-Encoding: gzip, deflate\r\n";
-
-void serve(int file_d);
-void read_headers(rio_t *rp, char* host_header, char *other_headers);
-int parse_url(char *url, char *host, char *path, char *cgiargs);
-void make_request(int fd, char *url, char *host, char *path, char *host_header, char *other_headers, int port);
+static const char *user_agent = "Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3";
+static const char *accept_type = "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8";
+static const char *accept_encoding = "gzip, deflate";
+
+/* A fetch whose client may go away: gone is set once a write to the
+   client failed, after which the fetch may read budget more bytes
+   until deadline, without sending them */
+typedef struct fill_state{
+  int gone;
+  long budget;
+  time_t deadline;
+} fill_state;
+
+/* What the thread serving a connection is handed: the connection and
+   the slot of its client in the limits (see limit.h) */
+typedef struct conn_arg{
+  int fd;
+  int client;
+} conn_arg;
+
+static long fill_budget = FILL_BYTE_BUDGET;
+static unsigned long fills_finished = 0;
+static unsigned long fills_cancelled = 0;
+static pthread_mutex_t fill_lock;
+
+void serve(int file_d, int client, int counted);
+void serve_stream(int fd, int client);
+int copy_slice(char *dst, size_t size, const http_slice *s);
+void connect_tunnel(int fd, http_request *req, char *early, size_t nearly);
+void make_request(int fd, http_request *req, char *url, char *host,
+                  const http_slice *path, int port, char *early, size_t nearly,
+                  int client);
+int send_body(int fd, int net_fd, int chunked, long length, char *early,
+              size_t nearly);
+long dechunk_tail(chain *c, unsigned int n, http_chunked *decoder);
+int send_piece(int fd, msg *m, const chain *c, unsigned int off,
+               unsigned int len, int rechunk, int last);
+void add_headers_except(msg *m, const char *block, size_t end,
+                        size_t skip[][2], int n);
+void add_plain_headers(msg *m, const char *block, http_meta *meta, int keep_te);
+void add_gzip_headers(msg *m, const char *block, http_meta *meta);
+int store_plain_headers(chain *response, size_t header_bytes, http_meta *meta);
+void invalidate(char *url, const char *head, size_t len);
+void send_cached(int fd, web_object *obj, http_request *req);
+int send_large(int fd, large_object *obj, http_request *req, char *host,
+               int port, const msg *request, int client);
+int not_modified(http_request *req, http_meta *meta);
+void send_not_modified(int fd, http_meta *meta, time_t stored);
+char *inflate_body(body_blob *body);
+int range_request(http_request *req, http_meta *meta, long length,
+                  http_range *ranges);
+void send_ranges(int fd, char *headers, http_meta *meta, time_t stored,
+                 const chain *body, long length, http_range *ranges, int n);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
 void terminate(int param);
+int large_cacheable(char *headers, size_t len);
+void relay_large(int fd, int net_fd, large_object *obj, unsigned int index,
+                 char *data, unsigned int len, fill_state *fill, int client);
+int client_gone(fill_state *fill, int net_fd, int storing, long left);
+int fill_goes_on(fill_state *fill, int storing, long n);
+void end_fetch(int client, int origin);
+void fetch_large_rest(int fd, large_object *obj, char *host, int port,
+                      const msg *request, unsigned long offset, int client);
+void print_stats(int param);
+void request_stats(int param);
+void stats_start();
+void *stats_thread(void *arg);
 void *thread(void *arg);
 
 cache_LL* cache;
 
 sem_t accept_mutex;
 
+/* SIGUSR1 writes a byte to stats_pipe[1] for stats_thread to print the
+   statistics; both ends are -1 until stats_start() opens the pipe */
+static int stats_pipe[2] = { -1, -1 };
+
 /*
 * Main function
 */
 int main(int argc, char **argv)
 {
     printf("-------- START PROXY INFO --------\r\n");
-    printf("%s%s%s", user_agent, accept_type, accept_encoding);
+    printf("User-Agent: %s\r\nAccept: %s\r\nAccept-Encoding: %s\r\n",
+           user_agent, accept_type, accept_encoding);
     printf("--------- END PROXY INFO ---------\r\n");
 
-    int listenfd, *connfd, port, clientlen;
+    int listenfd, port, clientlen;
+    conn_arg *conn;
     struct sockaddr_in clientaddr;
 
     pthread_t tid;
@@ -57,121 +143,408 @@ int main(int argc, char **argv)
     cache->head = NULL;
     cache->size = 0;
     cache_init();
+    large_init();
+    tunnel_init();
+    compress_init();
+    h2_init(serve_stream);
+    spool_init();
+    timeout_init();
+    upstream_init();
+    hedge_init();
+    limit_init();
+    origin_init();
+    lane_init();
+    upgrade_init();
+    pthread_mutex_init(&fill_lock, 0);
+    http_init();
+    dbg_printf("Header scanner: %s\n", http_scanner());
 
 
 
     signal(SIGPIPE, terminate);
+    signal(SIGUSR1, request_stats);
+
+    /* -z [min]: store text objects of at least min bytes gzipped
+     * -g [level]: gzip text responses for clients that accept it
+     * -B ms: CPU time per second the -g compression may take
+     * -b [kb]: buffer responses for slow clients, kb in memory each
+     * -F kb: most left to read of a fetch whose client went away for
+     *        it to still fill the cache (0: never)
+     * -T h,c,t,i: timeouts in seconds for reading the request head,
+     *        connecting, the origin's first byte and idle transfers
+     * -2: serve HTTP/2 to clients that open with its preface (h2c)
+     * -H [pct]: hedge slow GET and HEAD misses, at most pct% of them
+     * -L c,r,k,f: per client connections, requests/s and KB/s, and
+     *        fetches in flight over all clients (see limit.h)
+     * -O m,q,w,s: at most m requests in flight per origin, q more
+     *        waiting up to w seconds, others answered s (see origin.h)
+     * -M n[,q]: at most n misses at once, q more waiting (see lane.h)
+     * -U path: hand over to, or take over from, another proxy through
+     *        the Unix socket at path (see upgrade.h)
+     * -P n[,mb]: serve from n worker processes sharing a cache of mb
+     *        megabytes (see worker.h) */
+    int opt;
+    while ((opt = getopt(argc, argv, "z::g::B:b::F:T:2H::L:O:M:U:P:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'z':
+            cache_compress_min = optarg ? atoi(optarg) : CACHE_COMPRESS_MIN;
+            break;
+        case 'g':
+            gzip_level = optarg ? atoi(optarg) : GZIP_LEVEL;
+            break;
+        case 'B':
+            gzip_cpu_budget = atoi(optarg);
+            break;
+        case 'b':
+            spool_memory = optarg ? atoi(optarg) * 1024 : SPOOL_MEMORY;
+            break;
+        case 'F':
+            fill_budget = atol(optarg) * 1024;
+            break;
+        case 'T':
+            if (timeout_parse(optarg) < 0)
+            {
+                fprintf(stderr, "bad timeouts: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case '2':
+            h2_enabled = 1;
+            break;
+        case 'H':
+            hedge_percent = optarg ? atoi(optarg) : HEDGE_PERCENT;
+            break;
+        case 'L':
+            if (limit_parse(optarg) < 0)
+            {
+                fprintf(stderr, "bad limits: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'O':
+            if (origin_parse(optarg) < 0)
+            {
+                fprintf(stderr, "bad origin caps: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'M':
+            if (lane_parse(optarg) < 0)
+            {
+                fprintf(stderr, "bad miss pool: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'U':
+            upgrade_path = optarg;
+            break;
+        case 'P':
+            if (worker_parse(optarg) < 0)
+            {
+                fprintf(stderr, "bad workers: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-z[min_bytes]] [-g[level]] [-B cpu_ms] [-b[kb]] [-F kb] [-T h,c,t,i] [-2] [-H[pct]] [-L c,r,k,f] [-O m,q,w,s] [-M n[,q]] [-U path] [-P n[,mb]] <port>\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
 
-
-    if (argc != 2)
+    if (argc - optind != 1 || gzip_level < 0 || gzip_level > 9 ||
+        hedge_percent < 0 || hedge_percent > 100 ||
+        (upgrade_path != NULL && worker_count > 0))
     {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+        fprintf(stderr, "usage: %s [-z[min_bytes]] [-g[level]] [-B cpu_ms] [-b[kb]] [-F kb] [-T h,c,t,i] [-2] [-H[pct]] [-L c,r,k,f] [-O m,q,w,s] [-M n[,q]] [-U path] [-P n[,mb]] <port>\n",
+                argv[0]);
         exit(1);
     }
-    port = atoi(argv[1]);
+    port = atoi(argv[optind]);
+
+    //a proxy being upgraded hands over its listening socket, already
+    //accepting, and its cache
+    listenfd = upgrade_inherit(cache);
+    if (listenfd < 0)
+        listenfd = Open_listenfd(port);
+
+    //with workers, this process goes no further; it has no threads yet,
+    //as fork wants
+    if (worker_count > 0)
+        worker_start();
+    else
+        upgrade_serve(listenfd, cache);
+    //so the statistics thread only starts here, in each process that
+    //serves; until then a SIGUSR1 finds the pipe closed and is dropped
+    stats_start();
 
-    listenfd = Open_listenfd(port);
     while (1)
     {
         clientlen = sizeof(clientaddr);
-	connfd = Calloc(1, sizeof(int));
+	conn = Calloc(1, sizeof(conn_arg));
         P(&accept_mutex);
-        *connfd = Accept(listenfd, (SA *) &clientaddr, (socklen_t *) &clientlen);
+        conn->fd = upgrade_accept(listenfd, (SA *) &clientaddr,
+                                  (socklen_t *) &clientlen);
+        if (conn->fd < 0)
+        {
+            //handed over: what is being served is left to finish
+            Free(conn);
+            V(&accept_mutex);
+            break;
+        }
+
+        //a client over its connection limit is turned away right here
+        conn->client = limit_accept(conn->fd);
+        if (conn->client < -1)
+        {
+            if (conn->client == -2)
+                clienterror(conn->fd, "connections from your address", "429",
+                            "Too Many Requests", "Too many open");
+            else
+                clienterror(conn->fd, "clients", "503",
+                            "Service Unavailable", "Too many");
+            Close(conn->fd);
+            Free(conn);
+            V(&accept_mutex);
+            continue;
+        }
 
-	Pthread_create(&tid, NULL, thread, connfd);
+        upgrade_conn_begin();
+	Pthread_create(&tid, NULL, thread, conn);
 
     }
 
+    upgrade_drain();
+    print_stats(0);
     return 0;
 }
 
 
 void *thread(void *arg)
 {
-  int connfd = *((int *)arg);
+  conn_arg conn = *((conn_arg *)arg);
   V(&accept_mutex);
 
   Pthread_detach(pthread_self());
 
   Free(arg);
 
-  serve(connfd);
-  Close(connfd);
+  serve(conn.fd, conn.client, 0);
+  Close(conn.fd);
+  limit_close(conn.client);
+  upgrade_conn_end();
 
   return NULL;
 }
 
 
+/*
+* Serves an HTTP/2 stream, whose request h2.c already counted against
+* client.
+*/
+void serve_stream(int fd, int client)
+{
+    serve(fd, client, 1);
+}
+
 /*
 * Serves a client's request.
-* file_d is the file descriptor
+* file_d is the file descriptor, client the slot of the client in the
+* limits; counted is set if its request was already counted there.
+* The request head is read into one buffer and parsed in place as it
+* arrives; the parser only looks at the bytes each read added. It must
+* be complete within the header timeout.
 */
- void serve(int file_d)
+ void serve(int file_d, int client, int counted)
  {
-    char method[MAXLINE], url[MAXLINE], version[MAXLINE];
-    char buf[MAXLINE], host[MAXLINE], path[MAXLINE], cgiargs[MAXLINE];
-    char host_header[MAXLINE], other_headers[MAXLINE];
-    rio_t rio;
+    char raw[MAXBUF];
+    char method[MAXLINE], url[MAXLINE], host[MAXLINE];
+    size_t len = 0;
+    int state = HTTP_PARSE_AGAIN;
+    http_request req;
+    ssize_t n;
+
+    struct timespec deadline;
+    timeout_deadline(&deadline, TIMEOUT_PHASE_HEADER);
+
+    http_request_init(&req);
+    while (state == HTTP_PARSE_AGAIN && len < sizeof(raw))
+    {
+        n = -1;
+        errno = ETIMEDOUT;
+        if (timeout_arm(file_d, &deadline) == 0)
+            n = read(file_d, raw + len, sizeof(raw) - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && timeout_expired(errno))
+        {
+            //a client that said nothing at all just gets closed
+            timeout_hit(TIMEOUT_PHASE_HEADER);
+            if (len > 0)
+                clienterror(file_d, "request", "408", "Request Timeout",
+                            "Took too long to send the");
+            return;
+        }
+        if (n <= 0)
+            return;
+        len += n;
+        state = http_parse_request(&req, raw, len);
+    }
 
-    /* Read in a request from client */
-    Rio_readinitb(&rio, file_d); // initialize rio buffer with file descriptor
-    Rio_readlineb(&rio, buf, MAXLINE); // read in line
-    // move from buffer into string format
-    sscanf(buf, "%s %s %s", method, url, version);
+    //from now on the client may only keep us waiting so long at a time
+    timeout_recv(file_d, TIMEOUT_PHASE_IDLE);
+    timeout_send(file_d, TIMEOUT_PHASE_IDLE);
 
-    if (strcasecmp(method, "GET"))
+    //an HTTP/2 client with prior knowledge opens with the preface,
+    //which is no HTTP/1 request
+    if (state != HTTP_PARSE_DONE && h2_enabled && h2_preface(raw, len))
     {
-        dbg_printf("Asked for something other than GET\n");
-        clienterror(file_d, method, "501", "Request not implemented", "Nope");
+        h2_serve(file_d, raw, len, client);
         return;
     }
 
+    if (state != HTTP_PARSE_DONE)
+    {
+        dbg_printf("Malformed or oversized request\n");
+        clienterror(file_d, "request", "400", "Bad Request",
+                    "Could not parse the");
+        return;
+    }
 
-    read_headers(&rio, host_header, other_headers);
+    if (!counted && limit_request(client) < 0)
+    {
+        clienterror(file_d, "requests from your address", "429",
+                    "Too Many Requests", "Too many");
+        return;
+    }
 
-    // Parse URL out of request
-    dbg_printf("PRE-PARSE\n");
+    if (http_slice_is(&req.method, "CONNECT"))
+    {
+        connect_tunnel(file_d, &req, raw + req.head_len, len - req.head_len);
+        return;
+    }
 
-    // make a new string so as not to defile original url
-    char url_arg[MAXLINE];
-    strcpy(url_arg, url);
-    int port = parse_url(url_arg, host, path, cgiargs);
-    dbg_printf("POST-PARSE\n");
+    if (!http_slice_is(&req.method, "GET") && !http_slice_is(&req.method, "HEAD") &&
+        !http_slice_is(&req.method, "POST") && !http_slice_is(&req.method, "PUT") &&
+        !http_slice_is(&req.method, "PATCH") && !http_slice_is(&req.method, "DELETE"))
+    {
+        dbg_printf("Asked for an unsupported method\n");
+        copy_slice(method, sizeof(method), &req.method);
+        clienterror(file_d, method, "501", "Request not implemented", "Nope");
+        return;
+    }
 
+    //An absolute URL names the origin itself, a path relies on Host
+    http_slice host_s, path;
+    int port;
+    const http_slice *host_header = http_request_header(&req, HTTP_HDR_HOST);
+    int ok = http_parse_target(&req.target, &host_s, &port, &path) == 0;
 
-    if (!strncmp(buf, "https", strlen("https")))
-        printf("\n\n\n EXPECT A DNS ERROR \n\n");
+    if (ok && host_s.len == 0)
+    {
+        ok = host_header != NULL &&
+             http_parse_authority(host_header, &host_s, &port) == 0 &&
+             snprintf(url, sizeof(url), "http://%.*s%.*s",
+                      (int)host_header->len, host_header->p,
+                      (int)path.len, path.p) < sizeof(url);
+    }
+    else if (ok)
+        ok = copy_slice(url, sizeof(url), &req.target) == 0;
 
+    if (!ok || copy_slice(host, sizeof(host), &host_s) < 0)
+    {
+        copy_slice(url, sizeof(url), &req.target);
+        clienterror(file_d, url, "400", "Bad Request", "Can't fetch");
+        return;
+    }
 
     dbg_printf("\nRequesting with URL : %s\n\n", url);
-    make_request(file_d, url, host, path, host_header, other_headers, port);
+    make_request(file_d, &req, url, host, &path, port, raw + req.head_len,
+                 len - req.head_len, client);
+ }
 
+/*
+* Copies a slice into the C string dst of size bytes.
+* Returns 0, or -1 (with dst truncated) if it doesn't fit.
+*/
+int copy_slice(char *dst, size_t size, const http_slice *s)
+{
+    size_t n = s->len < size ? s->len : size - 1;
 
- }
+    memcpy(dst, s->p, n);
+    dst[n] = '\0';
+    return n == s->len ? 0 : -1;
+}
+
+
+/*
+* Handles a CONNECT: opens a connection to the host:port the client
+* named, tells the client the tunnel is up and relays bytes both ways
+* until it is done. Bytes the client sent right after its request
+* head (nearly of them at early) go to the origin first.
+*/
+void connect_tunnel(int fd, http_request *req, char *early, size_t nearly)
+{
+    static const char *established = "HTTP/1.0 200 Connection established\r\n\r\n";
+    char host[MAXLINE];
+    http_slice host_s;
+    tunnel_stats stats;
+    int port, net_fd;
+
+    if (http_parse_connect(&req->target, &host_s, &port) < 0 ||
+        copy_slice(host, sizeof(host), &host_s) < 0)
+    {
+        copy_slice(host, sizeof(host), &req->target);
+        clienterror(fd, host, "400", "Bad Request", "Can't tunnel to");
+        return;
+    }
+
+    if ((net_fd = upstream_connect(host, port)) < 0)
+    {
+        clienterror(fd, host, "502", "Bad Gateway", "Can't connect to");
+        return;
+    }
+
+    dbg_printf("Tunnel to %s:%d\n", host, port);
+    if (rio_writen(fd, (void *)established, strlen(established)) ==
+        strlen(established) &&
+        (nearly == 0 || rio_writen(net_fd, early, nearly) == nearly))
+        tunnel_relay(fd, net_fd, &stats);
 
+    Close(net_fd);
+}
 
  /*
 * Sends error to proxy's client as html file
 */
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
 {
-    char buf[MAXLINE], body[MAXLINE];
+    char body[MAXLINE];
+    msg m;
 
     /* Build body */
-    sprintf(body, "<html><title>Web Proxy Error</title>");
-    sprintf(body, "%s<body bgcolor =\"#FF8680\">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>Alex & Saumya's Web Proxy</em>\r\n", body);
-
-    /* Print out response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    int len = snprintf(body, sizeof(body),
+                       "<html><title>Web Proxy Error</title>"
+                       "<body bgcolor =\"#FF8680\">\r\n"
+                       "%s: %s\r\n"
+                       "<p>%s: %s\r\n"
+                       "<hr><em>Alex & Saumya's Web Proxy</em>\r\n",
+                       errnum, shortmsg, longmsg, cause);
+    if (len >= sizeof(body))
+        len = sizeof(body) - 1;
+
+    /* Print out response, all in one write */
+    msg_init(&m);
+    msg_add_str(&m, "HTTP/1.0 ");
+    msg_add_str(&m, errnum);
+    msg_add_str(&m, " ");
+    msg_add_str(&m, shortmsg);
+    msg_add_str(&m, "\r\nContent-type: text/html\r\n");
+    msg_printf(&m, "Content-length: %d\r\n\r\n", len);
+    msg_add(&m, body, len);
+    msg_send(&m, fd);
 }
 
 void terminate (int param)
@@ -179,219 +552,1582 @@ void terminate (int param)
     printf ("SIGPIPE . . . ignoring!\n");
 }
 
+/*
+* Dumps the proxy's statistics to stdout
+*/
+void print_stats(int param)
+{
+    printf("-------- PROXY STATS --------\n");
+    printCacheStats(cache, stdout);
+    printLargeStats(stdout);
+    printTunnelStats(stdout);
+    printCompressStats(stdout);
+    printH2Stats(stdout);
+    printSpoolStats(stdout);
+    printTimeoutStats(stdout);
+    printUpstreamStats(stdout);
+    printHedgeStats(stdout);
+    printLimitStats(stdout);
+    printOriginStats(stdout);
+    printLaneStats(stdout);
+    printUpgradeStats(stdout);
+    printWorkerStats(stdout);
+    printShmCacheStats(stdout);
+    printf("Background fills: %lu finished, %lu cancelled\n",
+           fills_finished, fills_cancelled);
+    printf("-----------------------------\n");
+    fflush(stdout);
+}
+
+/*
+* Handles SIGUSR1. stdio isn't safe to use in a signal handler, so the
+* statistics are left to stats_thread, woken through the pipe
+*/
+void request_stats(int param)
+{
+    int saved = errno;
+    char c = 0;
+
+    if(write(stats_pipe[1], &c, 1) < 0)
+        ; //already pending, or the pipe isn't open yet
+    errno = saved;
+}
+
+/*
+* Opens the pipe SIGUSR1 writes to and starts the thread that prints
+* the statistics
+*/
+void stats_start()
+{
+    pthread_t tid;
 
+    if(pipe(stats_pipe) < 0)
+        unix_error("pipe error");
+    //a burst of signals must not block the handler
+    fcntl(stats_pipe[1], F_SETFL, O_NONBLOCK);
+    Pthread_create(&tid, NULL, stats_thread, NULL);
+}
 
 /*
-* Reads in and ignores headers of requests.
-* host_header and other_headers are merely buffers
-* to store the information obtained from reading
-* regarding the host headers and other necessary
-* headers respectively.
+* Prints the statistics each time SIGUSR1 comes in
 */
-void read_headers(rio_t *rp, char *host_header, char *other_headers)
+void *stats_thread(void *arg)
 {
-   char buf[MAXLINE];
+    char c;
+    ssize_t n;
+
+    Pthread_detach(pthread_self());
+    while((n = read(stats_pipe[0], &c, 1)) != 0)
+    {
+        if(n > 0)
+            print_stats(0);
+        else if(errno != EINTR)
+            break;
+    }
+    return NULL;
+}
+
+
+
+/* Make request creates a request using the information such as the port,
+ * file descriptor, url, host, path & the headers of the parsed client
+ * request. The complete request is assembled in a msg, from constant
+ * strings and slices of the client's request that are not copied: our
+ * own User-Agent, Accept and connection headers replace the client's,
+ * and the client's other headers are passed on. If the object associated
+ * with the url exists in the cache, we return the stored data from the
+ * cache. If not, the request is sent to the server in one write.
+ * The reply is read into a chain of buffers as it arrives and relayed to the
+ * client from them; if the web object turns out small enough, the chain is
+ * then handed to the cache.
+ * Only GET and HEAD go through the cache. The body of any other request
+ * is streamed to the origin after the headers, beginning with the
+ * nearly bytes at early that came in with the request head, and a
+ * successful answer to it invalidates what the cache holds for url.
+ * Requests go out as HTTP/1.1, so replies may come chunked: they are
+ * decoded as they arrive, and the relay stops at the end of the body
+ * rather than when the origin closes.
+ * With -b, the response reaches the client through a spool, which holds
+ * what a slow client hasn't taken yet so the origin connection is closed
+ * as soon as the response is in.
+ * A client that goes away doesn't end a fetch that is being stored and
+ * is close enough to its end (see client_gone); any other is cancelled.
+ * A hit is answered without waiting on anything misses hold. With -O,
+ * -L and -M, a miss may have to wait for a place among the requests to
+ * its origin, for its client's turn to go to one and for a place in
+ * the miss pool, and the relay keeps to the client's bandwidth; client
+ * is its slot in the limits.
+ * With -H, a GET or HEAD without a body whose answer is slow to start
+ * is sent again on a second connection, and the first connection to
+ * answer is relayed (see hedge.h).
+ */
+void make_request(int fd, http_request *req, char *url, char *host,
+                  const http_slice *path, int port, char *early, size_t nearly,
+                  int client)
+{
+
+    int net_fd;
+    char authority[MAXLINE];
+    msg upstream;
+    int i;
+
+    int safe = http_slice_is(&req->method, "GET") ||
+               http_slice_is(&req->method, "HEAD");
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    //The request body, if any, is delimited by its chunked coding or
+    //its Content-Length; the coding wins when both are present
+    const http_slice *te = http_request_header(req, HTTP_HDR_TRANSFER_ENCODING);
+    const http_slice *cl = http_request_header(req, HTTP_HDR_CONTENT_LENGTH);
+    int chunked = te != NULL;
+    long body_len = 0;
+
+    if ((te != NULL && !http_is_chunked(te->p, te->len)) ||
+        (te == NULL && cl != NULL &&
+         (body_len = http_parse_length(cl->p, cl->len)) < 0))
+    {
+        clienterror(fd, url, "400", "Bad Request", "Can't find the body for");
+        return;
+    }
+
+    /* The following code adds the necessary information to make a complete request */
+    msg_init(&upstream);
+    msg_add_slice(&upstream, &req->method);
+    msg_add_str(&upstream, " ");
+    msg_add_slice(&upstream, path);
+    msg_add_str(&upstream, " HTTP/1.1\r\n");
+
+    const http_slice *host_header = http_request_header(req, HTTP_HDR_HOST);
+    if (host_header != NULL)
+        msg_add_header(&upstream, "Host", 4, host_header->p, host_header->len);
+    else
+    {
+        //an IPv6 literal needs its brackets back
+        int n = snprintf(authority, sizeof(authority),
+                         strchr(host, ':') ? "[%s]" : "%s", host);
+        if (port != 80 && n < sizeof(authority))
+            n += snprintf(authority + n, sizeof(authority) - n, ":%d", port);
+        if (n >= sizeof(authority))
+            upstream.overflow = 1;
+        else
+            msg_add_header(&upstream, "Host", 4, authority, n);
+    }
+
+    msg_add_header_str(&upstream, "User-Agent", user_agent);
+    msg_add_header_str(&upstream, "Accept", accept_type);
+    msg_add_header_str(&upstream, "Accept-Encoding", accept_encoding);
+    msg_add_header_str(&upstream, "Connection", "close");
+    msg_add_header_str(&upstream, "Proxy-Connection", "close");
+
+    /* We add the client's other headers, they are not ours to drop. An
+     * Expect: 100-continue is answered here rather than by the origin */
+    int expect_continue = 0;
+    for (i = 0; i < req->nheaders; i++)
+    {
+        http_header *h = &req->headers[i];
+        if (h->id == HTTP_HDR_HOST || h->id == HTTP_HDR_USER_AGENT ||
+            h->id == HTTP_HDR_ACCEPT || h->id == HTTP_HDR_ACCEPT_ENCODING ||
+            h->id == HTTP_HDR_CONNECTION ||
+            h->id == HTTP_HDR_PROXY_CONNECTION ||
+            h->id == HTTP_HDR_KEEP_ALIVE ||
+            (chunked && h->id == HTTP_HDR_CONTENT_LENGTH))
+            continue;
+        if (http_slice_is(&h->name, "Expect"))
+        {
+            expect_continue = http_value_contains(h->value.p, h->value.len,
+                                                  "100-continue");
+            continue;
+        }
+        msg_add_header(&upstream, h->name.p, h->name.len,
+                       h->value.p, h->value.len);
+    }
+
+    if (upstream.overflow)
+    {
+        clienterror(fd, url, "431", "Request Header Fields Too Large",
+                    "Can't forward");
+        return;
+    }
+
+    /* upstream holds the headers the origin will see, so it is also what
+     * selects between the Vary variants of a cached object */
+    web_object* found = safe ? checkCache(cache, url, &upstream) : NULL;
 
-   strcpy(other_headers, "");
+    //another worker may have stored it
+    if (found == NULL && safe && shm_cache_load(cache, url, &upstream))
+        found = checkCache(cache, url, &upstream);
 
-   dbg_printf("\nReading headers\n-----------\n");
+    //If the object is found, write the data back to the client
+    if(found != NULL) {
+        send_cached(fd, found, req);
+        releaseObject(cache, found);
+        lane_hit(&start);
+        return;
+    }
+
+    //Large objects are looked up in their own store; ranges it only
+    //holds part of are left to the origin
+    large_object *large = safe ? large_lookup(url) : NULL;
+
+    if (large != NULL) {
+        int sent = send_large(fd, large, req, host, port, &upstream,
+                              client);
+        large_release(large);
+        if (sent == 0)
+            return;
+        large = NULL;
+    }
+
+    //a miss waits for a place among the requests to its origin, then
+    //for its client's turn; each return from here on gives all back
+    int origin = origin_acquire(host, port, safe ? ORIGIN_PRIORITY_HIGH :
+                                                   ORIGIN_PRIORITY_LOW);
+    if (origin == ORIGIN_OVERFLOW)
+    {
+        char status[16];
+        snprintf(status, sizeof(status), "%d", origin_status);
+        clienterror(fd, host, status, origin_reason(origin_status),
+                    "Too many requests waiting for");
+        return;
+    }
+    if (limit_fetch_begin(client) < 0)
+    {
+        origin_release(origin);
+        clienterror(fd, host, "503", "Service Unavailable",
+                    "Too busy to fetch from");
+        return;
+    }
+    //and last for a place in the miss pool, which only fetches that
+    //are ready to go hold
+    if (lane_miss_begin() < 0)
+    {
+        limit_fetch_end(client);
+        origin_release(origin);
+        clienterror(fd, host, "503", "Service Unavailable",
+                    "Too many misses to fetch from");
+        return;
+    }
+
+    net_fd = upstream_connect(host, port);
+
+    if (net_fd == UPSTREAM_DNS_ERROR)
+    {
+        end_fetch(client, origin);
+        clienterror(fd, host, "DNS!", "DNS error, this host isn't a host!", "Ah!");
+	return;
+    }
+    if (net_fd < 0)
+    {
+        end_fetch(client, origin);
+        clienterror(fd, host, "502", "Bad Gateway", "Can't connect to");
+        return;
+    }
+    timeout_send(net_fd, TIMEOUT_PHASE_IDLE);
+
+    //the blank line ending the headers; send_large adds its own Range first
+    msg_add_str(&upstream, "\r\n");
+
+    //a copy of the request is kept for a hedge once the origin's
+    //answer times are known, as sending consumes the message
+    int hedging = hedge_percent > 0 && safe && !chunked && body_len == 0;
+    hedge hg;
+    msg again;
+    if (hedging)
+    {
+        hedge_start(&hg, host, port);
+        if (hg.delay >= 0)
+        {
+            msg_init(&again);
+            msg_append(&again, &upstream);
+        }
+    }
+
+#ifdef DEBUG
+    //the request holds the client's headers, cookies and all
+    dbg_printf("\n   SENDING REQUEST\n");
+    msg_dump(&upstream, stdout);
+    dbg_printf("\n   ENDING  REQUEST\n");
+#endif
+
+    if (msg_send(&upstream, net_fd) < 0)
+    {
+        Close(net_fd);
+        end_fetch(client, origin);
+        return;
+    }
+
+    if (chunked || body_len > 0)
+    {
+        static const char *proceed = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (expect_continue && http_slice_is(&req->version, "HTTP/1.1"))
+            rio_writen(fd, (void *)proceed, strlen(proceed));
+
+        int sent = send_body(fd, net_fd, chunked, body_len, early, nearly);
+        if (sent < 0)
+        {
+            dbg_printf("Request body not forwarded\n");
+            if (sent == -2)
+                clienterror(fd, url, "400", "Bad Request",
+                            "Malformed chunked body for");
+            Close(net_fd);
+            end_fetch(client, origin);
+            return;
+        }
+    }
+
+    if (hedging && hedge_due(&hg, net_fd))
+    {
+        int other = upstream_connect_other(host, port, net_fd);
+        if (other >= 0)
+        {
+            timeout_send(other, TIMEOUT_PHASE_IDLE);
+            if (msg_send(&again, other) < 0)
+            {
+                Close(other);
+                other = -1;
+            }
+        }
+        if (other >= 0 && (net_fd = hedge_race(&hg, net_fd, other)) < 0)
+        {
+            end_fetch(client, origin);
+            timeout_hit(TIMEOUT_PHASE_TTFB);
+            clienterror(fd, host, "504", "Gateway Timeout",
+                        "No answer in time from");
+            return;
+        }
+    }
+
+    //the origin gets so long to start answering, then so long between
+    //reads once it has
+    timeout_recv(net_fd, TIMEOUT_PHASE_TTFB);
+
+    //With buffering on, the response goes to the client through a
+    //spool from here on, so the origin is read as fast as it sends
+    spool sp;
+    int spooled = spool_memory > 0 && spool_open(&sp, fd) == 0;
+    if (spooled)
+        fd = sp.fd;
+
+    //The response is read straight into the segments of a chain, sent
+    //to the client from there and, if it is small enough to be cached,
+    //handed over to the cache without being copied again.
+    chain response;
+    chain_init(&response);
+    //the answer to a HEAD has no body, it is not the object, and
+    //other methods don't fetch the object either
+    int caching = http_slice_is(&req->method, "GET");
+    int head = http_slice_is(&req->method, "HEAD");
+    char *chunk;
+    int read_return;
 
-   Rio_readlineb(rp, buf, MAXLINE);
-   while(strcmp(buf, "\r\n"))
-   {
-        Rio_readlineb(rp, buf, MAXLINE);
-        printf("%s", buf);
+    //The body is hashed as it arrives so the cache can find an identical
+    //body it already holds; header_bytes stays 0 until the end of the
+    //response headers has been seen, and expected is the size of the
+    //whole response once its Content-Length is known
+    unsigned long body_hash = CACHE_HASH_INIT;
+    size_t header_bytes = 0;
+    unsigned int expected = 0;
+    fill_state fill = { 0, 0, 0 };
+
+    //How the body ends: after left more bytes (-1 while that isn't
+    //known, or when it runs until the origin closes), or with the last
+    //chunk of a chunked body. Chunked bodies are decoded in place as they
+    //arrive and sent on re-chunked to clients that speak HTTP/1.1, as
+    //plain bytes to the others. raw is set when the response headers
+    //are too long to look at and everything is relayed as it comes
+    long left = -1;
+    int dechunk = 0, raw = 0;
+    int rechunk = http_slice_is(&req->version, "HTTP/1.1");
+    http_chunked decoder;
+    http_meta meta;
+
+    //A text body going to a client that accepts gzip is compressed on
+    //the way (zip) into zipped, which is kept along with the response
+    //while it may be cached, so that the cache has its gzip copy too
+    const http_slice *ae = http_request_header(req, HTTP_HDR_ACCEPT_ENCODING);
+    int zip = 0;
+    gzip_stream z;
+    chain zipped;
+    chain_init(&zipped);
 
-        int prefix = strlen("Host: ");
+    dbg_printf("Entering reading loop\n");
+    while (left != 0 && !(dechunk && decoder.done))
+    {
+        //Size of the next segment: what is left of a response of known
+        //length, so its body ends up in one segment; otherwise twice the
+        //last one. Only one buffer is needed when nothing is kept.
+        unsigned int want = CHAIN_SEG_SIZE;
+        if (caching && expected > response.len)
+            want = expected - response.len;
+        else if (caching && response.tail != NULL)
+            want = response.tail->cap * 2;
+
+        read_return = chain_read(net_fd, &response, want, &chunk);
+        if (read_return < 0 && timeout_expired(errno) && !fill.gone)
+        {
+            timeout_hit(header_bytes == 0 ? TIMEOUT_PHASE_TTFB :
+                        TIMEOUT_PHASE_IDLE);
+            if (header_bytes == 0 && response.len == 0)
+                clienterror(fd, host, "504", "Gateway Timeout",
+                            "No answer in time from");
+        }
+        if (read_return <= 0)
+            break;
+        if (hedging)
+            hedge_answered(&hg);
+        //a client over its bandwidth waits here, holding off the origin
+        if (!fill.gone)
+            limit_sent(client, read_return);
+
+        //once the client is gone, only a fetch worth finishing goes on
+        if (fill.gone && !fill_goes_on(&fill, caching, read_return))
+        {
+            caching = 0;
+            break;
+        }
+
+        dbg_printf("Read return: %d\n", read_return);
+        dbg_printf("Object size: %u\n", response.len);
+
+        if (raw)
+        {
+            if (rio_writen(fd, chunk, read_return) < 0 &&
+                !client_gone(&fill, net_fd, 0, left))
+                break;
+            chain_reset(&response);
+            continue;
+        }
+
+        //what goes to the client this time: the headers, once they are
+        //complete, and the body bytes just read
+        msg out;
+        msg_init(&out);
+        int at_head = 0;
+
+        if (header_bytes == 0)
+        {
+            //Nothing goes to the client before the headers are complete,
+            //which they must be in the first segment
+            chain_seg *first = response.head;
+            header_bytes = http_header_end(first->data + first->off, first->len);
+
+            //an interim (1xx) answer is not the response
+            while (header_bytes > 12 && first->data[first->off + 9] == '1' &&
+                   !strncmp(first->data + first->off, "HTTP/1.", 7))
+            {
+                chain_consume(&response, header_bytes);
+                first = response.head;
+                header_bytes = http_header_end(first->data + first->off,
+                                               first->len);
+            }
+
+            char *block = first->data + first->off;
+            if (header_bytes == 0 ||
+                http_parse_meta(block, header_bytes, &meta) < 0)
+            {
+                if (header_bytes > 0 || response.head != response.tail)
+                {
+                    dbg_printf("Response headers relayed as they are\n");
+                    raw = 1;
+                    caching = 0;
+                    chain_write(fd, &response);
+                    chain_reset(&response);
+                }
+                header_bytes = 0;
+                continue;
+            }
+
+            //the status of the answer to an unsafe method tells whether
+            //the resource may have changed
+            if (!safe)
+                invalidate(url, block, header_bytes);
+
+            chunk = block + header_bytes;
+            read_return = first->len - header_bytes;
+            at_head = 1;
+            timeout_recv(net_fd, TIMEOUT_PHASE_IDLE);
+
+            if (head || meta.status == 204 || meta.status == 304)
+            {
+                msg_add(&out, block, header_bytes);
+                read_return = 0;
+                left = 0;
+            }
+            else
+            {
+                dechunk = meta.chunked;
+                zip = gzip_level > 0 && meta.status == 200 && ae != NULL &&
+                      http_accepts_encoding(ae->p, ae->len, "gzip") &&
+                      (meta.content_length < 0 ||
+                       meta.content_length >= GZIP_MIN_LENGTH) &&
+                      http_compressible(block, header_bytes) &&
+                      gzip_budget_ok() && gzip_stream_init(&z, gzip_level) == 0;
+
+                if (zip)
+                {
+                    add_gzip_headers(&out, block, &meta);
+                    if (rechunk)
+                        msg_add_str(&out, "Transfer-Encoding: chunked\r\n");
+                    msg_add_str(&out, "\r\n");
+                }
+                else if (dechunk)
+                {
+                    //the client learns of the chunked coding only if it
+                    //gets the body re-chunked
+                    add_plain_headers(&out, block, &meta, rechunk);
+                    msg_add_str(&out, "\r\n");
+                }
+                else
+                    msg_add(&out, block, header_bytes);
+
+                if (dechunk)
+                {
+                    http_chunked_init(&decoder);
+                    read_return = dechunk_tail(&response, read_return, &decoder);
+                }
+                else if (meta.content_length >= 0)
+                {
+                    left = meta.content_length - read_return;
+                    if (left < 0)
+                        left = 0;
+                }
+            }
+        }
+        else if (dechunk)
+        {
+            //the decoded data is left where it was read
+            read_return = dechunk_tail(&response, read_return, &decoder);
+        }
+        else if (left > 0)
+            left = left > read_return ? left - read_return : 0;
+
+        if (read_return < 0)
+        {
+            dbg_printf("Malformed chunked body\n");
+            caching = 0;
+            break;
+        }
+
+        //Write the data back to the client: the body bytes are the last
+        //read_return bytes of the response, or what compressing them
+        //added to zipped
+        int last = dechunk ? decoder.done : left == 0;
+        int sent = 0;
+        if (zip)
+        {
+            if (!caching)
+                chain_reset(&zipped);
+            unsigned int before = zipped.len;
+            if (gzip_stream_write(&z, chunk, read_return, last, &zipped) < 0)
+            {
+                caching = 0;
+                break;
+            }
+            if (!fill.gone)
+                sent = send_piece(fd, &out, &zipped, before,
+                                  zipped.len - before, rechunk, last);
+        }
+        else if (!fill.gone)
+            sent = send_piece(fd, &out, &response, response.len - read_return,
+                              read_return, dechunk && rechunk, last);
 
-	if (!strncmp(buf, "Host: ", prefix))
-            strcpy(host_header, buf + prefix);
-        /* We add other headers when required */
-        if (strncmp(buf, "User-Agent: ", strlen("User-Agent: ")) &&
-            strncmp(buf, "Accept: ", strlen("Accept: ")) &&
-            strncmp(buf, "Accept-Encoding: ", strlen("Accept-Encoding: ")) &&
-            strncmp(buf, "Connection: ", strlen("Connection: ")) &&
-            strncmp(buf, "Proxy-Connection: ", strlen("Proxy-Connection: ")))
-       {
-            sprintf(other_headers, "%s%s", other_headers, buf);
-       }
-    /* We added this check in order to ignore garbage headers */
-	if (buf[0] > 90 || buf[0] < 65)
-	{
-	  return;
-	}
-   }
+        if (sent < 0 && timeout_expired(errno))
+            timeout_hit(TIMEOUT_PHASE_IDLE);
+        if (sent < 0 && !client_gone(&fill, net_fd, caching, left))
+        {
+            caching = 0;
+            break;
+        }
+
+        if (!caching || header_bytes == 0)
+        {
+            //nothing is kept: read the next chunk into the same buffer,
+            //unless the headers are still incomplete
+            if (!caching)
+                chain_reset(&response);
+            continue;
+        }
 
-   dbg_printf("--------\nDone with headers\n");
-   return;
+        if (response.len >= MAX_OBJECT_SIZE)
+        {
+            dbg_printf("Too big to cache\n");
+            caching = 0;
+            chain_reset(&response);
+            continue;
+        }
+
+        body_hash = cache_hash(body_hash, chunk, read_return);
+        if (!at_head || dechunk)
+            continue;
+
+        //the first bytes of the body: its Content-Length says if the
+        //object can be cached
+        chain_seg *first = response.head;
+        if (meta.content_length >= 0)
+        {
+            long total = header_bytes + meta.content_length;
+            if (total >= MAX_OBJECT_SIZE)
+            {
+                dbg_printf("Content-Length too big to cache\n");
+                caching = 0;
+
+                //it may still go to the large object store, in which
+                //case the rest of the body is relayed chunk by chunk
+                //(as it is, so not when it is being compressed)
+                if (!zip && large_cacheable(first->data + first->off,
+                                            header_bytes))
+                    large = large_admit(url, first->data + first->off,
+                                        header_bytes, meta.content_length);
+                if (large != NULL)
+                {
+                    relay_large(fd, net_fd, large, 0,
+                                first->data + first->off + header_bytes,
+                                first->len - header_bytes, &fill, client);
+                    large_end_fill(large);
+                    large_release(large);
+                    left = 0;
+                }
+
+                chain_reset(&response);
+                continue;
+            }
+            expected = total;
+        }
+    }
+
+    Close(net_fd);
+    end_fetch(client, origin);
+
+    //a body cut short, or a chunked one without its last chunk, is not
+    //the object
+    int complete = header_bytes > 0 && left <= 0 && (!dechunk || decoder.done);
+
+    //a body that ran until the origin closed ends the gzip stream now
+    if (zip && complete && left < 0 && !dechunk)
+    {
+        msg out;
+        msg_init(&out);
+        if (!caching)
+            chain_reset(&zipped);
+        unsigned int before = zipped.len;
+        if (gzip_stream_write(&z, NULL, 0, 1, &zipped) < 0)
+            caching = 0;
+        else if (!fill.gone)
+            send_piece(fd, &out, &zipped, before, zipped.len - before,
+                       rechunk, 1);
+    }
+    if (zip)
+        gzip_stream_end(&z);
+
+    if (fill.gone && caching && complete)
+    {
+        dbg_printf("Fetch finished for the cache after its client left\n");
+        pthread_mutex_lock(&fill_lock);
+        fills_finished++;
+        pthread_mutex_unlock(&fill_lock);
+    }
+
+    if (caching && complete)
+    {
+        //the stored copy of a chunked response gets the length of the
+        //decoded body instead of its coding
+        if (dechunk && store_plain_headers(&response, header_bytes, &meta) < 0)
+            caching = 0;
+
+        if (caching)
+        {
+            dbg_printf("\nAdding to cache . . . \n");
+            addToCache(cache, &response, url, &upstream, body_hash,
+                       zip ? &zipped : NULL);
+            shm_cache_store(cache, url, &upstream);
+            dbg_printf("Done!\n");
+        }
+    }
+    chain_free(&response);
+    chain_free(&zipped);
+
+    //the origin is long gone when a slow client gets its last bytes
+    if (spooled)
+        spool_close(&sp);
+
+    return;
 }
 
+/*
+* Gives back the place of a fetch in the miss pool and among the
+* requests to its origin, and its client's turn to fetch, as soon as
+* the origin's part is over.
+*/
+void end_fetch(int client, int origin)
+{
+    lane_miss_end();
+    limit_fetch_end(client);
+    origin_release(origin);
+}
+
+/*
+* Decodes in place the n bytes of a chunked body just read to the end
+* of c, leaving only the data they held there. Returns the number of
+* data bytes, or -1 if the framing is malformed.
+*/
+long dechunk_tail(chain *c, unsigned int n, http_chunked *decoder)
+{
+    char *at = c->tail->data + c->tail->off + c->tail->len - n;
+    long len = http_dechunk(decoder, at, n);
+
+    if (len < 0)
+        return -1;
+    chain_shrink(c, n - len);
+    return len;
+}
 
 /*
-* Parses URL from GET request into hostname and path
+* Sends m to the client followed by len bytes of body, those of c from
+* offset off: as one chunk of a chunked body if rechunk is set, with
+* the empty chunk that ends the body after them if last is set too,
+* and as they are otherwise.
 */
-int parse_url(char *url, char *host, char *path, char *cgiargs)
+int send_piece(int fd, msg *m, const chain *c, unsigned int off,
+               unsigned int len, int rechunk, int last)
 {
-    char *path_ptr;
+    if (rechunk && len > 0)
+        msg_printf(m, "%x\r\n", len);
+    msg_add_chain_range(m, c, off, len);
+    if (rechunk && len > 0)
+        msg_add_str(m, "\r\n");
+    if (rechunk && last)
+        msg_add_str(m, "0\r\n\r\n");
+    return m->len > 0 ? msg_send(m, fd) : 0;
+}
 
-    char temp[MAXLINE];
-    strcpy(temp, url);
+/*
+* Called when writing to the client of a fetch failed, with left bytes
+* of the body still to be read from net_fd (-1 if that isn't known).
+* Says whether the fetch goes on without the client: only if what it
+* reads is being stored, and if no more than fill_budget bytes are left
+* when that is known. Fetches that go on get FILL_TIME_BUDGET seconds,
+* which a receive timeout on net_fd enforces on a stalled origin.
+*/
+int client_gone(fill_state *fill, int net_fd, int storing, long left)
+{
+    struct timeval tv = { FILL_TIME_BUDGET, 0 };
+
+    if (fill->gone)
+        return 1;
+    if (!storing || fill_budget <= 0 || left > fill_budget)
+    {
+        pthread_mutex_lock(&fill_lock);
+        fills_cancelled++;
+        pthread_mutex_unlock(&fill_lock);
+        return 0;
+    }
 
-    memset(host, 0, sizeof(host));
-    memset(path, 0, sizeof(path));
+    dbg_printf("Client gone, fetch goes on for the cache\n");
+    fill->gone = 1;
+    fill->budget = fill_budget;
+    fill->deadline = time(NULL) + FILL_TIME_BUDGET;
+    setsockopt(net_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return 1;
+}
 
-    sscanf(url, "http://%s", url);
+/*
+* Charges n bytes just read to a fetch going on without its client.
+* Returns 0 if it is to be cancelled: its budget of bytes or time ran
+* out, or what it reads is no longer being stored.
+*/
+int fill_goes_on(fill_state *fill, int storing, long n)
+{
+    fill->budget -= n;
+    if (storing && fill->budget >= 0 && time(NULL) <= fill->deadline)
+        return 1;
+
+    dbg_printf("Fetch cancelled\n");
+    pthread_mutex_lock(&fill_lock);
+    fills_cancelled++;
+    pthread_mutex_unlock(&fill_lock);
+    return 0;
+}
 
+/*
+* Adds the header block at block, up to end, to m without the n spans
+* of it in skip, each a start and an end offset (the end 0 for none).
+* The spans must not overlap.
+*/
+void add_headers_except(msg *m, const char *block, size_t end,
+                        size_t skip[][2], int n)
+{
+    size_t at = 0;
+    int i, j;
 
-    if ((path_ptr = strchr(url, '/')) == NULL)
+    //in order of their start
+    for (i = 1; i < n; i++)
     {
-        strcpy(host, url);
-        strcpy(cgiargs, "");
-        strcpy(path, "/");
+        for (j = i; j > 0 && skip[j][0] < skip[j - 1][0]; j--)
+        {
+            size_t t0 = skip[j][0], t1 = skip[j][1];
+            skip[j][0] = skip[j - 1][0];
+            skip[j][1] = skip[j - 1][1];
+            skip[j - 1][0] = t0;
+            skip[j - 1][1] = t1;
+        }
+    }
 
+    for (i = 0; i < n; i++)
+    {
+        if (skip[i][1] == 0)
+            continue;
+        msg_add(m, block + at, skip[i][0] - at);
+        at = skip[i][1];
     }
+    msg_add(m, block + at, end - at);
+}
 
-    else
+/*
+* Adds the header block of a chunked response at block, without the
+* blank line ending it, to m. Its Transfer-Encoding line is dropped
+* unless keep_te is set, and so is any Content-Length line, which
+* can't describe a chunked body.
+*/
+void add_plain_headers(msg *m, const char *block, http_meta *meta, int keep_te)
+{
+    size_t skip[2][2] = { { meta->cl_start, meta->cl_end },
+                          { 0, 0 } };
+
+    if (!keep_te)
     {
-        strcpy(path, path_ptr);
+        skip[1][0] = meta->te_start;
+        skip[1][1] = meta->te_end;
+    }
+    add_headers_except(m, block, meta->head_end, skip, 2);
+}
 
-        dbg_printf("strlen\n");
+/*
+* Adds the header block at block, without the blank line ending it, to
+* m for a body sent gzipped: the origin's length and transfer coding
+* no longer apply, and a strong ETag is made weak, since the gzip body
+* isn't the bytes the origin tagged. Content-Encoding is added, and
+* Vary for downstream caches to learn that the coding was negotiated.
+*/
+void add_gzip_headers(msg *m, const char *block, http_meta *meta)
+{
+    size_t skip[3][2] = { { meta->cl_start, meta->cl_end },
+                          { meta->te_start, meta->te_end },
+                          { meta->etag_start, meta->etag_end } };
+
+    add_headers_except(m, block, meta->head_end, skip, 3);
+    if (meta->etag.len >= 2 && !strncmp(meta->etag.p, "W/", 2))
+        msg_add_header(m, "ETag", 4, meta->etag.p, meta->etag.len);
+    else if (meta->etag.len > 0)
+        msg_printf(m, "ETag: W/%.*s\r\n", (int)meta->etag.len, meta->etag.p);
+    msg_add_str(m, "Content-Encoding: gzip\r\n");
+    if (!meta->vary_encoding)
+        msg_add_str(m, "Vary: Accept-Encoding\r\n");
+}
 
-        path_ptr[0] = '\0';
-        strcpy(host, url);
+/*
+* Replaces the header_bytes bytes of headers at the start of response,
+* a chunked response whose body has been decoded, with headers that
+* describe the decoded body: no Transfer-Encoding and a Content-Length.
+* Returns 0, or -1 if they don't fit in a segment.
+*/
+int store_plain_headers(chain *response, size_t header_bytes, http_meta *meta)
+{
+    char headers[CHAIN_SEG_SIZE];
+    size_t n = 0;
+    msg m;
+    int i;
+
+    msg_init(&m);
+    add_plain_headers(&m, response->head->data + response->head->off, meta, 0);
+    msg_printf(&m, "Content-Length: %u\r\n\r\n",
+               response->len - (unsigned int)header_bytes);
+    if (m.overflow || m.len > sizeof(headers))
+        return -1;
+
+    for (i = 0; i < m.niov; i++)
+    {
+        memcpy(headers + n, m.iov[i].iov_base, m.iov[i].iov_len);
+        n += m.iov[i].iov_len;
     }
 
+    chain_consume(response, header_bytes);
+    chain_prepend(response, headers, n);
+    return 0;
+}
 
-    char *port_ptr;
-    int port;
-    //checks if the user requests a certain port
-    if ((port_ptr = strchr(host, ':')) != NULL)
+/*
+* Streams the body of a client's request to the origin as it arrives,
+* starting with the nearly bytes at early read along with the request
+* head. A body of length bytes is copied as it is. A chunked body
+* (chunked set) is passed on with its framing, which is only followed
+* to find where the body ends. Nothing is buffered beyond one read.
+* Returns 0, -1 if either side went away or -2 if the chunked framing
+* is malformed.
+*/
+int send_body(int fd, int net_fd, int chunked, long length, char *early,
+              size_t nearly)
+{
+    char buf[MAXBUF];
+    http_chunked decoder;
+    http_slice data;
+    char *p = early;
+    ssize_t n = nearly;
+    size_t take;
+
+    http_chunked_init(&decoder);
+    while (chunked ? !decoder.done : length > 0)
     {
-        port_ptr++;
-	dbg_printf("Port Ptr: %s\n", port_ptr);
-	port = atoi(port_ptr);
-	dbg_printf("Got port number: %d\n", port);
+        if (n == 0)
+        {
+            size_t want = sizeof(buf);
+            if (!chunked && length < want)
+                want = length;
+            n = read(fd, buf, want);
+            if (n < 0 && errno == EINTR)
+            {
+                n = 0;
+                continue;
+            }
+            if (n <= 0)
+                return -1;
+            p = buf;
+        }
+
+        //only the bytes up to the end of the body are ours to send
+        if (chunked)
+        {
+            for (take = 0; take < n && !decoder.done; )
+            {
+                long used = http_chunked_step(&decoder, p + take, n - take,
+                                              &data);
+                if (used < 0)
+                    return -2;
+                take += used;
+            }
+        }
+        else
+        {
+            take = n < length ? n : length;
+            length -= take;
+        }
+
+        if (rio_writen(net_fd, p, take) != take)
+            return -1;
+        n = 0;
     }
 
-    else
-        port = 80;//else uses the default port
+    return 0;
+}
+
+/*
+* Called with the first len bytes of the answer to a request that may
+* have changed a resource (POST, PUT, PATCH, DELETE). Unless its status
+* is an error, what is cached for url is dropped, and so is what is
+* cached for the URLs of its Location and Content-Location headers when
+* they are on the same origin.
+*/
+void invalidate(char *url, const char *head, size_t len)
+{
+    static const char *names[] = { "Location", "Content-Location" };
+    char other[MAXLINE];
+    size_t end, vlen;
+    int i;
+
+    if (len < 12 || strncmp(head, "HTTP/1.", 7) || atoi(head + 9) >= 400)
+        return;
 
-    dbg_printf("LEAVING PARSE_URL()!\n");
-    dbg_printf(" URL = %s\n", temp);
-    dbg_printf(" HOST = %s\n", host);
-    dbg_printf(" PATH = %s\n\n", path);
+    invalidateCache(cache, url);
+    large_invalidate(url);
+    shm_cache_remove(url);
 
-    return port;
+    //the origin part of url, "http://host[:port]"
+    char *slash = strchr(url + strlen("http://"), '/');
+    int olen = slash ? slash - url : strlen(url);
 
+    if ((end = http_header_end(head, len)) == 0)
+        return;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        const char *value = http_find_header(head, end, names[i], &vlen);
+        if (value == NULL || vlen == 0)
+            continue;
+
+        if (value[0] == '/')
+            snprintf(other, sizeof(other), "%.*s%.*s", olen, url,
+                     (int)vlen, value);
+        else if (vlen >= olen && !strncasecmp(value, url, olen) &&
+                 (vlen == olen || value[olen] == '/'))
+            snprintf(other, sizeof(other), "%.*s", (int)vlen, value);
+        else
+            continue;
+
+        invalidateCache(cache, other);
+        large_invalidate(other);
+        shm_cache_remove(other);
+    }
 }
 
-/* Make request creates a request using the information such as the port,
- * file descriptor, url, host, path & necessary headers. These are stored
- * in a structure called argstruct (in order to use Pcreate_thread for
- * each new request that needs to be made). If the object associated with the url
- * exists in the cache, we return the stored data from the cache.
- * If not, the complete request with the
- * given information is created and stored in buf which is then read
- * MAXBUF bytes at a time. Information about the size & data from the web object
- * are kept track of and stored in cache_object_size & cache_object so that
- * the web object may be cached later.
- */
-void make_request(int fd, char *url, char *host,
-	char *path, char *host_header, char *other_headers, int port)
+/*
+* Writes a cached object back to the client, assembled from the
+* metadata parsed when it was stored rather than from its headers: an
+* Age header is added, a HEAD only gets the headers, a conditional
+* request the object still satisfies gets a 304 and a Range request
+* gets the ranges asked for in a 206. A client accepting gzip gets
+* the gzip copy of the body, if it has one (the stored body itself
+* when it is stored compressed), with a Content-Encoding and
+* Content-Length of its own. Otherwise objects stored without
+* compression are sent as received, and compressed ones inflated.
+*/
+void send_cached(int fd, web_object *obj, http_request *req)
 {
+    body_blob *body = obj->body;
+    http_meta *meta = &obj->meta;
+    const http_slice *ae = http_request_header(req, HTTP_HDR_ACCEPT_ENCODING);
+    int head = http_slice_is(&req->method, "HEAD");
+    msg m;
+
+    if (not_modified(req, meta))
+    {
+        dbg_printf("Cached object not modified\n");
+        send_not_modified(fd, meta, obj->stored);
+        return;
+    }
 
-    web_object* found = checkCache(cache, url);
+    http_range ranges[HTTP_MAX_RANGES];
+    int nranges = range_request(req, meta, body->logical_size, ranges);
+    if (nranges >= 0)
+    {
+        //ranges are of the body as the origin sent it
+        char *plain = NULL;
+        chain_seg seg;
+        chain view = body->data;
 
-    //If the object is found, write the data back to the client
-    if(found != NULL) {
-        Rio_writen(fd, found->data, found->size);
+        if (body->compressed)
+        {
+            if ((plain = inflate_body(body)) == NULL)
+                return;
+            seg.data = plain;
+            seg.off = 0;
+            seg.len = seg.cap = body->logical_size;
+            seg.next = NULL;
+            view.head = view.tail = &seg;
+            view.len = seg.len;
+        }
+        send_ranges(fd, obj->data, meta, obj->stored, &view,
+                    body->logical_size, ranges, nranges);
+        free(plain);
         return;
     }
 
+    //the gzip copy is the stored body itself when the cache keeps it
+    //compressed, otherwise one made for clients (see gzipBody)
+    body_blob *zbody = NULL;
+    if (ae != NULL && http_accepts_encoding(ae->p, ae->len, "gzip"))
+        zbody = gzipBody(cache, obj);
+    int gzip = zbody != NULL;
+
+    //every header but the blank line; a gzip body comes with its own
+    //length
+    msg_init(&m);
+    if (gzip)
+    {
+        add_gzip_headers(&m, obj->data, meta);
+        msg_printf(&m, "Content-Length: %u\r\n", zbody->size);
+    }
+    else
+        msg_add(&m, obj->data, meta->head_end);
+    msg_printf(&m, "Age: %ld\r\n\r\n", (long)(time(NULL) - obj->stored));
 
-    int net_fd;
-    char buf[MAXBUF], reply[MAXBUF];
-    rio_t rio;
+    if (head)
+    {
+        msg_send(&m, fd);
+        return;
+    }
 
-    net_fd = Open_clientfd(host, port);
+    if (!body->compressed || gzip)
+    {
+        if (gzip)
+            dbg_printf("Sending %u byte gzip body from cache\n", zbody->size);
+        msg_add_chain(&m, gzip ? &zbody->data : &body->data);
+        msg_send(&m, fd);
+        return;
+    }
 
-    if (net_fd < -1)
+    char *plain = inflate_body(body);
+    if (plain != NULL)
     {
-        clienterror(fd, host, "DNS!", "DNS error, this host isn't a host!", "Ah!");
-	return;
+        msg_add(&m, plain, body->logical_size);
+        msg_send(&m, fd);
+        free(plain);
     }
+}
 
-    /* The following code adds the necessary information to make buf a complete request */
-    sprintf(buf, "GET %s HTTP/1.0\r\n", path);
-    printf("Send request buf: \n%s\n", buf);
+/*
+* Returns a malloc'd copy of a compressed body as the origin sent it,
+* or NULL if it doesn't inflate to its recorded size.
+*/
+char *inflate_body(body_blob *body)
+{
+    unsigned int bodySize = body->logical_size;
+    char *plain = Malloc(bodySize);
+
+    if (gzip_decompress(&body->data, plain, bodySize) != bodySize)
+    {
+        free(plain);
+        return NULL;
+    }
 
-    if (!strlen(host_header))
-        sprintf(buf, "%sHost: %s\r\n", buf, host);
+    dbg_printf("Inflated %u byte body from cache\n", bodySize);
+    return plain;
+}
+
+/*
+* Resolves the Range header of a GET for a cached 200 whose body is
+* length bytes. Returns the number of ranges stored in ranges, 0 if
+* none is satisfiable, or -1 if the whole object is to be sent: no
+* Range, one that is ignored, or an If-Range naming another version.
+*/
+int range_request(http_request *req, http_meta *meta, long length,
+                  http_range *ranges)
+{
+    const http_slice *range = http_request_header(req, HTTP_HDR_RANGE);
+    const http_slice *if_range = http_request_header(req, HTTP_HDR_IF_RANGE);
+
+    if (range == NULL || meta->status != 200 ||
+        !http_slice_is(&req->method, "GET"))
+        return -1;
+
+    //If-Range compares strongly: weak tags never match
+    if (if_range != NULL)
+    {
+        const http_slice *validator = if_range->len > 0 && if_range->p[0] == '"' ?
+                                      &meta->etag : &meta->last_modified;
+        if (if_range->len >= 2 && !strncmp(if_range->p, "W/", 2))
+            return -1;
+        if (validator->len != if_range->len ||
+            memcmp(validator->p, if_range->p, if_range->len))
+            return -1;
+    }
+
+    return http_parse_ranges(range->p, range->len, length, ranges);
+}
+
+/*
+* Sends the n ranges of a cached body (length bytes, in body) as a
+* 206, with the stored headers described by meta. One range is sent
+* as such, several as a multipart/byteranges body. With no range
+* satisfiable the answer is a 416.
+*/
+void send_ranges(int fd, char *headers, http_meta *meta, time_t stored,
+                 const chain *body, long length, http_range *ranges, int n)
+{
+    char boundary[32];
+    msg m, parts;
+    int i;
+
+    msg_init(&m);
+    msg_init(&parts);
+
+    if (n == 0)
+    {
+        msg_add_str(&m, "HTTP/1.0 416 Range Not Satisfiable\r\n");
+        msg_printf(&m, "Content-Range: bytes */%ld\r\n"
+                   "Content-Length: 0\r\n\r\n", length);
+        msg_send(&m, fd);
+        return;
+    }
+
+    //the stored headers, less the status line, Content-Length and, for
+    //a multipart body, Content-Type
+    size_t skip[2][2] = {{meta->cl_start, meta->cl_end},
+                         {n > 1 ? meta->ct_start : 0, n > 1 ? meta->ct_end : 0}};
+    size_t at = meta->status_end;
+    if (skip[1][0] < skip[0][0])
+    {
+        size_t first[2] = {skip[1][0], skip[1][1]};
+        skip[1][0] = skip[0][0];
+        skip[1][1] = skip[0][1];
+        skip[0][0] = first[0];
+        skip[0][1] = first[1];
+    }
+
+    msg_add_str(&m, "HTTP/1.0 206 Partial Content\r\n");
+    for (i = 0; i < 2; i++)
+    {
+        if (skip[i][1] == 0)
+            continue;
+        msg_add(&m, headers + at, skip[i][0] - at);
+        at = skip[i][1];
+    }
+    msg_add(&m, headers + at, meta->head_end - at);
+
+    if (n == 1)
+    {
+        msg_printf(&m, "Content-Range: bytes %ld-%ld/%ld\r\n",
+                   ranges[0].first, ranges[0].last, length);
+        msg_add_chain_range(&parts, body, ranges[0].first,
+                            ranges[0].last - ranges[0].first + 1);
+    }
     else
-        sprintf(buf, "%sHost: %s\r\n", buf, host_header);
-    sprintf(buf, "%s%s", buf, user_agent);
-    sprintf(buf, "%s%s", buf, accept_type);
-    sprintf(buf, "%s%s", buf, accept_encoding);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sProxy-Connection: close\r\n", buf);
-    sprintf(buf, "%s%s\r\n", buf, other_headers);
+    {
+        snprintf(boundary, sizeof(boundary), "%08lx%08lx",
+                 (unsigned long)stored, (unsigned long)random());
+        for (i = 0; i < n; i++)
+        {
+            msg_add_str(&parts, "\r\n--");
+            msg_add_str(&parts, boundary);
+            msg_add_str(&parts, "\r\n");
+            if (meta->content_type.len > 0)
+            {
+                msg_add_str(&parts, "Content-Type: ");
+                msg_add_slice(&parts, &meta->content_type);
+                msg_add_str(&parts, "\r\n");
+            }
+            msg_printf(&parts, "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                       ranges[i].first, ranges[i].last, length);
+            msg_add_chain_range(&parts, body, ranges[i].first,
+                                ranges[i].last - ranges[i].first + 1);
+        }
+        msg_add_str(&parts, "\r\n--");
+        msg_add_str(&parts, boundary);
+        msg_add_str(&parts, "--\r\n");
 
-    dbg_printf("\n   SENDING REQUEST\n");
-    dbg_printf("%s\n", buf);
-    dbg_printf("\n   ENDING  REQUEST\n");
+        msg_add_str(&m, "Content-Type: multipart/byteranges; boundary=");
+        msg_add_str(&m, boundary);
+        msg_add_str(&m, "\r\n");
+    }
 
+    dbg_printf("Sending %d range(s) from cache\n", n);
+    msg_printf(&m, "Content-Length: %lu\r\nAge: %ld\r\n\r\n",
+               (unsigned long)parts.len, (long)(time(NULL) - stored));
+    msg_append(&m, &parts);
+    msg_send(&m, fd);
+}
 
-    Rio_writen(net_fd, buf, strlen(buf));
+/*
+* Decides whether a conditional request can be answered with a 304
+* from the metadata of a cached 200. If-None-Match takes precedence
+* over If-Modified-Since, as RFC 7232 asks.
+*/
+int not_modified(http_request *req, http_meta *meta)
+{
+    const http_slice *inm = http_request_header(req, HTTP_HDR_IF_NONE_MATCH);
+    const http_slice *ims = http_request_header(req, HTTP_HDR_IF_MODIFIED_SINCE);
 
+    if (meta->status != 200)
+        return 0;
 
-    strcpy(reply, "");
-    strcpy(buf, "");
-    Rio_readinitb(&rio, net_fd);
+    if (inm != NULL)
+        return http_etag_matches(inm->p, inm->len, &meta->etag);
 
-    int read_return;
+    if (ims != NULL && meta->last_modified.len > 0)
+    {
+        time_t since = http_parse_date(ims->p, ims->len);
+        time_t modified = http_parse_date(meta->last_modified.p,
+                                          meta->last_modified.len);
+        return since != -1 && modified != -1 && modified <= since;
+    }
+
+    return 0;
+}
 
-    //cache_object size finds the total size of the data
-    //by summing the total number of bytes received from
-    //every read.
-    char cache_object[MAX_OBJECT_SIZE];
-    int cache_object_size = 0;
+/*
+* Sends a 304 carrying the validators of a cached object.
+*/
+void send_not_modified(int fd, http_meta *meta, time_t stored)
+{
+    msg m;
+
+    msg_init(&m);
+    msg_add_str(&m, "HTTP/1.0 304 Not Modified\r\n");
+    if (meta->etag.len > 0)
+        msg_add_header(&m, "ETag", 4, meta->etag.p, meta->etag.len);
+    if (meta->last_modified.len > 0)
+        msg_add_header(&m, "Last-Modified", 13, meta->last_modified.p,
+                       meta->last_modified.len);
+    msg_printf(&m, "Age: %ld\r\n\r\n", (long)(time(NULL) - stored));
+    msg_send(&m, fd);
+}
 
-    dbg_printf("Entering reading loop\n");
-    do
+/*
+* Only complete (200) responses that don't vary go to the large
+* object store.
+*/
+int large_cacheable(char *headers, size_t len)
+{
+    size_t vlen;
+
+    return len > 12 && !strncmp(headers, "HTTP/1.", 7) &&
+           !strncmp(headers + 8, " 200", 4) &&
+           http_find_header(headers, len, "Vary", &vlen) == NULL;
+}
+
+/*
+* Relays the rest of a large object's body from net_fd to the client,
+* storing it in obj (unless obj is NULL) one chunk at a time, starting
+* with chunk number index. The len bytes at data are the start of that
+* chunk, already read and sent. The body is read straight into the
+* buffers that become the stored chunks. If the client goes away, the
+* rest is only read to be stored, as state allows. What is relayed
+* counts against the bandwidth of client.
+*/
+void relay_large(int fd, int net_fd, large_object *obj, unsigned int index,
+                 char *data, unsigned int len, fill_state *state, int client)
+{
+    char *chunk = Malloc(LARGE_CHUNK_SIZE);
+    unsigned int fill = 0;
+    unsigned long stored = (unsigned long)index * LARGE_CHUNK_SIZE;
+    int n;
+
+    while (1)
     {
-        strcpy(reply, "");
+        if (len > 0)
+        {
+            //first the bytes that came with the headers
+            n = len < LARGE_CHUNK_SIZE - fill ? len : LARGE_CHUNK_SIZE - fill;
+            memcpy(chunk + fill, data, n);
+            data += n;
+            len -= n;
+        }
+        else
+        {
+            n = read(net_fd, chunk + fill, LARGE_CHUNK_SIZE - fill);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            if (state->gone && !fill_goes_on(state, obj != NULL, n))
+                break;
+            if (!state->gone && rio_writen(fd, chunk + fill, n) < 0 &&
+                !client_gone(state, net_fd, obj != NULL,
+                             obj ? obj->length - stored - fill - n : -1))
+                break;
+            if (!state->gone)
+                limit_sent(client, n);
+        }
 
-        dbg_printf("Read \n");
-        read_return = Rio_readnb(&rio, reply, MAXBUF);
+        fill += n;
+        if (fill == LARGE_CHUNK_SIZE)
+        {
+            if (obj != NULL)
+            {
+                large_store(obj, index++, chunk, fill);
+                chunk = Malloc(LARGE_CHUNK_SIZE);
+            }
+            stored += fill;
+            fill = 0;
+        }
+    }
 
-        dbg_printf("Read return: %d\n", read_return);
-	    dbg_printf("Object size: %d\n", cache_object_size);
+    //a short chunk is only kept if it is the last one of the body
+    if (obj != NULL && fill > 0 && stored + fill == obj->length)
+        large_store(obj, index, chunk, fill);
+    else
+        free(chunk);
 
-        //Add the bytes returned from the read to the total object size
-	    cache_object_size += read_return;
+    if (state->gone && obj != NULL && stored + fill == obj->length)
+    {
+        dbg_printf("Large fetch finished for the store after its client left\n");
+        pthread_mutex_lock(&fill_lock);
+        fills_finished++;
+        pthread_mutex_unlock(&fill_lock);
+    }
+}
 
-        //As long as our object size is within the max, continue to add data
-        //to the cache_object so that we can add it to the cache later.
-        if ( cache_object_size < MAX_OBJECT_SIZE )
+/*
+* Writes a large object back to the client: its headers and the chunks
+* that are cached, in one gather write. If those don't cover the whole
+* body, the rest is fetched from the origin with request. HEAD,
+* conditional and Range requests are answered from the metadata as for
+* the main cache, as long as the ranges are within the cached chunks.
+* Returns 0, or -1 if the request is better sent to the origin.
+* client is the slot of the client in the limits.
+*/
+int send_large(int fd, large_object *obj, http_request *req, char *host,
+               int port, const msg *request, int client)
+{
+    large_chunk *chunks[MAX_LARGE_OBJECT_SIZE / LARGE_CHUNK_SIZE + 1];
+    chain_seg segs[MAX_LARGE_OBJECT_SIZE / LARGE_CHUNK_SIZE + 1];
+    http_range ranges[HTTP_MAX_RANGES];
+    unsigned long sent = 0;
+    unsigned int i, n;
+    msg m;
+
+    if (not_modified(req, &obj->meta))
+    {
+        send_not_modified(fd, &obj->meta, obj->stored);
+        return 0;
+    }
+
+    int nranges = range_request(req, &obj->meta, obj->length, ranges);
+
+    msg_init(&m);
+    msg_add(&m, obj->headers, obj->meta.head_end);
+    msg_printf(&m, "Age: %ld\r\n\r\n", (long)(time(NULL) - obj->stored));
+    if (http_slice_is(&req->method, "HEAD") || nranges == 0)
+    {
+        if (nranges == 0)
+            send_ranges(fd, obj->headers, &obj->meta, obj->stored, NULL,
+                        obj->length, ranges, 0);
+        else
+            msg_send(&m, fd);
+        return 0;
+    }
+
+    //the chunks are held until they have been written
+    for (n = 0; n < sizeof(chunks) / sizeof(chunks[0]) &&
+                (chunks[n] = large_get_chunk(obj, n)) != NULL; n++)
+    {
+        msg_add(&m, chunks[n]->data, chunks[n]->len);
+        sent += chunks[n]->len;
+    }
+
+    if (nranges > 0)
+    {
+        //serve the ranges if the cached prefix holds all of them
+        int covered = 1;
+        for (i = 0; i < nranges; i++)
+            covered = covered && ranges[i].last < sent;
+
+        if (covered)
         {
- 	        dbg_printf("Cache . . . \n");
-            sprintf(cache_object, "%s%s", cache_object, reply);
+            chain view;
+            chain_init(&view);
+            for (i = 0; i < n; i++)
+            {
+                segs[i].data = chunks[i]->data;
+                segs[i].off = 0;
+                segs[i].len = segs[i].cap = chunks[i]->len;
+                segs[i].next = i + 1 < n ? &segs[i + 1] : NULL;
+            }
+            view.head = n > 0 ? &segs[0] : NULL;
+            view.tail = n > 0 ? &segs[n - 1] : NULL;
+            view.len = sent;
+            send_ranges(fd, obj->headers, &obj->meta, obj->stored, &view,
+                        obj->length, ranges, nranges);
         }
 
-	dbg_printf("Write . . . \n");
-    //Write the data back to the client
-    rio_writen(fd, reply, read_return);
+        for (i = 0; i < n; i++)
+            large_put_chunk(chunks[i]);
+        return covered ? 0 : -1;
+    }
+
+    int ok = msg_send(&m, fd) == 0;
+    for (i = 0; i < n; i++)
+        large_put_chunk(chunks[i]);
+
+    if (ok && sent < obj->length)
+    {
+        dbg_printf("Sent %lu cached bytes of %lu, fetching the rest\n",
+                   sent, obj->length);
+        fetch_large_rest(fd, obj, host, port, request, sent, client);
+    }
+    return 0;
+}
 
-	dbg_printf("Loop\n\n");
-    } while ( read_return > 0);
+/*
+* Fetches the body of a large object from offset on, with request
+* (the upstream request of the client, without the blank line ending
+* its headers) plus a Range header, and relays
+* it to the client. An origin ignoring the range sends the whole body
+* again, and the bytes before offset are dropped. Unless somebody else
+* is already doing it, the chunks fetched are added to obj. The fetch
+* waits for the turn of client like any other, and the relay keeps to
+* its bandwidth.
+*/
+void fetch_large_rest(int fd, large_object *obj, char *host, int port,
+                      const msg *request, unsigned long offset, int client)
+{
+    //the copy shares the pieces of request and adds its own
+    msg m = *request;
+    int net_fd;
 
+    msg_printf(&m, "Range: bytes=%lu-\r\n\r\n", offset);
+    if (limit_fetch_begin(client) < 0)
+        return;
+    if ((net_fd = upstream_connect(host, port)) < 0)
+    {
+        limit_fetch_end(client);
+        return;
+    }
+    timeout_send(net_fd, TIMEOUT_PHASE_IDLE);
+    timeout_recv(net_fd, TIMEOUT_PHASE_TTFB);
 
-    if (cache_object_size < MAX_OBJECT_SIZE)
+    if (msg_send(&m, net_fd) < 0)
     {
-        dbg_printf("\nAdding to cache . . . \n");
-        addToCache(cache, cache_object, url, cache_object_size);
-        dbg_printf("Done!\n");
+        Close(net_fd);
+        limit_fetch_end(client);
+        return;
     }
 
-    return;
+    //Read the response headers, which must fit in one segment
+    chain head;
+    chain_init(&head);
+    size_t header_bytes = 0;
+    char *at;
+    while (header_bytes == 0 && head.len < CHAIN_SEG_SIZE &&
+           chain_read(net_fd, &head, CHAIN_SEG_SIZE, &at) > 0)
+        header_bytes = http_header_end(head.head->data, head.len);
+
+    char *resp = head.head ? head.head->data : NULL;
+    unsigned long skip = 0;
+    size_t vlen;
+    const char *range = NULL;
+    //the rest is relayed as it comes, which takes a body that isn't chunked
+    if (header_bytes > 0 &&
+        http_find_header(resp, header_bytes, "Transfer-Encoding", &vlen) != NULL)
+        header_bytes = 0;
+    if (header_bytes > 0)
+        range = http_find_header(resp, header_bytes, "Content-Range", &vlen);
+
+    if (header_bytes > 0 && !strncmp(resp + 8, " 206", 4) && range != NULL &&
+        !strncmp(range, "bytes ", 6) && strtoul(range + 6, NULL, 10) == offset)
+        skip = 0;
+    else if (header_bytes > 0 && !strncmp(resp + 8, " 200", 4))
+        skip = offset;
+    else
+    {
+        dbg_printf("Origin did not answer the range request\n");
+        chain_free(&head);
+        Close(net_fd);
+        limit_fetch_end(client);
+        return;
+    }
+
+    timeout_recv(net_fd, TIMEOUT_PHASE_IDLE);
+    char *data = resp + header_bytes;
+    unsigned int n = head.len - header_bytes;
+    int r, failed = 0;
+    while (skip > 0 && skip >= n)
+    {
+        skip -= n;
+        data = resp;
+        if ((r = read(net_fd, resp, head.head->cap)) <= 0)
+        {
+            failed = 1;
+            break;
+        }
+        n = r;
+    }
+
+    if (!failed)
+    {
+        data += skip;
+        n -= skip;
+        fill_state state = { 0, 0, 0 };
+        rio_writen(fd, data, n);
+        limit_sent(client, n);
+
+        int filling = large_begin_fill(obj, offset);
+        relay_large(fd, net_fd, filling ? obj : NULL,
+                    offset / LARGE_CHUNK_SIZE, data, n, &state, client);
+        if (filling)
+            large_end_fill(obj);
+    }
+
+    chain_free(&head);
+    Close(net_fd);
+    limit_fetch_end(client);
 }
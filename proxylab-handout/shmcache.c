@@ -0,0 +1,482 @@
+/*
+* The cache shared by worker processes. See shmcache.h.
+*/
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "shmcache.h"
+#include "csapp.h"
+#include "cache.h"
+
+
+#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+int shm_cache_mb = SHM_CACHE_MB;
+
+/* An entry, at the start of its chunk and followed by its key and
+   data. next chains it in its bucket or, once free, in the free list
+   of its class; newer and older link it in the LRU list of its class */
+typedef struct shm_entry{
+  size_t next;
+  size_t newer;
+  size_t older;
+  unsigned long hash;
+  unsigned int key_len;
+  unsigned int data_len;
+  int cls;
+} shm_entry;
+
+/* The start of the segment, followed by how many chunks of each page
+   are taken. writing is set while the index is being changed, for
+   whoever finds its owner dead to know whether to trust it. Pages
+   start at pages; those from top on were never in a class, and those
+   on free_pages were given back by theirs. All links are offsets from
+   the start of the segment, 0 for none */
+typedef struct shm_header{
+  pthread_mutex_t lock;
+  int writing;
+  size_t size;
+  size_t pages;
+  size_t top;
+  size_t free_pages;
+  size_t buckets[SHM_BUCKETS];
+  size_t free[SHM_CLASSES];
+  size_t newest[SHM_CLASSES];
+  size_t oldest[SHM_CLASSES];
+  unsigned long class_pages[SHM_CLASSES];
+  unsigned long entries;
+  unsigned long bytes;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long stores;
+  unsigned long evictions;
+  unsigned long refused;
+  unsigned long reclaimed;
+  unsigned long recoveries;
+} shm_header;
+
+/* The segment, NULL unless workers share it */
+static shm_header* seg = NULL;
+
+#define AT(off) ((shm_entry*)((char*)seg + (off)))
+
+/* The chunks taken on the page holding off */
+#define TAKEN(off) (((unsigned int*)(seg + 1))[((off) - seg->pages) / SHM_PAGE])
+
+
+/* reset:
+*   Empties the shared cache, handing all pages back. Called with the
+*   lock held.
+*/
+static void reset()
+{
+    memset(seg->buckets, 0, sizeof(seg->buckets));
+    memset(seg->free, 0, sizeof(seg->free));
+    memset(seg->newest, 0, sizeof(seg->newest));
+    memset(seg->oldest, 0, sizeof(seg->oldest));
+    memset(seg->class_pages, 0, sizeof(seg->class_pages));
+    memset(seg + 1, 0, (seg->size - seg->pages) / SHM_PAGE *
+                       sizeof(unsigned int));
+    seg->top = seg->pages;
+    seg->free_pages = 0;
+    seg->entries = 0;
+    seg->bytes = 0;
+    seg->writing = 0;
+}
+
+/* shm_cache_open:
+*   Maps a new segment of shm_cache_mb megabytes, to be shared with the
+*   processes forked from now on. Returns 0, or -1 on error.
+*/
+int shm_cache_open()
+{
+    pthread_mutexattr_t attr;
+    char name[64];
+    size_t size = (size_t)shm_cache_mb * 1024 * 1024;
+    size_t pages = sizeof(shm_header) + size / SHM_PAGE * sizeof(unsigned int);
+    pages = (pages + 63) & ~(size_t)63;
+    int fd;
+
+    if(size < pages + SHM_PAGE)
+        return -1;
+
+    //the name is only needed until the segment is mapped
+    snprintf(name, sizeof(name), "/proxy-cache-%d", (int)getpid());
+    if((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+        return -1;
+    shm_unlink(name);
+    if(ftruncate(fd, size) < 0 ||
+       (seg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   0)) == MAP_FAILED)
+    {
+        seg = NULL;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&seg->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    seg->size = size;
+    seg->pages = pages;
+    reset();
+    dbg_printf("Shared cache: %zu bytes at %p\n", size, (void*)seg);
+    return 0;
+}
+
+/* lock:
+*   Takes the lock of the segment, recovering it from a worker that
+*   died holding it. Returns 0, or -1 if it can't be had.
+*/
+static int lock()
+{
+    int rc = pthread_mutex_lock(&seg->lock);
+
+    if(rc == EOWNERDEAD)
+    {
+        seg->recoveries++;
+        if(seg->writing)
+        {
+            dbg_printf("Shared cache: a worker died changing it, emptied\n");
+            reset();
+        }
+        pthread_mutex_consistent(&seg->lock);
+        rc = 0;
+    }
+    return rc == 0 ? 0 : -1;
+}
+
+static void unlock()
+{
+    pthread_mutex_unlock(&seg->lock);
+}
+
+/* find:
+*   Returns the entry for the key_len bytes of key with hash, 0 if
+*   there is none, and sets link to where the offset of the entry is
+*   kept. Called with the lock held.
+*/
+static size_t find(const char* key, unsigned int key_len, unsigned long hash,
+                   size_t** link)
+{
+    size_t* at = &seg->buckets[hash % SHM_BUCKETS];
+
+    while(*at != 0)
+    {
+        shm_entry* e = AT(*at);
+        if(e->hash == hash && e->key_len == key_len &&
+           !memcmp((char*)(e + 1), key, key_len))
+            break;
+        at = &e->next;
+    }
+    *link = at;
+    return *at;
+}
+
+/* lru_unlink:
+*   Takes the entry at off off the LRU list of its class. Called with
+*   the lock held.
+*/
+static void lru_unlink(size_t off)
+{
+    shm_entry* e = AT(off);
+
+    if(e->newer != 0)
+        AT(e->newer)->older = e->older;
+    else
+        seg->newest[e->cls] = e->older;
+    if(e->older != 0)
+        AT(e->older)->newer = e->newer;
+    else
+        seg->oldest[e->cls] = e->newer;
+}
+
+/* lru_push:
+*   Makes the entry at off the most recently used of its class. Called
+*   with the lock held.
+*/
+static void lru_push(size_t off)
+{
+    shm_entry* e = AT(off);
+
+    e->newer = 0;
+    e->older = seg->newest[e->cls];
+    if(e->older != 0)
+        AT(e->older)->newer = off;
+    else
+        seg->oldest[e->cls] = off;
+    seg->newest[e->cls] = off;
+}
+
+/* free_page:
+*   Gives page, all of whose chunks of cls are free, back to the arena
+*   for any class to take. Called with the lock held.
+*/
+static void free_page(size_t page, int cls)
+{
+    size_t* at = &seg->free[cls];
+
+    while(*at != 0)
+    {
+        if(*at >= page && *at < page + SHM_PAGE)
+            *at = AT(*at)->next;
+        else
+            at = &AT(*at)->next;
+    }
+    AT(page)->next = seg->free_pages;
+    seg->free_pages = page;
+    seg->class_pages[cls]--;
+    seg->reclaimed++;
+}
+
+/* drop:
+*   Takes the entry at off, whose offset is kept at link, out of the
+*   index and frees its chunk, and its page if nothing is left on it.
+*   Called with the lock held.
+*/
+static void drop(size_t off, size_t* link)
+{
+    shm_entry* e = AT(off);
+
+    *link = e->next;
+    lru_unlink(off);
+    seg->entries--;
+    seg->bytes -= e->data_len;
+    e->next = seg->free[e->cls];
+    seg->free[e->cls] = off;
+    if(--TAKEN(off) == 0)
+        free_page(off - (off - seg->pages) % SHM_PAGE, e->cls);
+}
+
+/* add_page:
+*   Cuts a page given back by its class or, if there is none, one never
+*   used into chunks of cls, free. Returns 0, or -1 if the arena has no
+*   page left. Called with the lock held.
+*/
+static int add_page(int cls)
+{
+    size_t chunk = (size_t)SHM_MIN_CHUNK << cls;
+    size_t page, off;
+
+    if((page = seg->free_pages) != 0)
+        seg->free_pages = AT(page)->next;
+    else if(seg->top + SHM_PAGE <= seg->size)
+    {
+        page = seg->top;
+        seg->top += SHM_PAGE;
+    }
+    else
+        return -1;
+
+    for(off = page; off + chunk <= page + SHM_PAGE; off += chunk)
+    {
+        AT(off)->cls = cls;
+        AT(off)->next = seg->free[cls];
+        seg->free[cls] = off;
+    }
+    seg->class_pages[cls]++;
+    return 0;
+}
+
+/* take_chunk:
+*   Returns a free chunk of cls, from a new page if there are none and
+*   else from the least recently used entry of cls, or 0 if cls has
+*   neither. Called with the lock held.
+*/
+static size_t take_chunk(int cls)
+{
+    size_t off;
+
+    if(seg->free[cls] == 0)
+        add_page(cls);
+    if(seg->free[cls] == 0 && seg->oldest[cls] != 0)
+    {
+        shm_entry* victim = AT(seg->oldest[cls]);
+        size_t* link;
+        find((char*)(victim + 1), victim->key_len, victim->hash, &link);
+        drop(seg->oldest[cls], link);
+        seg->evictions++;
+        //the victim's page may have gone back with it
+        if(seg->free[cls] == 0)
+            add_page(cls);
+    }
+
+    if((off = seg->free[cls]) != 0)
+    {
+        seg->free[cls] = AT(off)->next;
+        TAKEN(off)++;
+    }
+    return off;
+}
+
+/* put:
+*   Stores the len bytes at data under url, replacing what was there.
+*/
+static void put(char* url, const char* data, size_t len)
+{
+    unsigned int key_len = strlen(url);
+    unsigned long hash = cache_hash(CACHE_HASH_INIT, url, key_len);
+    size_t need = sizeof(shm_entry) + key_len + len;
+    size_t off, *link;
+    int cls = 0;
+
+    while(cls < SHM_CLASSES && ((size_t)SHM_MIN_CHUNK << cls) < need)
+        cls++;
+
+    if(lock() < 0)
+        return;
+    seg->writing = 1;
+    if((off = find(url, key_len, hash, &link)) != 0)
+        drop(off, link);
+    if(cls == SHM_CLASSES || (off = take_chunk(cls)) == 0)
+    {
+        seg->refused++;
+        seg->writing = 0;
+        unlock();
+        return;
+    }
+
+    shm_entry* e = AT(off);
+    e->hash = hash;
+    e->key_len = key_len;
+    e->data_len = len;
+    e->cls = cls;
+    memcpy((char*)(e + 1), url, key_len);
+    memcpy((char*)(e + 1) + key_len, data, len);
+    e->next = seg->buckets[hash % SHM_BUCKETS];
+    seg->buckets[hash % SHM_BUCKETS] = off;
+    lru_push(off);
+    seg->entries++;
+    seg->bytes += len;
+    seg->stores++;
+    seg->writing = 0;
+    unlock();
+}
+
+/* get:
+*   Returns a freshly allocated copy of what is stored under url, and
+*   sets len to its size, or returns NULL if there is nothing or not
+*   the variant the upstream request req selects. Counts the lookup as
+*   a hit or a miss.
+*/
+static char* get(char* url, const msg* req, size_t* len)
+{
+    unsigned int key_len = strlen(url);
+    unsigned long hash = cache_hash(CACHE_HASH_INIT, url, key_len);
+    size_t off, *link;
+    char* copy = NULL;
+
+    if(lock() < 0)
+        return NULL;
+    //another variant is no use here, and would only push ours out
+    if((off = find(url, key_len, hash, &link)) != 0 &&
+       cache_matches((char*)(AT(off) + 1) + key_len, AT(off)->data_len, req) &&
+       (copy = malloc(AT(off)->data_len)) != NULL)
+    {
+        shm_entry* e = AT(off);
+        *len = e->data_len;
+        memcpy(copy, (char*)(e + 1) + key_len, e->data_len);
+        seg->writing = 1;
+        lru_unlink(off);
+        lru_push(off);
+        seg->writing = 0;
+        seg->hits++;
+    }
+    else
+        seg->misses++;
+    unlock();
+    return copy;
+}
+
+/* shm_cache_load:
+*   Adds what the shared cache holds for url to cache, if it is the
+*   variant the upstream request req selects. Returns 1 if something
+*   was added, 0 otherwise.
+*/
+int shm_cache_load(struct cache_LL* cache, char* url, const msg* req)
+{
+    size_t len;
+    char* packed;
+    int added = 0;
+
+    if(seg == NULL)
+        return 0;
+    if((packed = get(url, req, &len)) == NULL)
+        return 0;
+    added = cache_import(cache, packed, len) > 0;
+    free(packed);
+    return added;
+}
+
+/* shm_cache_store:
+*   Copies the object cache just stored for url, as requested by req,
+*   to the shared cache.
+*/
+void shm_cache_store(struct cache_LL* cache, char* url, const msg* req)
+{
+    web_object* obj;
+    size_t len;
+    char* packed;
+
+    if(seg == NULL || (obj = checkCache(cache, url, req)) == NULL)
+        return;
+    packed = cache_pack(cache, obj, &len);
+    releaseObject(cache, obj);
+    put(url, packed, len);
+    free(packed);
+}
+
+/* shm_cache_remove:
+*   Drops what the shared cache holds for url.
+*/
+void shm_cache_remove(char* url)
+{
+    unsigned int key_len;
+    size_t off, *link;
+
+    if(seg == NULL)
+        return;
+    key_len = strlen(url);
+    if(lock() < 0)
+        return;
+    seg->writing = 1;
+    if((off = find(url, key_len, cache_hash(CACHE_HASH_INIT, url, key_len),
+                   &link)) != 0)
+        drop(off, link);
+    seg->writing = 0;
+    unlock();
+}
+
+/* printShmCacheStats:
+*   Writes the use of the shared cache, over all workers, to out. Like
+*   the other printers it reads the counters without the lock.
+*/
+void printShmCacheStats(FILE* out)
+{
+    unsigned long used = 0;
+    int cls;
+
+    if(seg == NULL)
+    {
+        fprintf(out, "Shared cache: off\n");
+        return;
+    }
+    for(cls = 0; cls < SHM_CLASSES; cls++)
+        used += seg->class_pages[cls];
+    fprintf(out, "Shared cache: %lu objects, %lu KB in %lu of %lu pages, "
+            "%lu hits, %lu misses, %lu stored, %lu evicted, %lu refused, "
+            "%lu pages reclaimed, %lu lock recoveries\n", seg->entries,
+            seg->bytes / 1024, used,
+            (unsigned long)((seg->size - seg->pages) / SHM_PAGE), seg->hits,
+            seg->misses, seg->stores, seg->evictions, seg->refused,
+            seg->reclaimed, seg->recoveries);
+}
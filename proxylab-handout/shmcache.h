@@ -0,0 +1,50 @@
+/* The cache shared by worker processes (see worker.h). It lives in a
+   POSIX shared memory segment mapped before the workers are forked,
+   so that it outlives any one of them, and it holds no pointers, only
+   offsets from the start of the segment: a hash index of chains of
+   entries, one LRU list per size class and a slab arena. The arena is
+   handed out a SHM_PAGE at a time to size classes of powers of two
+   from SHM_MIN_CHUNK bytes, each page cut into chunks of its class;
+   an entry takes the smallest chunk it fits in, a free one, one of a
+   new page or else that of the least recently used entry of its
+   class. A page goes back to the arena, for any class, once nothing
+   is left on it; one that still holds a single entry stays with its
+   class, so when the objects change size an arena full of pages of
+   the old sizes only gives them up as those empty out. An entry is a URL and the object cached for it, packed by
+   cache_pack, so a worker that misses in its own cache looks here and
+   takes what it finds into its own (the last variant stored, for
+   objects with Vary). A robust process-shared mutex guards the
+   segment: when a worker dies holding it, the next one to lock it
+   goes on, unless the dead one was in the middle of a change, in
+   which case the shared cache is emptied rather than trusted */
+
+#ifndef __SHMCACHE_H__
+#define __SHMCACHE_H__
+
+#include <stdio.h>
+#include "msg.h"
+
+/* Megabytes of the segment by default */
+#define SHM_CACHE_MB 16
+
+/* Chains of the hash index */
+#define SHM_BUCKETS 4096
+
+/* Bytes of the pages of the arena, and of the chunks of the smallest
+   size class; the largest class takes whole pages */
+#define SHM_PAGE (256 * 1024)
+#define SHM_MIN_CHUNK 256
+#define SHM_CLASSES 11
+
+/* Megabytes of the segment */
+extern int shm_cache_mb;
+
+struct cache_LL;
+
+int shm_cache_open();
+int shm_cache_load(struct cache_LL* cache, char* url, const msg* req);
+void shm_cache_store(struct cache_LL* cache, char* url, const msg* req);
+void shm_cache_remove(char* url);
+void printShmCacheStats(FILE* out);
+
+#endif /* __SHMCACHE_H__ */
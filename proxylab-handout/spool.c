@@ -0,0 +1,270 @@
+/*
+* Buffered relay to slow clients. See spool.h.
+*/
+#include <poll.h>
+#include "spool.h"
+#include "timeout.h"
+#include "csapp.h"
+
+
+#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+unsigned int spool_memory = 0;
+
+/* Counters reported by printSpoolStats */
+static unsigned long spools_opened = 0;
+static unsigned long spools_active = 0;
+static unsigned long spools_failed = 0;
+static unsigned long spool_files = 0;
+static unsigned long spool_bytes = 0;
+static unsigned long spool_spilled = 0;
+
+static pthread_mutex_t spool_lock;
+
+void spool_init()
+{
+    pthread_mutex_init(&spool_lock, 0);
+}
+
+
+/* spill:
+*   Appends n bytes to the temporary file, making it first if need
+*   be. Returns 0, or -1 on error.
+*/
+static int spill(spool* sp, const char* buf, size_t n)
+{
+    if(sp->file < 0)
+    {
+        char name[] = SPOOL_DIR "/proxy-spool-XXXXXX";
+        if((sp->file = mkstemp(name)) < 0)
+            return -1;
+        unlink(name);
+
+        pthread_mutex_lock(&spool_lock);
+        spool_files++;
+        pthread_mutex_unlock(&spool_lock);
+    }
+
+    while(n > 0)
+    {
+        ssize_t w = pwrite(sp->file, buf, n, sp->file_len);
+        if(w < 0 && errno == EINTR)
+            continue;
+        if(w <= 0)
+            return -1;
+        buf += w;
+        n -= w;
+        sp->file_len += w;
+        sp->spilled += w;
+    }
+    return 0;
+}
+
+/* fill:
+*   Takes what the relay wrote: into memory while it has room and the
+*   file is not in use, into the file otherwise. Returns the bytes
+*   taken, 0 once the relay is done, or -1 on error.
+*/
+static int fill(spool* sp)
+{
+    char buf[SPOOL_IO_SIZE];
+    char* at;
+    int n;
+
+    if(sp->file_len == sp->file_off && sp->mem.len < spool_memory)
+        return chain_read(sp->in, &sp->mem, CHAIN_SEG_SIZE, &at);
+
+    while((n = read(sp->in, buf, sizeof(buf))) < 0)
+    {
+        if(errno != EINTR)
+            return -1;
+    }
+    if(n > 0 && spill(sp, buf, n) < 0)
+        return -1;
+    return n;
+}
+
+/* drain:
+*   Gives the client what it takes of the oldest bytes held, those in
+*   memory before those in the file. Returns 0, or -1 if the client
+*   is gone.
+*/
+static int drain(spool* sp)
+{
+    char buf[SPOOL_IO_SIZE];
+    ssize_t n;
+
+    if(sp->mem.len > 0)
+    {
+        n = write(sp->client, sp->mem.head->data + sp->mem.head->off,
+                  sp->mem.head->len);
+        if(n < 0)
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        chain_consume(&sp->mem, n);
+        if(sp->mem.len == 0)
+            chain_reset(&sp->mem);
+        sp->bytes += n;
+        return 0;
+    }
+
+    n = sp->file_len - sp->file_off;
+    if(n > sizeof(buf))
+        n = sizeof(buf);
+    if((n = pread(sp->file, buf, n, sp->file_off)) <= 0)
+        return -1;
+    if((n = write(sp->client, buf, n)) < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    sp->file_off += n;
+    sp->bytes += n;
+
+    //a drained file is reused from its start
+    if(sp->file_off == sp->file_len)
+    {
+        sp->file_off = sp->file_len = 0;
+        if(ftruncate(sp->file, 0) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* spool_thread:
+*   Moves bytes from the relay to the client until the relay is done
+*   and the client has them all, or the client fails or takes nothing
+*   for the idle timeout. Closing in then makes further writes of the
+*   relay fail rather than block.
+*/
+static void *spool_thread(void *arg)
+{
+    spool* sp = arg;
+    struct pollfd fds[2];
+    int eof = 0;
+
+    while(!eof || sp->mem.len > 0 || sp->file_len > sp->file_off)
+    {
+        int held = sp->mem.len > 0 || sp->file_len > sp->file_off;
+
+        fds[0].fd = !eof && sp->file_len - sp->file_off < SPOOL_FILE_MAX ?
+                    sp->in : -1;
+        fds[0].events = POLLIN;
+        fds[1].fd = held ? sp->client : -1;
+        fds[1].events = POLLOUT;
+
+        //a client that takes nothing for the idle timeout is given up
+        //on; waiting on the origin is the relay's business
+        int idle = held ? timeout_secs[TIMEOUT_PHASE_IDLE] : 0;
+        int ready = poll(fds, 2, idle ? idle * 1000 : -1);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready == 0)
+            timeout_hit(TIMEOUT_PHASE_IDLE);
+        if(ready <= 0)
+        {
+            sp->failed = 1;
+            break;
+        }
+
+        if(fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            int n = fill(sp);
+            if(n <= 0)
+                eof = 1;
+            if(n < 0)
+                sp->failed = 1;
+        }
+        if(fds[1].revents & (POLLOUT | POLLHUP | POLLERR) && drain(sp) < 0)
+        {
+            sp->failed = 1;
+            break;
+        }
+    }
+
+    close(sp->in);
+    return NULL;
+}
+
+/* spool_open:
+*   Puts a spool in front of client_fd. The relay writes to sp->fd
+*   from then on, until spool_close. Returns 0, or -1 if the spool
+*   couldn't be set up, in which case the relay writes to the client
+*   itself.
+*/
+int spool_open(spool* sp, int client_fd)
+{
+    int sv[2];
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return -1;
+
+    sp->fd = sv[0];
+    sp->in = sv[1];
+    sp->client = client_fd;
+    chain_init(&sp->mem);
+    sp->file = -1;
+    sp->file_off = 0;
+    sp->file_len = 0;
+    sp->bytes = 0;
+    sp->spilled = 0;
+    sp->failed = 0;
+
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    if(pthread_create(&sp->tid, NULL, spool_thread, sp) != 0)
+    {
+        fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) & ~O_NONBLOCK);
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    pthread_mutex_lock(&spool_lock);
+    spools_opened++;
+    spools_active++;
+    pthread_mutex_unlock(&spool_lock);
+    return 0;
+}
+
+/* spool_close:
+*   Ends the response and waits until the client has all of it, or
+*   the spool gave up on the client. Returns 0 if it was all
+*   delivered, -1 otherwise.
+*/
+int spool_close(spool* sp)
+{
+    Close(sp->fd);
+    Pthread_join(sp->tid, NULL);
+
+    fcntl(sp->client, F_SETFL, fcntl(sp->client, F_GETFL) & ~O_NONBLOCK);
+    chain_free(&sp->mem);
+    if(sp->file >= 0)
+        close(sp->file);
+
+    if(sp->spilled > 0)
+        dbg_printf("Spooled %lu bytes, %lu through a file\n", sp->bytes,
+                   sp->spilled);
+
+    pthread_mutex_lock(&spool_lock);
+    spools_active--;
+    if(sp->failed)
+        spools_failed++;
+    spool_bytes += sp->bytes;
+    spool_spilled += sp->spilled;
+    pthread_mutex_unlock(&spool_lock);
+
+    return sp->failed ? -1 : 0;
+}
+
+/* printSpoolStats:
+*   Writes the buffered relay's counters to out, read without locking.
+*/
+void printSpoolStats(FILE* out)
+{
+    fprintf(out, "Buffered relay: %s, %lu responses (%lu active, %lu failed), "
+            "%lu bytes relayed, %lu spilled to %lu files\n",
+            spool_memory > 0 ? "on" : "off", spools_opened, spools_active,
+            spools_failed, spool_bytes, spool_spilled, spool_files);
+}
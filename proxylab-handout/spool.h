@@ -0,0 +1,59 @@
+/* Buffered relay of responses to slow clients. Instead of writing to
+   the client, the relay writes to one end of a socketpair; a thread
+   of the spool takes what arrives there at once, keeps it in memory
+   up to spool_memory bytes and in an unlinked temporary file past
+   that, and feeds it to the client as fast as the client takes it.
+   The origin is read at its own pace and its connection closed as
+   soon as the response is in, however slow the client. What a spool
+   holds is bounded: once its file reaches SPOOL_FILE_MAX the spool
+   stops taking more, and the relay waits on the client as it would
+   without one */
+
+#ifndef __SPOOL_H__
+#define __SPOOL_H__
+
+#include <stdio.h>
+#include <pthread.h>
+#include "chain.h"
+
+/* Bytes of a response kept in memory by default (-b) before the rest
+   goes to the temporary file */
+#define SPOOL_MEMORY (256 * 1024)
+
+/* Most bytes waiting in the temporary file */
+#define SPOOL_FILE_MAX (64 * 1024 * 1024)
+
+/* Where the temporary files are made */
+#define SPOOL_DIR "/tmp"
+
+/* Most bytes moved by one read or write of the file */
+#define SPOOL_IO_SIZE 65536
+
+/* A spool between a relay and its client. The relay writes to fd;
+   the thread reads it from in and holds what the client hasn't taken
+   yet in mem, then in file (from file_off to file_len) once mem is
+   full or the file is already in use, which keeps the bytes in
+   order. file is -1 until it is needed */
+typedef struct spool{
+  int fd;
+  int in;
+  int client;
+  pthread_t tid;
+  chain mem;
+  int file;
+  off_t file_off;
+  off_t file_len;
+  unsigned long bytes;
+  unsigned long spilled;
+  int failed;
+} spool;
+
+/* Bytes kept in memory per response, 0 when buffering is off */
+extern unsigned int spool_memory;
+
+void spool_init();
+int spool_open(spool* sp, int client_fd);
+int spool_close(spool* sp);
+void printSpoolStats(FILE* out);
+
+#endif /* __SPOOL_H__ */
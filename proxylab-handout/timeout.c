@@ -0,0 +1,161 @@
+/*
+* Per-phase timeouts. See timeout.h.
+*/
+#include "timeout.h"
+#include "csapp.h"
+
+
+#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+int timeout_secs[TIMEOUT_PHASES] = {
+    TIMEOUT_HEADER, TIMEOUT_CONNECT, TIMEOUT_TTFB, TIMEOUT_IDLE
+};
+
+static const char* phase_names[TIMEOUT_PHASES] = {
+    "header", "connect", "ttfb", "idle"
+};
+
+/* Counters reported by printTimeoutStats, one per phase */
+static unsigned long timeouts[TIMEOUT_PHASES];
+
+static pthread_mutex_t timeout_lock;
+
+void timeout_init()
+{
+    pthread_mutex_init(&timeout_lock, 0);
+}
+
+/* timeout_parse:
+*   Sets the timeouts from "header,connect,ttfb,idle" in seconds;
+*   phases left out at the end keep theirs. Returns 0, or -1 if spec
+*   is malformed.
+*/
+int timeout_parse(const char* spec)
+{
+    int secs[TIMEOUT_PHASES];
+    int i = 0;
+    char* end;
+
+    while(i < TIMEOUT_PHASES)
+    {
+        long v = strtol(spec, &end, 10);
+        if(end == spec || v < 0 || v > 86400)
+            return -1;
+        secs[i++] = v;
+        if(*end == '\0')
+            break;
+        if(*end != ',')
+            return -1;
+        spec = end + 1;
+    }
+    if(*end != '\0')
+        return -1;
+
+    memcpy(timeout_secs, secs, i * sizeof(int));
+    return 0;
+}
+
+/* timeout_deadline:
+*   Sets deadline to the end of phase starting now; a phase without
+*   timeout gets a deadline of 0.
+*/
+void timeout_deadline(struct timespec* deadline, int phase)
+{
+    if(timeout_secs[phase] == 0)
+    {
+        deadline->tv_sec = 0;
+        deadline->tv_nsec = 0;
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_secs[phase];
+}
+
+/* set_timeout:
+*   Sets the SO_RCVTIMEO or SO_SNDTIMEO option of fd to ms
+*   milliseconds, 0 meaning none.
+*/
+static void set_timeout(int fd, int option, long ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = ms % 1000 * 1000;
+    setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv));
+}
+
+/* timeout_arm:
+*   Cuts the receive timeout of fd to what is left until deadline.
+*   Returns 0, or -1 if the deadline has passed.
+*/
+int timeout_arm(int fd, const struct timespec* deadline)
+{
+    struct timespec now;
+    long ms;
+
+    if(deadline->tv_sec == 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+         (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    if(ms <= 0)
+        return -1;
+    set_timeout(fd, SO_RCVTIMEO, ms);
+    return 0;
+}
+
+/* timeout_recv:
+*   Makes each read on fd wait at most the timeout of phase.
+*/
+void timeout_recv(int fd, int phase)
+{
+    set_timeout(fd, SO_RCVTIMEO, timeout_secs[phase] * 1000L);
+}
+
+/* timeout_send:
+*   Makes each write on fd wait at most the timeout of phase.
+*/
+void timeout_send(int fd, int phase)
+{
+    set_timeout(fd, SO_SNDTIMEO, timeout_secs[phase] * 1000L);
+}
+
+/* timeout_expired:
+*   Tells whether a read or write that failed with errno err ran out
+*   of time.
+*/
+int timeout_expired(int err)
+{
+    return err == EAGAIN || err == EWOULDBLOCK || err == ETIMEDOUT;
+}
+
+/* timeout_hit:
+*   Counts a timeout of phase.
+*/
+void timeout_hit(int phase)
+{
+    dbg_printf("Timeout: %s\n", phase_names[phase]);
+    pthread_mutex_lock(&timeout_lock);
+    timeouts[phase]++;
+    pthread_mutex_unlock(&timeout_lock);
+}
+
+/* printTimeoutStats:
+*   Writes the timeouts and how often each phase ran out to out, read
+*   without locking.
+*/
+void printTimeoutStats(FILE* out)
+{
+    int i;
+
+    fprintf(out, "Timeouts:");
+    for(i = 0; i < TIMEOUT_PHASES; i++)
+        fprintf(out, " %s %ds (%lu hit)%s", phase_names[i], timeout_secs[i],
+                timeouts[i], i < TIMEOUT_PHASES - 1 ? "," : "\n");
+}
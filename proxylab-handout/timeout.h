@@ -0,0 +1,49 @@
+/* Deadlines for the phases of a request, so that a slow or silent
+   peer can't hold a thread forever:
+     header   - the client has this long to send its whole request head
+     connect  - for each attempt to connect to an address of the
+                origin (upstream.h)
+     ttfb     - from the request being sent to the origin until the
+                first byte of its response
+     idle     - longest wait for the next bytes of a body, in either
+                direction, once the response has started (or while
+                the request body is being read), and between any
+                bytes of a CONNECT tunnel
+   Phases of one read or write are enforced with SO_RCVTIMEO and
+   SO_SNDTIMEO, the header phase with a deadline that each read's
+   timeout is cut to. A phase set to 0 has no timeout */
+
+#ifndef __TIMEOUT_H__
+#define __TIMEOUT_H__
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/socket.h>
+
+/* Default timeouts in seconds */
+#define TIMEOUT_HEADER 30
+#define TIMEOUT_CONNECT 10
+#define TIMEOUT_TTFB 60
+#define TIMEOUT_IDLE 120
+
+/* The phases */
+#define TIMEOUT_PHASE_HEADER 0
+#define TIMEOUT_PHASE_CONNECT 1
+#define TIMEOUT_PHASE_TTFB 2
+#define TIMEOUT_PHASE_IDLE 3
+#define TIMEOUT_PHASES 4
+
+/* Seconds allowed for each phase */
+extern int timeout_secs[TIMEOUT_PHASES];
+
+void timeout_init();
+int timeout_parse(const char* spec);
+void timeout_deadline(struct timespec* deadline, int phase);
+int timeout_arm(int fd, const struct timespec* deadline);
+void timeout_recv(int fd, int phase);
+void timeout_send(int fd, int phase);
+int timeout_expired(int err);
+void timeout_hit(int phase);
+void printTimeoutStats(FILE* out);
+
+#endif /* __TIMEOUT_H__ */
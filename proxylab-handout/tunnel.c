@@ -0,0 +1,218 @@
+/*
+* Bidirectional relay for CONNECT tunnels. See tunnel.h.
+*/
+#define _GNU_SOURCE
+#include <poll.h>
+#include "tunnel.h"
+#include "timeout.h"
+#include "csapp.h"
+
+
+#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+/* Counters reported by printTunnelStats */
+static unsigned long tunnels_opened = 0;
+static unsigned long tunnels_active = 0;
+static unsigned long tunnels_idle = 0;
+static unsigned long tunnels_failed = 0;
+static unsigned long tunnel_bytes_up = 0;
+static unsigned long tunnel_bytes_down = 0;
+
+static pthread_mutex_t tunnel_lock;
+
+/* One direction of a tunnel: bytes read from src wait in the pipe
+   until dst takes them. eof is set once src has no more to send,
+   shut once dst's write half has been shut down */
+typedef struct direction{
+  int src;
+  int dst;
+  int pipe[2];
+  size_t pending;
+  int eof;
+  int shut;
+  unsigned long bytes;
+} direction;
+
+void tunnel_init()
+{
+    pthread_mutex_init(&tunnel_lock, 0);
+}
+
+
+/* fill:
+*   Moves what src has to offer into the pipe. Returns -1 on error.
+*/
+static int fill(direction* d)
+{
+    ssize_t n = splice(d->src, NULL, d->pipe[1], NULL, TUNNEL_SPLICE_SIZE,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if(n < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if(n == 0)
+        d->eof = 1;
+    d->pending += n;
+    return 0;
+}
+
+/* drain:
+*   Moves what the pipe holds on to dst. Returns -1 on error.
+*/
+static int drain(direction* d)
+{
+    ssize_t n = splice(d->pipe[0], NULL, d->dst, NULL, d->pending,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if(n < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    d->pending -= n;
+    d->bytes += n;
+    return 0;
+}
+
+/* half_close:
+*   Passes the end of a direction on once everything before it has
+*   been delivered.
+*/
+static void half_close(direction* d)
+{
+    if(d->eof && d->pending == 0 && !d->shut)
+    {
+        shutdown(d->dst, SHUT_WR);
+        d->shut = 1;
+    }
+}
+
+/* tunnel_relay:
+*   Relays bytes between client_fd and server_fd in both directions
+*   until both are done, one fails, or nothing moves for the idle
+*   timeout of -T. The sockets are left non-blocking and open. What
+*   was moved is stored in stats.
+*/
+void tunnel_relay(int client_fd, int server_fd, tunnel_stats* stats)
+{
+    direction dirs[2];
+    struct pollfd fds[2];
+    int i;
+
+    memset(dirs, 0, sizeof(dirs));
+    dirs[0].src = client_fd;
+    dirs[0].dst = server_fd;
+    dirs[1].src = server_fd;
+    dirs[1].dst = client_fd;
+    stats->reason = TUNNEL_ERROR;
+
+    if(pipe(dirs[0].pipe) < 0)
+        return;
+    if(pipe(dirs[1].pipe) < 0)
+    {
+        close(dirs[0].pipe[0]);
+        close(dirs[0].pipe[1]);
+        return;
+    }
+
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+    pthread_mutex_lock(&tunnel_lock);
+    tunnels_opened++;
+    tunnels_active++;
+    pthread_mutex_unlock(&tunnel_lock);
+
+    while(!dirs[0].shut || !dirs[1].shut)
+    {
+        //fds[0] is the client, fds[1] the server; each is the source
+        //of one direction and the destination of the other
+        for(i = 0; i < 2; i++)
+        {
+            fds[i].fd = dirs[i].src;
+            fds[i].events = 0;
+        }
+        for(i = 0; i < 2; i++)
+        {
+            if(!dirs[i].eof && dirs[i].pending == 0)
+                fds[i].events |= POLLIN;
+            if(dirs[i].pending > 0)
+                fds[1 - i].events |= POLLOUT;
+        }
+        //a socket nothing is expected from is left out, or a hung up
+        //peer would wake the loop up for nothing
+        for(i = 0; i < 2; i++)
+        {
+            if(fds[i].events == 0)
+                fds[i].fd = -1;
+        }
+
+        int idle = timeout_secs[TIMEOUT_PHASE_IDLE];
+        int ready = poll(fds, 2, idle ? idle * 1000 : -1);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready < 0)
+            break;
+        if(ready == 0)
+        {
+            stats->reason = TUNNEL_IDLE;
+            break;
+        }
+
+        int failed = 0;
+        for(i = 0; i < 2 && !failed; i++)
+        {
+            direction* d = &dirs[i];
+            if(fds[i].revents & (POLLIN | POLLHUP | POLLERR) && !d->eof &&
+               d->pending == 0)
+                failed = fill(d) < 0;
+            if(!failed && fds[1 - i].revents & (POLLOUT | POLLERR) &&
+               d->pending > 0)
+                failed = drain(d) < 0;
+            half_close(d);
+        }
+        if(failed)
+            break;
+    }
+
+    if(dirs[0].shut && dirs[1].shut)
+        stats->reason = TUNNEL_CLOSED;
+    stats->up = dirs[0].bytes;
+    stats->down = dirs[1].bytes;
+
+    for(i = 0; i < 2; i++)
+    {
+        close(dirs[i].pipe[0]);
+        close(dirs[i].pipe[1]);
+    }
+
+    pthread_mutex_lock(&tunnel_lock);
+    tunnels_active--;
+    if(stats->reason == TUNNEL_IDLE)
+        tunnels_idle++;
+    if(stats->reason == TUNNEL_ERROR)
+        tunnels_failed++;
+    tunnel_bytes_up += stats->up;
+    tunnel_bytes_down += stats->down;
+    pthread_mutex_unlock(&tunnel_lock);
+
+    dbg_printf("TUNNEL >> Closed (%s): %lu bytes up, %lu bytes down\n",
+               stats->reason == TUNNEL_CLOSED ? "done" :
+               stats->reason == TUNNEL_IDLE ? "idle" : "error",
+               stats->up, stats->down);
+}
+
+/* printTunnelStats:
+*   Prints the tunnel counters, read without locking.
+*/
+void printTunnelStats(FILE* out)
+{
+    fprintf(out, "tunnels: %lu opened, %lu active\n", tunnels_opened,
+            tunnels_active);
+    fprintf(out, "tunnels ended idle: %lu, on error: %lu\n", tunnels_idle,
+            tunnels_failed);
+    fprintf(out, "tunnel bytes: %lu up, %lu down\n", tunnel_bytes_up,
+            tunnel_bytes_down);
+}
@@ -0,0 +1,33 @@
+/* CONNECT tunnels. Once the origin connection is up the proxy only
+   moves bytes between the two sockets, in both directions at once,
+   without looking at them (they are usually TLS). Each direction goes
+   through a pipe with splice(), so the bytes never enter user space.
+   When one side stops sending, the other side's write half is shut
+   down once the pipe has drained, and the tunnel lives on in the
+   other direction until it is done too */
+
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include <stdio.h>
+
+/* Most bytes moved by one splice() call */
+#define TUNNEL_SPLICE_SIZE 65536
+
+/* Why a tunnel ended */
+#define TUNNEL_CLOSED 0
+#define TUNNEL_IDLE 1
+#define TUNNEL_ERROR 2
+
+/* What one tunnel moved: up is client to origin, down the other way */
+typedef struct tunnel_stats{
+  unsigned long up;
+  unsigned long down;
+  int reason;
+} tunnel_stats;
+
+void tunnel_init();
+void tunnel_relay(int client_fd, int server_fd, tunnel_stats* stats);
+void printTunnelStats(FILE* out);
+
+#endif /* __TUNNEL_H__ */
@@ -0,0 +1,465 @@
+/*
+* Unit checks of the proxy's parsers, run by make test.
+*
+* Each check prints the failing expression and its line; the program
+* exits non-zero if any failed.
+*/
+#include "csapp.h"
+#include "http.h"
+#include "hpack.h"
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        checks++;                                                       \
+        if(!(cond))                                                     \
+        {                                                               \
+            failures++;                                                 \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__,     \
+                   #cond);                                              \
+        }                                                               \
+    } while(0)
+
+static int slice_is(const http_slice* s, const char* str)
+{
+    return s->len == strlen(str) && !memcmp(s->p, str, s->len);
+}
+
+/*
+* Header names are classified whatever their case, and names that only
+* share a prefix or a hash with a known one are not taken for it.
+*/
+static void test_header_ids()
+{
+    CHECK(http_header_id("Host", 4) == HTTP_HDR_HOST);
+    CHECK(http_header_id("host", 4) == HTTP_HDR_HOST);
+    CHECK(http_header_id("HOST", 4) == HTTP_HDR_HOST);
+    CHECK(http_header_id("User-Agent", 10) == HTTP_HDR_USER_AGENT);
+    CHECK(http_header_id("Accept", 6) == HTTP_HDR_ACCEPT);
+    CHECK(http_header_id("accept-encoding", 15) == HTTP_HDR_ACCEPT_ENCODING);
+    CHECK(http_header_id("Connection", 10) == HTTP_HDR_CONNECTION);
+    CHECK(http_header_id("Proxy-Connection", 16) ==
+          HTTP_HDR_PROXY_CONNECTION);
+    CHECK(http_header_id("Keep-Alive", 10) == HTTP_HDR_KEEP_ALIVE);
+    CHECK(http_header_id("Range", 5) == HTTP_HDR_RANGE);
+    CHECK(http_header_id("Content-Length", 14) == HTTP_HDR_CONTENT_LENGTH);
+    CHECK(http_header_id("Transfer-Encoding", 17) ==
+          HTTP_HDR_TRANSFER_ENCODING);
+    CHECK(http_header_id("If-None-Match", 13) == HTTP_HDR_IF_NONE_MATCH);
+    CHECK(http_header_id("If-Modified-Since", 17) ==
+          HTTP_HDR_IF_MODIFIED_SINCE);
+    CHECK(http_header_id("If-Range", 8) == HTTP_HDR_IF_RANGE);
+
+    CHECK(http_header_id("Hos", 3) == HTTP_HDR_OTHER);
+    CHECK(http_header_id("Hostx", 5) == HTTP_HDR_OTHER);
+    CHECK(http_header_id("Accept-Language", 15) == HTTP_HDR_OTHER);
+    CHECK(http_header_id("X-Host", 6) == HTTP_HDR_OTHER);
+    CHECK(http_header_id("", 0) == HTTP_HDR_OTHER);
+}
+
+/*
+* A request fed a byte at a time parses as it does whole, with its
+* headers classified and the bytes after the head left alone.
+*/
+static void test_parse_request()
+{
+    static const char request[] =
+        "GET http://example.com:8080/a/b?c=d HTTP/1.1\r\n"
+        "Host: example.com:8080\r\n"
+        "accept-encoding:gzip\r\n"
+        "X-Other:  spaced  \r\n"
+        "\r\n"
+        "body";
+    size_t head = sizeof(request) - 1 - 4;
+    http_request req;
+    size_t n;
+    int r = HTTP_PARSE_AGAIN;
+
+    http_request_init(&req);
+    for(n = 1; n <= head && r == HTTP_PARSE_AGAIN; n++)
+    {
+        r = http_parse_request(&req, request, n);
+        CHECK(r == (n < head ? HTTP_PARSE_AGAIN : HTTP_PARSE_DONE));
+    }
+    CHECK(r == HTTP_PARSE_DONE);
+    CHECK(req.head_len == head);
+    CHECK(slice_is(&req.method, "GET"));
+    CHECK(slice_is(&req.target, "http://example.com:8080/a/b?c=d"));
+    CHECK(slice_is(&req.version, "HTTP/1.1"));
+    CHECK(req.nheaders == 3);
+    CHECK(req.headers[0].id == HTTP_HDR_HOST);
+    CHECK(req.headers[1].id == HTTP_HDR_ACCEPT_ENCODING);
+    CHECK(slice_is(&req.headers[1].value, "gzip"));
+    CHECK(req.headers[2].id == HTTP_HDR_OTHER);
+    CHECK(slice_is(&req.headers[2].value, "spaced"));
+
+    const http_slice* host = http_request_header(&req, HTTP_HDR_HOST);
+    CHECK(host != NULL && slice_is(host, "example.com:8080"));
+    CHECK(http_request_header(&req, HTTP_HDR_RANGE) == NULL);
+
+    http_slice h, path;
+    int port;
+    CHECK(http_parse_target(&req.target, &h, &port, &path) == 0);
+    CHECK(slice_is(&h, "example.com") && port == 8080);
+    CHECK(slice_is(&path, "/a/b?c=d"));
+
+    http_request_init(&req);
+    CHECK(http_parse_request(&req, "GET\r\n\r\n", 7) == HTTP_PARSE_ERROR);
+    http_request_init(&req);
+    CHECK(http_parse_request(&req, "GET / HTTP/1.0\r\nNoColon\r\n\r\n", 27)
+          == HTTP_PARSE_ERROR);
+}
+
+/*
+* Each byte scanner finds the first match at every offset and length,
+* across the vector widths.
+*/
+static void test_find_char(const char* scanner)
+{
+    char buf[100];
+    size_t len, at;
+    int ok = 1;
+
+    memset(buf, 'a', sizeof(buf));
+    for(len = 0; len <= sizeof(buf); len++)
+    {
+        for(at = 0; at <= len; at++)
+        {
+            if(at < len)
+                buf[at] = ':';
+            const char* p = http_find_char(buf, len, ':');
+            if(p != (at < len ? buf + at : NULL))
+                ok = 0;
+            if(at < len)
+                buf[at] = 'a';
+        }
+    }
+    CHECK(ok);
+    if(!ok)
+        printf("  with the %s scanner\n", scanner);
+}
+
+static int ranges(const char* spec, long length, http_range* r)
+{
+    return http_parse_ranges(spec, strlen(spec), length, r);
+}
+
+/*
+* Range specs resolve against the body length: suffix and open-ended
+* ranges, clamping, unsatisfiable sets and sets that are ignored.
+*/
+static void test_ranges()
+{
+    http_range r[HTTP_MAX_RANGES];
+
+    CHECK(ranges("bytes=0-99", 1000, r) == 1);
+    CHECK(r[0].first == 0 && r[0].last == 99);
+    CHECK(ranges("bytes=500-", 1000, r) == 1);
+    CHECK(r[0].first == 500 && r[0].last == 999);
+    CHECK(ranges("bytes=900-2000", 1000, r) == 1);
+    CHECK(r[0].first == 900 && r[0].last == 999);
+
+    //suffixes
+    CHECK(ranges("bytes=-100", 1000, r) == 1);
+    CHECK(r[0].first == 900 && r[0].last == 999);
+    CHECK(ranges("bytes=-5000", 1000, r) == 1);
+    CHECK(r[0].first == 0 && r[0].last == 999);
+    CHECK(ranges("bytes=-0", 1000, r) == 0);
+
+    //several, with spaces and a case-insensitive unit
+    CHECK(ranges("Bytes=0-0, 10-19 ,-1", 1000, r) == 3);
+    CHECK(r[0].first == 0 && r[0].last == 0);
+    CHECK(r[1].first == 10 && r[1].last == 19);
+    CHECK(r[2].first == 999 && r[2].last == 999);
+    CHECK(ranges("bytes=0-1,2-3,4-5,6-7,8-9,10-11,12-13,14-15", 100, r)
+          == HTTP_MAX_RANGES);
+    CHECK(ranges("bytes=0-1,2-3,4-5,6-7,8-9,10-11,12-13,14-15,16-17",
+                 100, r) == -1);
+
+    //unsatisfiable ones are left out, and none left is a 416
+    CHECK(ranges("bytes=1000-", 1000, r) == 0);
+    CHECK(ranges("bytes=2000-3000", 1000, r) == 0);
+    CHECK(ranges("bytes=2000-3000,0-9", 1000, r) == 1);
+    CHECK(r[0].first == 0 && r[0].last == 9);
+    CHECK(ranges("bytes=0-", 0, r) == 0);
+
+    //malformed: the header is ignored
+    CHECK(ranges("items=0-9", 1000, r) == -1);
+    CHECK(ranges("bytes=", 5, r) == -1);
+    CHECK(ranges("bytes=9-0", 1000, r) == -1);
+    CHECK(ranges("bytes=5", 1000, r) == -1);
+    CHECK(ranges("bytes=a-9", 1000, r) == -1);
+    CHECK(ranges("bytes=0-9x", 1000, r) == -1);
+    CHECK(ranges("bytes=--5", 1000, r) == -1);
+}
+
+/*
+* Decodes body with http_dechunk, fed split into pieces of step bytes
+* (all of it at once for 0). Returns the data length, or -1 if the
+* decoder failed or didn't see the end.
+*/
+static long dechunk(const char* body, size_t step, char* out)
+{
+    size_t len = strlen(body), pos = 0, n;
+    char piece[256];
+    http_chunked c;
+    long total = 0, got;
+
+    http_chunked_init(&c);
+    while(pos < len && !c.done)
+    {
+        n = step > 0 && len - pos > step ? step : len - pos;
+        memcpy(piece, body + pos, n);
+        if((got = http_dechunk(&c, piece, n)) < 0)
+            return -1;
+        memcpy(out + total, piece, got);
+        total += got;
+        pos += n;
+    }
+    return c.done ? total : -1;
+}
+
+/*
+* Chunked bodies decode the same whole and split at any byte, with
+* extensions, trailers and bare line feeds, and bad framing fails.
+*/
+static void test_chunked()
+{
+    static const char body[] =
+        "5\r\nhello\r\n"
+        "6;name=\"value\"\r\n world\r\n"
+        "A \r\n, chunked!\r\n"
+        "0\r\n"
+        "X-Trailer: yes\r\n"
+        "\r\n"
+        "next response";
+    static const char data[] = "hello world, chunked!";
+    char out[256];
+    size_t step;
+    int ok = 1;
+
+    CHECK(dechunk(body, 0, out) == sizeof(data) - 1 &&
+          !memcmp(out, data, sizeof(data) - 1));
+    for(step = 1; step < sizeof(body); step++)
+    {
+        if(dechunk(body, step, out) != sizeof(data) - 1 ||
+           memcmp(out, data, sizeof(data) - 1))
+            ok = 0;
+    }
+    CHECK(ok);
+
+    CHECK(dechunk("3\nabc\n0\n\n", 0, out) == 3 && !memcmp(out, "abc", 3));
+    CHECK(dechunk("0\r\n\r\n", 1, out) == 0);
+    CHECK(dechunk("ff\r\n", 0, out) == -1);
+
+    //what comes after the body is left for the caller
+    http_chunked c;
+    http_slice d;
+    const char* end = "0\r\n\r\nGET";
+    http_chunked_init(&c);
+    CHECK(http_chunked_step(&c, end, strlen(end), &d) == 5);
+    CHECK(c.done && d.len == 0);
+    CHECK(http_chunked_step(&c, end + 5, 3, &d) == 0);
+
+    //malformed sizes and framing
+    CHECK(dechunk("\r\n", 0, out) == -1);
+    CHECK(dechunk(";ext\r\n", 0, out) == -1);
+    CHECK(dechunk("g\r\n", 0, out) == -1);
+    CHECK(dechunk("-5\r\nhello\r\n0\r\n\r\n", 0, out) == -1);
+    CHECK(dechunk("1000000000000000\r\n", 0, out) == -1);
+    CHECK(dechunk("5\rhello\r\n0\r\n\r\n", 0, out) == -1);
+    CHECK(dechunk("5\r\nhelloX\r\n0\r\n\r\n", 0, out) == -1);
+    CHECK(dechunk("5\r\nhello\rX0\r\n\r\n", 0, out) == -1);
+    CHECK(dechunk("0\r\n\rX", 0, out) == -1);
+
+    CHECK(http_is_chunked("chunked", 7));
+    CHECK(http_is_chunked("gzip, Chunked ", 14));
+    CHECK(!http_is_chunked("chunked, gzip", 13));
+    CHECK(!http_is_chunked("xchunked", 8));
+}
+
+/* A header block of RFC 7541 appendix C, and the fields and dynamic
+   table size it decodes to */
+typedef struct hpack_case{
+  const char* hex;
+  const char* fields[8][2];
+  size_t table_size;
+} hpack_case;
+
+static size_t unhex(const char* hex, unsigned char* out)
+{
+    size_t n = 0;
+    unsigned int b;
+
+    while(*hex != '\0')
+    {
+        if(*hex == ' ')
+        {
+            hex++;
+            continue;
+        }
+        sscanf(hex, "%2x", &b);
+        out[n++] = b;
+        hex += 2;
+    }
+    return n;
+}
+
+/*
+* Decodes a sequence of blocks on one connection, with a dynamic table
+* of table_max bytes, and checks each against its fields and the size
+* of the table after it.
+*/
+static void check_hpack(const hpack_case* cases, int ncases, size_t table_max)
+{
+    unsigned char block[256];
+    char buf[1024];
+    hpack_field fields[8];
+    hpack_table t;
+    int i, j, n;
+
+    hpack_table_init(&t);
+    t.max_size = table_max;
+    for(i = 0; i < ncases; i++)
+    {
+        int ok = 1;
+
+        n = hpack_decode(&t, block, unhex(cases[i].hex, block), buf,
+                         sizeof(buf), fields, 8);
+        for(j = 0; j < 8 && cases[i].fields[j][0] != NULL; j++)
+        {
+            if(j >= n || !slice_is(&fields[j].name, cases[i].fields[j][0]) ||
+               !slice_is(&fields[j].value, cases[i].fields[j][1]))
+                ok = 0;
+        }
+        CHECK(n == j);
+        CHECK(ok);
+        CHECK(t.size == cases[i].table_size);
+        if(n != j || !ok || t.size != cases[i].table_size)
+            printf("  in block %s\n", cases[i].hex);
+    }
+    hpack_table_free(&t);
+}
+
+static int hpack_rejects(const char* hex)
+{
+    unsigned char block[64];
+    char buf[256];
+    hpack_field fields[8];
+    hpack_table t;
+
+    hpack_table_init(&t);
+    int n = hpack_decode(&t, block, unhex(hex, block), buf, sizeof(buf),
+                         fields, 8);
+    hpack_table_free(&t);
+    return n < 0;
+}
+
+/*
+* The request and response examples of RFC 7541 (C.3, C.4 and C.6),
+* and blocks a decoder must refuse.
+*/
+static void test_hpack()
+{
+    static const hpack_case c3[] = {
+        { "828684410f7777772e6578616d706c652e636f6d",
+          { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" },
+            { ":authority", "www.example.com" } }, 57 },
+        { "828684be58086e6f2d6361636865",
+          { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" },
+            { ":authority", "www.example.com" },
+            { "cache-control", "no-cache" } }, 110 },
+        { "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565",
+          { { ":method", "GET" }, { ":scheme", "https" },
+            { ":path", "/index.html" }, { ":authority", "www.example.com" },
+            { "custom-key", "custom-value" } }, 164 },
+    };
+    static const hpack_case c4[] = {
+        { "828684418cf1e3c2e5f23a6ba0ab90f4ff",
+          { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" },
+            { ":authority", "www.example.com" } }, 57 },
+        { "828684be5886a8eb10649cbf",
+          { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" },
+            { ":authority", "www.example.com" },
+            { "cache-control", "no-cache" } }, 110 },
+        { "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+          { { ":method", "GET" }, { ":scheme", "https" },
+            { ":path", "/index.html" }, { ":authority", "www.example.com" },
+            { "custom-key", "custom-value" } }, 164 },
+    };
+    static const hpack_case c6[] = {
+        { "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff"
+          "6e919d29ad171863c78f0b97c8e9ae82ae43d3",
+          { { ":status", "302" }, { "cache-control", "private" },
+            { "date", "Mon, 21 Oct 2013 20:13:21 GMT" },
+            { "location", "https://www.example.com" } }, 222 },
+        { "4883640effc1c0bf",
+          { { ":status", "307" }, { "cache-control", "private" },
+            { "date", "Mon, 21 Oct 2013 20:13:21 GMT" },
+            { "location", "https://www.example.com" } }, 222 },
+        { "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab"
+          "77ad94e7821dd7f2e6c7b335dfdfcd5b3960d5af27087f3672c1ab270fb5291f"
+          "9587316065c003ed4ee5b1063d5007",
+          { { ":status", "200" }, { "cache-control", "private" },
+            { "date", "Mon, 21 Oct 2013 20:13:22 GMT" },
+            { "location", "https://www.example.com" },
+            { "content-encoding", "gzip" },
+            { "set-cookie",
+              "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1" } },
+          215 },
+    };
+
+    check_hpack(c3, 3, HPACK_TABLE_SIZE);
+    check_hpack(c4, 3, HPACK_TABLE_SIZE);
+    //C.6 is decoded with a 256 byte table, so entries get evicted
+    check_hpack(c6, 3, 256);
+
+    //index 0, and indexes past the tables
+    CHECK(hpack_rejects("80"));
+    CHECK(hpack_rejects("be"));
+    CHECK(hpack_rejects("7e00"));
+    CHECK(!hpack_rejects("bd"));
+
+    //Huffman padding: '0' then three 1 bits is fine, zero bits or more
+    //than seven bits of padding are not, and neither is EOS
+    CHECK(!hpack_rejects("018107"));
+    CHECK(hpack_rejects("018100"));
+    CHECK(hpack_rejects("018207ff"));
+    CHECK(hpack_rejects("0184ffffffff"));
+
+    //table size updates: at most the default, only at the start
+    CHECK(!hpack_rejects("3fe11f82"));
+    CHECK(hpack_rejects("3fe21f82"));
+    CHECK(hpack_rejects("8220"));
+
+    //truncated integers and strings
+    CHECK(hpack_rejects("ff"));
+    CHECK(hpack_rejects("0185"));
+}
+
+int main()
+{
+    static const char* scanners[] = { "scalar", "sse2", "avx2" };
+    int i;
+
+    http_init();
+
+    test_header_ids();
+    for(i = 0; i < 3; i++)
+    {
+        if(http_use_scanner(scanners[i]) < 0)
+            continue;
+        test_find_char(scanners[i]);
+        test_parse_request();
+    }
+    test_ranges();
+    test_chunked();
+
+    hpack_init();
+    test_hpack();
+
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures > 0;
+}
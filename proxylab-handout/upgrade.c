@@ -0,0 +1,364 @@
+/*
+* Upgrades without downtime. See upgrade.h.
+*/
+#define _GNU_SOURCE
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include "upgrade.h"
+#include "csapp.h"
+#include "cache.h"
+
+
+#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+char* upgrade_path = NULL;
+
+/* The listening socket and cache handed over, and the pipe on which
+   the handoff wakes the accept loop up */
+static int handoff_listenfd = -1;
+static struct cache_LL* handoff_cache = NULL;
+static int wake[2] = { -1, -1 };
+static int handed_off = 0;
+
+/* Connections being served */
+static int active = 0;
+
+/* Counters reported by printUpgradeStats */
+static int inherited = -1;
+static int imported = 0;
+
+static pthread_mutex_t upgrade_lock;
+static pthread_cond_t upgrade_idle;
+
+void upgrade_init()
+{
+    pthread_mutex_init(&upgrade_lock, 0);
+    pthread_cond_init(&upgrade_idle, 0);
+}
+
+
+/* handoff_addr:
+*   Fills addr with the address of the handoff socket. Returns its
+*   length, or -1 if the path doesn't fit.
+*/
+static int handoff_addr(struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(upgrade_path) >= sizeof(addr->sun_path))
+        return -1;
+    strcpy(addr->sun_path, upgrade_path);
+    return sizeof(*addr);
+}
+
+/* upgrade_inherit:
+*   Asks the proxy listening on the handoff socket, if there is one,
+*   for its listening socket and cache, which is added to cache.
+*   Returns the listening socket, or -1 if there is nothing to inherit.
+*/
+int upgrade_inherit(struct cache_LL* cache)
+{
+    struct sockaddr_un addr;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr* cm;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    int fds[2] = { -1, -1 };
+    char c = 'U';
+    int s, len, nfds = 0;
+
+    if(upgrade_path == NULL || (len = handoff_addr(&addr)) < 0)
+        return -1;
+    if((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if(connect(s, (struct sockaddr*)&addr, len) < 0 ||
+       write(s, &c, 1) != 1)
+    {
+        close(s);
+        return -1;
+    }
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    if(recvmsg(s, &mh, 0) == 1 &&
+       (cm = CMSG_FIRSTHDR(&mh)) != NULL &&
+       cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+    {
+        nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+    }
+    close(s);
+    if(nfds == 0)
+        return -1;
+
+    //the cache comes as a memory file that is only read
+    if(nfds > 1)
+    {
+        struct stat st;
+        char* map;
+        if(fstat(fds[1], &st) == 0 && st.st_size > 0 &&
+           (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fds[1],
+                       0)) != MAP_FAILED)
+        {
+            int n = cache_import(cache, map, st.st_size);
+            imported = n > 0 ? n : 0;
+            munmap(map, st.st_size);
+        }
+        close(fds[1]);
+    }
+
+    inherited = fds[0];
+    dbg_printf("Upgrade: inherited listening socket %d and %d cached objects\n",
+               fds[0], imported);
+    return fds[0];
+}
+
+/* hand_over:
+*   Answers a successor on the connection s with the listening socket
+*   and a copy of the cache. Returns 0, or -1 if it wasn't handed over.
+*/
+static int hand_over(int s)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr* cm;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    int fds[2];
+    int nfds = 1;
+    char c;
+
+    if(read(s, &c, 1) != 1 || c != 'U')
+        return -1;
+
+    fds[0] = handoff_listenfd;
+    fds[1] = memfd_create("proxy-cache", MFD_CLOEXEC);
+    if(fds[1] >= 0 && cache_export(handoff_cache, fds[1]) >= 0)
+        nfds = 2;
+    else if(fds[1] >= 0)
+        close(fds[1]);
+
+    memset(&mh, 0, sizeof(mh));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+
+    int sent = sendmsg(s, &mh, 0) == 1;
+    if(nfds == 2)
+        close(fds[1]);
+    return sent ? 0 : -1;
+}
+
+/* same_user:
+*   Checks that the peer on the Unix socket c runs as our user; only
+*   such a process may take the listening socket and the cache.
+*/
+static int same_user(int c)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return getsockopt(c, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+           cred.uid == geteuid();
+}
+
+/* handoff_thread:
+*   Waits on the handoff socket s for a successor, then wakes the
+*   accept loop up so that it stops. If the socket fails for good, the
+*   proxy keeps serving and can no longer be taken over.
+*/
+static void *handoff_thread(void *arg)
+{
+    int s = *(int*)arg;
+    int c;
+
+    Free(arg);
+    Pthread_detach(pthread_self());
+
+    while(1)
+    {
+        if((c = accept(s, NULL, NULL)) < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            //out of descriptors or memory for now: wait for some back
+            if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+               errno == ENOMEM)
+            {
+                sleep(1);
+                continue;
+            }
+            fprintf(stderr, "handoff socket %s failed: %s\n", upgrade_path,
+                    strerror(errno));
+            close(s);
+            return NULL;
+        }
+        if(!same_user(c))
+        {
+            dbg_printf("Upgrade: refused a handoff to another user\n");
+            close(c);
+            continue;
+        }
+        //a successor has a moment to ask
+        struct timeval tv = { 5, 0 };
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        int done = hand_over(c) == 0;
+        close(c);
+        if(done)
+            break;
+    }
+    close(s);
+
+    dbg_printf("Upgrade: handed over to a new proxy, draining\n");
+    pthread_mutex_lock(&upgrade_lock);
+    handed_off = 1;
+    pthread_mutex_unlock(&upgrade_lock);
+    if(write(wake[1], "x", 1) < 0)
+        dbg_printf("Upgrade: couldn't wake the accept loop\n");
+    return NULL;
+}
+
+/* upgrade_serve:
+*   Takes over the handoff socket, if there is to be one, to hand
+*   listenfd and cache to a successor.
+*/
+void upgrade_serve(int listenfd, struct cache_LL* cache)
+{
+    struct sockaddr_un addr;
+    pthread_t tid;
+    int s, len;
+    int* arg;
+
+    if(upgrade_path == NULL)
+        return;
+    if((len = handoff_addr(&addr)) < 0 ||
+       (s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        fprintf(stderr, "can't make the handoff socket %s\n", upgrade_path);
+        return;
+    }
+
+    //the socket of the proxy this one took over from, if any, goes;
+    //the new one is only for our user, and closed to others before
+    //anything can connect to it
+    unlink(upgrade_path);
+    if(bind(s, (struct sockaddr*)&addr, len) < 0 ||
+       chmod(upgrade_path, 0600) < 0 || listen(s, 1) < 0 || pipe(wake) < 0)
+    {
+        fprintf(stderr, "can't listen on the handoff socket %s\n",
+                upgrade_path);
+        close(s);
+        return;
+    }
+
+    handoff_listenfd = listenfd;
+    handoff_cache = cache;
+    arg = Malloc(sizeof(int));
+    *arg = s;
+    Pthread_create(&tid, NULL, handoff_thread, arg);
+}
+
+/* upgrade_accept:
+*   Accepts a connection on listenfd. Returns it, or -1 once the
+*   listening socket was handed over.
+*/
+int upgrade_accept(int listenfd, struct sockaddr* addr, socklen_t* len)
+{
+    struct pollfd fds[2];
+    socklen_t room = *len;
+    int fd;
+
+    if(wake[0] < 0)
+        return Accept(listenfd, addr, len);
+
+    fds[0].fd = listenfd;
+    fds[1].fd = wake[0];
+    fds[0].events = fds[1].events = POLLIN;
+    while(1)
+    {
+        if(poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            unix_error("Accept error");
+        }
+        if(fds[1].revents)
+            return -1;
+
+        *len = room;
+        if((fd = accept(listenfd, addr, len)) >= 0)
+            return fd;
+        if(errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+            unix_error("Accept error");
+    }
+}
+
+void upgrade_conn_begin()
+{
+    pthread_mutex_lock(&upgrade_lock);
+    active++;
+    pthread_mutex_unlock(&upgrade_lock);
+}
+
+void upgrade_conn_end()
+{
+    pthread_mutex_lock(&upgrade_lock);
+    if(--active == 0)
+        pthread_cond_broadcast(&upgrade_idle);
+    pthread_mutex_unlock(&upgrade_lock);
+}
+
+/* upgrade_drain:
+*   Waits for the connections being served to finish, for at most
+*   UPGRADE_DRAIN seconds.
+*/
+void upgrade_drain()
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += UPGRADE_DRAIN;
+
+    pthread_mutex_lock(&upgrade_lock);
+    while(active > 0 &&
+          pthread_cond_timedwait(&upgrade_idle, &upgrade_lock, &deadline) == 0)
+        ;
+    dbg_printf("Upgrade: exiting with %d connections left\n", active);
+    pthread_mutex_unlock(&upgrade_lock);
+}
+
+/* printUpgradeStats:
+*   Writes where the listening socket came from and the connections
+*   being served to out, read without locking.
+*/
+void printUpgradeStats(FILE* out)
+{
+    if(upgrade_path == NULL)
+        fprintf(out, "Upgrade: off, %d connections\n", active);
+    else
+        fprintf(out, "Upgrade: handoff at %s, %s, %d cached objects "
+                "inherited, %d connections%s\n", upgrade_path,
+                inherited >= 0 ? "listening socket inherited" :
+                                 "listening socket opened",
+                imported, active, handed_off ? ", handed off" : "");
+}
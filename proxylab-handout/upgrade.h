@@ -0,0 +1,36 @@
+/* Upgrades without downtime. With -U path, the proxy listens on the
+   Unix socket at path for its successor: a new proxy started with the
+   same -U (a new binary, say) connects there first and is handed the
+   listening socket with SCM_RIGHTS, along with a copy of the cache in
+   a memory file (see cache_export), so that it starts serving at once
+   and warm. The old proxy then stops accepting, lets the connections
+   it has finish for up to UPGRADE_DRAIN seconds and exits, while the
+   new one takes over path for the next upgrade. A proxy that finds no
+   predecessor at path opens its listening socket itself. Only a
+   process of the same user is handed anything: the socket at path is
+   made private to it, and peers of other users are turned away */
+
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include <stdio.h>
+#include <sys/socket.h>
+
+/* Seconds an old proxy waits for its connections to finish */
+#define UPGRADE_DRAIN 30
+
+/* The path of the handoff socket, NULL without -U */
+extern char* upgrade_path;
+
+struct cache_LL;
+
+void upgrade_init();
+int upgrade_inherit(struct cache_LL* cache);
+void upgrade_serve(int listenfd, struct cache_LL* cache);
+int upgrade_accept(int listenfd, struct sockaddr* addr, socklen_t* len);
+void upgrade_conn_begin();
+void upgrade_conn_end();
+void upgrade_drain();
+void printUpgradeStats(FILE* out);
+
+#endif /* __UPGRADE_H__ */
@@ -0,0 +1,341 @@
+/*
+* Connections to origin servers. See upstream.h.
+*/
+#include <poll.h>
+#include "upstream.h"
+#include "timeout.h"
+#include "csapp.h"
+
+
+#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+/* An address that failed: the hash of its sockaddr, and until when it
+   is tried last */
+typedef struct failed_addr{
+  unsigned long key;
+  time_t until;
+} failed_addr;
+
+static failed_addr failures[UPSTREAM_FAIL_SLOTS];
+
+/* Counters reported by printUpstreamStats */
+static unsigned long connects = 0;
+static unsigned long connects_failed = 0;
+static unsigned long attempts = 0;
+static unsigned long attempts_failed = 0;
+static unsigned long fallbacks = 0;
+static unsigned long demoted = 0;
+
+static pthread_mutex_t upstream_lock;
+
+void upstream_init()
+{
+    pthread_mutex_init(&upstream_lock, 0);
+}
+
+
+static unsigned long addr_key(const struct addrinfo* ai)
+{
+    const unsigned char* p = (const unsigned char*)ai->ai_addr;
+    unsigned long h = 14695981039346656037UL;
+    socklen_t i;
+
+    for(i = 0; i < ai->ai_addrlen; i++)
+        h = (h ^ p[i]) * 1099511628211UL;
+    return h;
+}
+
+/* failed_recently:
+*   Tells whether connecting to the address of ai failed lately.
+*/
+static int failed_recently(const struct addrinfo* ai)
+{
+    unsigned long key = addr_key(ai);
+    failed_addr* f = &failures[key % UPSTREAM_FAIL_SLOTS];
+    int failed;
+
+    pthread_mutex_lock(&upstream_lock);
+    failed = f->key == key && f->until > time(NULL);
+    pthread_mutex_unlock(&upstream_lock);
+    return failed;
+}
+
+/* remember:
+*   Records that connecting to the address of ai failed, or forgets a
+*   failure of it once it worked.
+*/
+static void remember(const struct addrinfo* ai, int failed)
+{
+    unsigned long key = addr_key(ai);
+    failed_addr* f = &failures[key % UPSTREAM_FAIL_SLOTS];
+
+    pthread_mutex_lock(&upstream_lock);
+    if(failed)
+    {
+        f->key = key;
+        f->until = time(NULL) + UPSTREAM_FAIL_MEMORY;
+        attempts_failed++;
+    }
+    else if(f->key == key)
+        f->until = 0;
+    pthread_mutex_unlock(&upstream_lock);
+}
+
+/* order:
+*   Lists the n addresses at addrs in the order they are tried: those
+*   that failed lately after the others, and avoid (if not NULL) last
+*   of all; within each group the address families alternate,
+*   starting with that of the first address getaddrinfo gave. Returns
+*   the number of addresses put last for having failed.
+*/
+static int order(struct addrinfo** addrs, int n,
+                 const struct sockaddr* avoid, socklen_t avoid_len)
+{
+    struct addrinfo* sorted[UPSTREAM_MAX_ADDRS];
+    int used[UPSTREAM_MAX_ADDRS] = { 0 };
+    int bad[UPSTREAM_MAX_ADDRS];
+    int group, k = 0, late = 0, i;
+
+    for(i = 0; i < n; i++)
+    {
+        if(avoid != NULL && addrs[i]->ai_addrlen == avoid_len &&
+           !memcmp(addrs[i]->ai_addr, avoid, avoid_len))
+            bad[i] = 2;
+        else
+            bad[i] = failed_recently(addrs[i]);
+    }
+
+    for(group = 0; group < 3; group++)
+    {
+        int family = -1;
+        while(1)
+        {
+            //the next address of the other family, or of any if there
+            //is none left of it
+            int pick = -1;
+            for(i = 0; i < n && pick < 0; i++)
+            {
+                if(!used[i] && bad[i] == group && addrs[i]->ai_family != family)
+                    pick = i;
+            }
+            for(i = 0; i < n && pick < 0; i++)
+            {
+                if(!used[i] && bad[i] == group)
+                    pick = i;
+            }
+            if(pick < 0)
+                break;
+            used[pick] = 1;
+            family = addrs[pick]->ai_family;
+            sorted[k++] = addrs[pick];
+            late += group == 1;
+        }
+    }
+
+    memcpy(addrs, sorted, n * sizeof(struct addrinfo*));
+    return late;
+}
+
+static long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* race:
+*   Opens a connection to port on host, trying avoid last. Returns the
+*   connected socket, blocking, UPSTREAM_DNS_ERROR if host can't be
+*   resolved, or -1 if none of its addresses could be reached in time.
+*/
+static int race(const char* host, int port, const struct sockaddr* avoid,
+                socklen_t avoid_len)
+{
+    struct addrinfo hints, *list, *ai;
+    struct addrinfo* addrs[UPSTREAM_MAX_ADDRS];
+    struct pollfd fds[UPSTREAM_MAX_ADDRS];
+    int which[UPSTREAM_MAX_ADDRS];
+    long deadline[UPSTREAM_MAX_ADDRS];
+    char service[16];
+    int n = 0, next = 0, pending = 0, fd = -1, won = -1, timed_out = 0;
+    long now, next_start = 0;
+    int i;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    snprintf(service, sizeof(service), "%d", port);
+
+    if(getaddrinfo(host, service, &hints, &list) != 0)
+        return UPSTREAM_DNS_ERROR;
+    for(ai = list; ai != NULL && n < UPSTREAM_MAX_ADDRS; ai = ai->ai_next)
+        addrs[n++] = ai;
+
+    int late = order(addrs, n, avoid, avoid_len);
+    pthread_mutex_lock(&upstream_lock);
+    demoted += late;
+    pthread_mutex_unlock(&upstream_lock);
+
+    while(fd < 0 && (next < n || pending > 0))
+    {
+        now = now_ms();
+
+        //start the next attempt when its turn has come, or right away
+        //if nothing is in flight
+        if(next < n && (pending == 0 || now >= next_start))
+        {
+            ai = addrs[next];
+            int s = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+                           ai->ai_protocol);
+
+            pthread_mutex_lock(&upstream_lock);
+            attempts++;
+            pthread_mutex_unlock(&upstream_lock);
+
+            if(s >= 0 && connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+            {
+                fd = s;
+                won = next;
+            }
+            else if(s >= 0 && errno == EINPROGRESS)
+            {
+                fds[pending].fd = s;
+                fds[pending].events = POLLOUT;
+                fds[pending].revents = 0;
+                which[pending] = next;
+                deadline[pending++] = timeout_secs[TIMEOUT_PHASE_CONNECT] ?
+                    now + timeout_secs[TIMEOUT_PHASE_CONNECT] * 1000L : 0;
+            }
+            else
+            {
+                if(s >= 0)
+                    close(s);
+                remember(ai, 1);
+            }
+            next++;
+            next_start = now + UPSTREAM_STAGGER_MS;
+            continue;
+        }
+
+        //wait until an attempt ends, times out, or the next one is due
+        long wait = -1, w;
+        for(i = 0; i < pending; i++)
+        {
+            w = deadline[i] > now ? deadline[i] - now : 0;
+            if(deadline[i] > 0 && (wait < 0 || w < wait))
+                wait = w;
+        }
+        w = next_start > now ? next_start - now : 0;
+        if(next < n && (wait < 0 || w < wait))
+            wait = w;
+
+        //a signal leaves revents as they were, so look again
+        if(poll(fds, pending, wait) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        now = now_ms();
+
+        for(i = pending - 1; i >= 0 && fd < 0; i--)
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            if(fds[i].revents == 0 && (deadline[i] == 0 || now < deadline[i]))
+                continue;
+
+            if(fds[i].revents != 0 &&
+               getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+               err == 0)
+            {
+                fd = fds[i].fd;
+                won = which[i];
+            }
+            else
+            {
+                if(fds[i].revents == 0)
+                    timed_out = 1;
+                close(fds[i].fd);
+                remember(addrs[which[i]], 1);
+                //a failure lets the next address go at once
+                next_start = now;
+            }
+
+            pending--;
+            fds[i] = fds[pending];
+            which[i] = which[pending];
+            deadline[i] = deadline[pending];
+        }
+    }
+
+    //the attempts that lost
+    for(i = 0; i < pending; i++)
+        close(fds[i].fd);
+
+    pthread_mutex_lock(&upstream_lock);
+    connects++;
+    if(fd < 0)
+        connects_failed++;
+    else if(won > 0)
+        fallbacks++;
+    pthread_mutex_unlock(&upstream_lock);
+
+    if(fd >= 0)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        remember(addrs[won], 0);
+        if(won > 0)
+            dbg_printf("Connected to %s through address %d of %d\n", host,
+                       won + 1, n);
+    }
+    else if(timed_out)
+        timeout_hit(TIMEOUT_PHASE_CONNECT);
+
+    freeaddrinfo(list);
+    return fd;
+}
+
+/* upstream_connect:
+*   Opens a connection to port on host. Returns the connected socket,
+*   blocking, UPSTREAM_DNS_ERROR if host can't be resolved, or -1 if
+*   none of its addresses could be reached in time.
+*/
+int upstream_connect(const char* host, int port)
+{
+    return race(host, port, NULL, 0);
+}
+
+/* upstream_connect_other:
+*   Opens another connection to port on host than fd, to a different
+*   address of host if it has one. Returns as upstream_connect.
+*/
+int upstream_connect_other(const char* host, int port, int fd)
+{
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+
+    if(getpeername(fd, (struct sockaddr*)&peer, &len) < 0)
+        return race(host, port, NULL, 0);
+    return race(host, port, (struct sockaddr*)&peer, len);
+}
+
+/* printUpstreamStats:
+*   Writes the origin connection counters to out, read without locking.
+*/
+void printUpstreamStats(FILE* out)
+{
+    fprintf(out, "Upstream connects: %lu (%lu failed, %lu through a later "
+            "address), %lu attempts (%lu failed), %lu addresses tried last\n",
+            connects, connects_failed, fallbacks, attempts, attempts_failed,
+            demoted);
+}
@@ -0,0 +1,37 @@
+/* Connections to origin servers. The origin's name is resolved with
+   getaddrinfo, which knows IPv6 and is thread safe, and its addresses
+   are raced Happy Eyeballs style (RFC 8305): families alternate, a
+   new attempt starts every UPSTREAM_STAGGER_MS or as soon as one
+   fails, and the first connection made wins while the others are
+   dropped. Each attempt gets the connect timeout (timeout.h). An
+   address that failed is remembered for UPSTREAM_FAIL_MEMORY seconds
+   and tried after the others meanwhile. A second connection to the
+   same origin, as for a hedged request (hedge.h), goes to another
+   address than the first if there is one */
+
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <stdio.h>
+
+/* What upstream_connect returns when host can't be resolved */
+#define UPSTREAM_DNS_ERROR -2
+
+/* Most addresses of one name that are tried */
+#define UPSTREAM_MAX_ADDRS 16
+
+/* Milliseconds between the starts of two attempts, RFC 8305's
+   Connection Attempt Delay */
+#define UPSTREAM_STAGGER_MS 250
+
+/* Seconds a failed address stays at the back of the line, and the
+   number of addresses remembered */
+#define UPSTREAM_FAIL_MEMORY 30
+#define UPSTREAM_FAIL_SLOTS 256
+
+void upstream_init();
+int upstream_connect(const char* host, int port);
+int upstream_connect_other(const char* host, int port, int fd);
+void printUpstreamStats(FILE* out);
+
+#endif /* __UPSTREAM_H__ */
@@ -0,0 +1,174 @@
+/*
+* Worker processes. See worker.h.
+*/
+#include <sys/prctl.h>
+#include "worker.h"
+#include "shmcache.h"
+#include "csapp.h"
+
+
+#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+int worker_count = 0;
+
+/* The workers and when they were forked, in the first process */
+static pid_t workers[WORKER_MAX];
+static time_t started[WORKER_MAX];
+
+/* What this worker is, -1 in the first process, and how many workers
+   had been forked again before it */
+static int self = -1;
+static unsigned long respawned = 0;
+
+/* What SIGUSR1 did before the first process took it over */
+static void (*usr1)(int) = SIG_DFL;
+
+
+/* worker_parse:
+*   Sets the workers and the size of the shared cache from "n,mb"; mb
+*   may be left out. Returns 0, or -1 if spec is malformed.
+*/
+int worker_parse(const char* spec)
+{
+    char* end;
+    long n = strtol(spec, &end, 10);
+    long mb = SHM_CACHE_MB;
+
+    if(end == spec || n < 1 || n > WORKER_MAX)
+        return -1;
+    if(*end == ',')
+    {
+        spec = end + 1;
+        mb = strtol(spec, &end, 10);
+        if(end == spec || mb < 1 || mb > 65536)
+            return -1;
+    }
+    if(*end != '\0')
+        return -1;
+
+    worker_count = n;
+    shm_cache_mb = mb;
+    return 0;
+}
+
+/* forward:
+*   Passes a signal the first process got on to the workers.
+*/
+static void forward(int sig)
+{
+    int i;
+
+    for(i = 0; i < worker_count; i++)
+    {
+        if(workers[i] > 0)
+            kill(workers[i], sig);
+    }
+}
+
+/* spawn:
+*   Forks worker i. Returns 1 in the new worker, 0 in the first
+*   process.
+*/
+static int spawn(int i)
+{
+    pid_t parent = getpid();
+    pid_t pid;
+
+    //what is buffered would be written by the worker as well
+    fflush(stdout);
+    if((pid = fork()) < 0)
+    {
+        fprintf(stderr, "can't fork worker %d: %s\n", i, strerror(errno));
+        workers[i] = 0;
+        return 0;
+    }
+    if(pid == 0)
+    {
+        self = i;
+        signal(SIGUSR1, usr1);
+        //workers go with the first process
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if(getppid() != parent)
+            exit(0);
+        return 1;
+    }
+
+    workers[i] = pid;
+    started[i] = time(NULL);
+    return 0;
+}
+
+/* worker_start:
+*   Opens the shared cache and forks the workers, then looks after them
+*   for good. Returns only in the workers, which go on to serve.
+*/
+void worker_start()
+{
+    int i, status;
+    pid_t pid;
+
+    if(shm_cache_open() < 0)
+    {
+        fprintf(stderr, "can't map a shared cache of %d MB\n", shm_cache_mb);
+        exit(1);
+    }
+
+    usr1 = signal(SIGUSR1, forward);
+    for(i = 0; i < worker_count; i++)
+    {
+        if(spawn(i))
+            return;
+    }
+
+    while(1)
+    {
+        if((pid = waitpid(-1, &status, 0)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            //a fork failed and left nobody to wait for
+            sleep(WORKER_BACKOFF);
+        }
+
+        for(i = 0; i < worker_count; i++)
+        {
+            if(pid > 0 && workers[i] != pid)
+                continue;
+            if(pid < 0 && workers[i] != 0)
+                continue;
+
+            if(pid > 0)
+            {
+                if(WIFSIGNALED(status))
+                    printf("Worker %d (pid %d) killed by signal %d\n", i,
+                           (int)pid, WTERMSIG(status));
+                else
+                    printf("Worker %d (pid %d) exited with %d\n", i,
+                           (int)pid, WEXITSTATUS(status));
+                if(time(NULL) - started[i] < WORKER_BACKOFF)
+                    sleep(WORKER_BACKOFF);
+            }
+            respawned++;
+            if(spawn(i))
+                return;
+        }
+    }
+}
+
+/* printWorkerStats:
+*   Writes which worker this is to out.
+*/
+void printWorkerStats(FILE* out)
+{
+    if(worker_count == 0)
+        fprintf(out, "Workers: off\n");
+    else
+        fprintf(out, "Workers: worker %d of %d (pid %d), %lu forked again "
+                "before it\n", self, worker_count, (int)getpid(), respawned);
+}
@@ -0,0 +1,33 @@
+/* Worker processes. With -P n,mb, the proxy opens its listening
+   socket and a shared cache of mb megabytes (see shmcache.h), then
+   forks n workers that each accept connections on that socket and
+   serve them with threads, as a single proxy would. The first process
+   only looks after them: a worker that dies, even halfway through a
+   request, takes nothing but its own connections with it and is
+   forked again, WORKER_BACKOFF seconds later if it lived less than
+   that, while the shared cache carries on. SIGUSR1 sent to the first
+   process has each worker write its statistics.
+   Each worker has its own heap, its own cache in front of the shared
+   one and its own large object store, and the limits of -L, -O and -M
+   and the hedging budget of -H hold per worker. A request that
+   invalidates a URL clears it from the shared cache and its own
+   worker's, but other workers may still answer it from their own
+   until it is evicted there */
+
+#ifndef __WORKER_H__
+#define __WORKER_H__
+
+#include <stdio.h>
+
+/* Most workers, and the seconds between quick deaths of one */
+#define WORKER_MAX 64
+#define WORKER_BACKOFF 1
+
+/* Workers to fork, 0 to serve from this process alone */
+extern int worker_count;
+
+int worker_parse(const char* spec);
+void worker_start();
+void printWorkerStats(FILE* out);
+
+#endif /* __WORKER_H__ */